@@ -0,0 +1,516 @@
+/*
+ * loadgen.c - multi-threaded load generator, reports throughput and latency as JSON
+ * usage: loadgen --target HOST:PORT [--proxy HOST:PORT] [--connections N]
+ *                [--duration SECONDS] [--rate RPS] [--keys N] [--zipf S]
+ *                [--path PREFIX] [--query STRING] [--idle N] [--warmup]
+ *
+ * Each connection has a thread of its own and sends GETs for PREFIX<key> on
+ * target, through the proxy in absolute form when one is given. It is closed
+ * loop by default, a connection sends its next request once the last response
+ * is in. With --rate the connections share a fixed schedule (open loop) and
+ * latency counts from when a request was due, so a stall is not hidden by
+ * the requests it kept from being sent. Keys are uniform or Zipf distributed
+ * over --keys objects, 0 makes every request a new object. --idle holds that
+ * many more connections open without using them, --warmup fetches every key
+ * once before the clock starts
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+
+#define RECV_BUF (1<<16)
+#define REQUEST_MAX 4096
+#define IO_TIMEOUT 10      /* seconds a response may stall before it counts as an error */
+#define HIST_SUB_BITS 3    /* latency histogram buckets per power of two, log2 */
+#define HIST_MAX_BITS 40   /* microseconds, longer latencies land in the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct loadgen_config{
+    char * target;                  /* host:port named in requests */
+    char * connect_to;              /* host:port connected to, the proxy or target */
+    int via_proxy;
+    int connections;
+    double duration;
+    double rate;                    /* requests per second over all connections, 0 for closed loop */
+    long keys;                      /* 0 for a new object every request */
+    double zipf;                    /* skew, 0 for uniform */
+    char * path;
+    char * query;
+    int idle;
+    int warmup;
+};
+
+/*log-linear histogram of microseconds, the same buckets as the proxy's*/
+struct histogram{
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long sum;
+    unsigned long max;
+};
+
+struct client{
+    pthread_t tid;
+    int id;
+    int fd;
+    uint64_t rng;
+    char * buf;
+    size_t len, off;                /* received bytes not yet consumed */
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long bytes;            /* response bodies */
+    struct histogram hist;
+};
+
+struct loadgen_config config = {NULL, NULL, 0, 16, 10, 0, 1000, 0, "/obj/", NULL, 0, 0};
+struct sockaddr_storage server_addr;
+socklen_t server_addr_len;
+double * zipf_cdf;
+atomic_ulong unique_keys;
+unsigned long run_id;               /* keeps unique keys from repeating across runs */
+double start_time;
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when){
+    struct timespec ts;
+    ts.tv_sec = (time_t)when;
+    ts.tv_nsec = (long)((when - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*xorshift64*, per connection so threads do not share state*/
+static uint64_t next_random(uint64_t * state){
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static unsigned histogram_index(uint64_t v){
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t histogram_floor(unsigned idx){
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+}
+
+static void histogram_record(struct histogram * h, uint64_t v){
+    h->counts[histogram_index(v)]++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*value at quantile q, the top of the bucket it falls in*/
+static uint64_t histogram_quantile(struct histogram * h, unsigned long count, double q){
+    unsigned long rank = q * count + 0.999999, seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t top = histogram_floor(i + 1) - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*key for the next request*/
+static unsigned long pick_key(struct client * c){
+    if (config.keys == 0)
+        return atomic_fetch_add(&unique_keys, 1);
+    if (!zipf_cdf)
+        return next_random(&c->rng) % config.keys;
+    double u = (next_random(&c->rng) >> 11) * (1.0 / 9007199254740992.0);
+    long lo = 0, hi = config.keys - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void zipf_init(void){
+    double total = 0;
+    zipf_cdf = malloc(config.keys * sizeof(double));
+    for (long k = 0; k < config.keys; k++)
+        zipf_cdf[k] = total += 1.0 / pow(k + 1, config.zipf);
+    for (long k = 0; k < config.keys; k++)
+        zipf_cdf[k] /= total;
+}
+
+static int resolve(char * hostport){
+    char host[256], * colon = strrchr(hostport, ':');
+    if (!colon || colon - hostport >= (long)sizeof(host))
+        return -1;
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - hostport), hostport);
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, * res;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int open_connection(void){
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    struct timeval tv = {IO_TIMEOUT, 0};
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void client_disconnect(struct client * c){
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->len = c->off = 0;
+}
+
+/*receive more bytes after the unconsumed ones, 0 once the server closes*/
+static ssize_t client_recv(struct client * c){
+    if (c->off == c->len)
+        c->off = c->len = 0;
+    else if (c->len == RECV_BUF) {
+        memmove(c->buf, c->buf + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off = 0;
+    }
+    ssize_t n;
+    while ((n = recv(c->fd, c->buf + c->len, RECV_BUF - c->len, 0)) < 0 && errno == EINTR)
+        ;
+    if (n > 0)
+        c->len += n;
+    return n;
+}
+
+/*a line of the response, NUL terminated in place, NULL on error*/
+static char * client_line(struct client * c){
+    char * eol;
+    while (!(eol = memmem(c->buf + c->off, c->len - c->off, "\r\n", 2))) {
+        if (c->len - c->off == RECV_BUF || client_recv(c) <= 0)
+            return NULL;
+    }
+    char * line = c->buf + c->off;
+    *eol = 0;
+    c->off = eol + 2 - c->buf;
+    return line;
+}
+
+/*consume n body bytes, -1 if the connection ends first*/
+static int client_skip(struct client * c, unsigned long n){
+    while (n) {
+        if (c->off == c->len && client_recv(c) <= 0)
+            return -1;
+        size_t have = c->len - c->off < n ? c->len - c->off : n;
+        c->off += have;
+        n -= have;
+    }
+    return 0;
+}
+
+/*
+ * read_response - read a whole response, body included
+ * Returns the body length, or -1 if the response was an error or cut short.
+ * keepalive is cleared if the connection cannot be used again
+ */
+static long read_response(struct client * c, int * keepalive){
+    char * line = client_line(c);
+    int status;
+    if (!line || sscanf(line, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+    long length = -1;
+    int chunked = 0;
+    *keepalive = strncmp(line, "HTTP/1.1", 8) == 0;
+    while ((line = client_line(c)) && *line) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atol(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked"))
+            chunked = 1;
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+            *keepalive = !strcasestr(line, "close");
+    }
+    if (!line)
+        return -1;
+
+    long body = 0;
+    if (status == 304 || status == 204)
+        length = 0;
+    if (chunked) {
+        for (;;) {
+            if (!(line = client_line(c)))
+                return -1;
+            long size = strtol(line, NULL, 16);
+            if (size == 0)
+                break;
+            if (client_skip(c, size) < 0 || !client_line(c))
+                return -1;
+            body += size;
+        }
+        //trailer fields end with a blank line
+        while ((line = client_line(c)) && *line)
+            ;
+        if (!line)
+            return -1;
+    }
+    else if (length >= 0) {
+        if (client_skip(c, length) < 0)
+            return -1;
+        body = length;
+    }
+    else {
+        //delimited by the end of the connection
+        *keepalive = 0;
+        c->off = c->len;
+        ssize_t n;
+        while ((n = client_recv(c)) > 0) {
+            body += n;
+            c->off = c->len;
+        }
+        if (n < 0)
+            return -1;
+    }
+    return status >= 200 && status < 400 ? body : -1;
+}
+
+/*send a GET for key and read its response, returns the body length or -1*/
+static long fetch(struct client * c, unsigned long key){
+    char req[REQUEST_MAX], name[48];
+    int keepalive, len;
+    if (c->fd < 0 && (c->fd = open_connection()) < 0)
+        return -1;
+    if (config.keys)
+        snprintf(name, sizeof(name), "%lu", key);
+    else
+        snprintf(name, sizeof(name), "u%lu-%lu", run_id, key);
+    len = snprintf(req, sizeof(req), "GET %s%s%s%s%s%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                   config.via_proxy ? "http://" : "", config.via_proxy ? config.target : "",
+                   config.path, name, config.query ? "?" : "", config.query ? config.query : "",
+                   config.target);
+    if (send(c->fd, req, len, MSG_NOSIGNAL) != len) {
+        client_disconnect(c);
+        return -1;
+    }
+    long body = read_response(c, &keepalive);
+    if (body < 0 || !keepalive)
+        client_disconnect(c);
+    return body;
+}
+
+static void * client_thread(void * vargp){
+    struct client * c = vargp;
+    double deadline = start_time + config.duration;
+    //open loop, each connection takes every connections'th slot of the schedule
+    double interval = config.rate ? config.connections / config.rate : 0;
+    double due = start_time + (config.rate ? c->id / config.rate : 0);
+    double now;
+
+    while ((now = now_sec()) < deadline) {
+        double began = now;
+        if (config.rate) {
+            if (due >= deadline)
+                break;
+            if (due > now)
+                sleep_until(due);
+            began = due;
+            due += interval;
+        }
+        long body = fetch(c, pick_key(c));
+        if (body < 0) {
+            c->errors++;
+            continue;
+        }
+        c->requests++;
+        c->bytes += body;
+        histogram_record(&c->hist, (now_sec() - began) * 1e6);
+    }
+    client_disconnect(c);
+    return NULL;
+}
+
+static struct option long_options[] = {
+    {"target", required_argument, NULL, 't'},
+    {"proxy", required_argument, NULL, 'x'},
+    {"connections", required_argument, NULL, 'c'},
+    {"duration", required_argument, NULL, 'd'},
+    {"rate", required_argument, NULL, 'r'},
+    {"keys", required_argument, NULL, 'k'},
+    {"zipf", required_argument, NULL, 'z'},
+    {"path", required_argument, NULL, 'p'},
+    {"query", required_argument, NULL, 'q'},
+    {"idle", required_argument, NULL, 'i'},
+    {"warmup", no_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+    int opt, bad = 0;
+    while ((opt = getopt_long(argc, argv, "t:x:c:d:r:k:z:p:q:i:w", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                config.target = optarg;
+                break;
+            case 'x':
+                config.connect_to = optarg;
+                config.via_proxy = 1;
+                break;
+            case 'c':
+                config.connections = atoi(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'r':
+                config.rate = atof(optarg);
+                break;
+            case 'k':
+                config.keys = atol(optarg);
+                break;
+            case 'z':
+                config.zipf = atof(optarg);
+                break;
+            case 'p':
+                config.path = optarg;
+                break;
+            case 'q':
+                config.query = optarg;
+                break;
+            case 'i':
+                config.idle = atoi(optarg);
+                break;
+            case 'w':
+                config.warmup = 1;
+                break;
+            default:
+                bad = 1;
+        }
+    }
+    if (!config.connect_to)
+        config.connect_to = config.target;
+    if (bad || !config.target || config.connections < 1 || config.duration <= 0 || config.rate < 0 ||
+        config.keys < 0 || config.zipf < 0 || config.idle < 0 || resolve(config.connect_to) < 0) {
+        fprintf(stderr, "usage: %s --target HOST:PORT [--proxy HOST:PORT] [--connections N] "
+                        "[--duration SECONDS] [--rate RPS] [--keys N] [--zipf S] [--path PREFIX] "
+                        "[--query STRING] [--idle N] [--warmup]\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (config.keys && config.zipf > 0)
+        zipf_init();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    run_id = ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+
+    struct client * clients = calloc(config.connections, sizeof(struct client));
+    for (int i = 0; i < config.connections; i++) {
+        clients[i].id = i;
+        clients[i].fd = -1;
+        clients[i].rng = run_id * 0x9e3779b97f4a7c15ULL + i + 1;
+        clients[i].buf = malloc(RECV_BUF);
+    }
+
+    //fetch every key once so the run starts from a warm cache
+    unsigned long warmed = 0;
+    if (config.warmup && config.keys) {
+        for (long k = 0; k < config.keys; k++)
+            warmed += fetch(&clients[0], k) >= 0;
+        client_disconnect(&clients[0]);
+    }
+
+    int idle_open = 0;
+    int * idle = malloc((config.idle + 1) * sizeof(int));
+    for (int i = 0; i < config.idle; i++)
+        if ((idle[idle_open] = open_connection()) >= 0)
+            idle_open++;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    start_time = now_sec();
+    for (int i = 0; i < config.connections; i++)
+        pthread_create(&clients[i].tid, &attr, client_thread, &clients[i]);
+
+    struct histogram * hist = calloc(1, sizeof(struct histogram));
+    unsigned long requests = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < config.connections; i++) {
+        struct client * c = &clients[i];
+        pthread_join(c->tid, NULL);
+        requests += c->requests;
+        errors += c->errors;
+        bytes += c->bytes;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            hist->counts[b] += c->hist.counts[b];
+        hist->sum += c->hist.sum;
+        if (c->hist.max > hist->max)
+            hist->max = c->hist.max;
+    }
+    double elapsed = now_sec() - start_time;
+    for (int i = 0; i < idle_open; i++)
+        close(idle[i]);
+
+    printf("{\"mode\":\"%s\",\"connections\":%d,\"rate\":%.1f,\"keys\":%ld,\"zipf\":%.3f,"
+           "\"idle\":%d,\"warmed\":%lu,\"duration\":%.3f,\"requests\":%lu,\"errors\":%lu,"
+           "\"rps\":%.1f,\"bytes\":%lu,\"throughput_mbps\":%.2f,",
+           config.rate ? "open" : "closed", config.connections, config.rate, config.keys, config.zipf,
+           idle_open, warmed, elapsed, requests, errors, requests / elapsed, bytes,
+           bytes * 8 / elapsed / 1e6);
+    printf("\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+           requests ? (double)hist->sum / requests : 0.0,
+           histogram_quantile(hist, requests, 0.5), histogram_quantile(hist, requests, 0.9),
+           histogram_quantile(hist, requests, 0.99), histogram_quantile(hist, requests, 0.999),
+           hist->max);
+    fprintf(stderr, "%lu requests in %.2f s, %.0f req/s, %lu errors, p50 %lu us p99 %lu us p999 %lu us\n",
+            requests, elapsed, requests / elapsed, errors, histogram_quantile(hist, requests, 0.5),
+            histogram_quantile(hist, requests, 0.99), histogram_quantile(hist, requests, 0.999));
+    return 0;
+}
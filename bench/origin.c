@@ -0,0 +1,302 @@
+/*
+ * origin.c - stand-in end server for benchmarks, serves synthetic objects
+ * usage: origin <port> [--size BYTES|MIN-MAX] [--size-dist fixed|uniform|pareto]
+ *               [--latency MS] [--jitter MS] [--max-age SECONDS|-1]
+ *
+ * Every GET is answered 200 with a body whose size is drawn for its path,
+ * so a path always names the same object. The query parameters size=,
+ * latency= and max_age= override the options for one request. A max age
+ * of -1 sends no-store. Objects carry an ETag and a matching If-None-Match
+ * gets a 304. Each connection is served by its own thread with keep-alive
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+
+#define HEAD_MAX 16384     /* longest request head */
+#define BODY_CHUNK (1<<16) /* bytes of the fill pattern sent per write */
+#define PARETO_ALPHA 1.2   /* tail index of the pareto size distribution */
+
+enum size_dist{
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_PARETO             /* bounded, most objects small and a few near the max */
+};
+
+struct origin_config{
+    long min_size, max_size;
+    enum size_dist dist;
+    long latency_ms;
+    long jitter_ms;         /* up to this much more, drawn per request */
+    long max_age;           /* -1 for no-store */
+};
+
+struct origin_config config = {4096, 4096, SIZE_FIXED, 0, 0, 3600};
+static char body_pattern[BODY_CHUNK];
+static const char last_modified[] = "Mon, 01 Jan 2024 00:00:00 GMT";
+
+static uint64_t fnv_hash(const char * s, size_t len){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/*uniform in [0, 1) from a 64 bit hash*/
+static double unit(uint64_t h){
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*size of the object at path, the same every time it is asked for*/
+static long object_size(uint64_t h){
+    double u = unit(h);
+    double lo = config.min_size, hi = config.max_size;
+    switch (config.dist) {
+        case SIZE_UNIFORM:
+            return lo + u * (hi - lo + 1);
+        case SIZE_PARETO: {
+            //inverse CDF of the pareto distribution bounded to [lo, hi]
+            double la = pow(lo, PARETO_ALPHA), ha = pow(hi, PARETO_ALPHA);
+            return pow(-(u * ha - u * la - ha) / (ha * la), -1.0 / PARETO_ALPHA);
+        }
+        default:
+            return config.min_size;
+    }
+}
+
+/*value of query parameter name in the request target, -2 if absent*/
+static long query_param(const char * target, size_t len, const char * name){
+    const char * q = memchr(target, '?', len);
+    size_t nlen = strlen(name);
+    while (q && q < target + len) {
+        q++;
+        if ((size_t)(target + len - q) > nlen && strncmp(q, name, nlen) == 0 && q[nlen] == '=')
+            return atol(q + nlen + 1);
+        q = memchr(q, '&', target + len - q);
+    }
+    return -2;
+}
+
+static int send_all(int fd, const char * buf, size_t len){
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void sleep_ms(double ms){
+    struct timespec ts = {(time_t)(ms / 1000), (long)(fmod(ms, 1000) * 1e6)};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ * respond - answer the request head in req, NUL terminated
+ * Returns -1 if the connection is to be closed
+ */
+static int respond(int fd, char * req, size_t len){
+    char * sp = memchr(req, ' ', len);
+    if (!sp)
+        return -1;
+    const char * target = sp + 1;
+    char * end = memchr(target, ' ', req + len - target);
+    if (!end)
+        return -1;
+    size_t tlen = end - target;
+    //absolute-form targets name the same object as origin-form ones
+    if (tlen > 7 && strncmp(target, "http://", 7) == 0) {
+        const char * path = memchr(target + 7, '/', tlen - 7);
+        if (path) {
+            tlen -= path - target;
+            target = path;
+        }
+        else {
+            target = "/";
+            tlen = 1;
+        }
+    }
+    int is_get = strncmp(req, "GET ", 4) == 0;
+    int keepalive = !strcasestr(req, "\r\nConnection: close");
+
+    const char * query = memchr(target, '?', tlen);
+    uint64_t h = fnv_hash(target, query ? (size_t)(query - target) : tlen);
+    long size = query_param(target, tlen, "size");
+    long latency = query_param(target, tlen, "latency");
+    long max_age = query_param(target, tlen, "max_age");
+    if (size < 0)
+        size = object_size(h);
+    if (latency < 0)
+        latency = config.latency_ms;
+    if (max_age == -2)
+        max_age = config.max_age;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double delay = latency + unit(h ^ now.tv_nsec) * config.jitter_ms;
+    if (delay > 0)
+        sleep_ms(delay);
+
+    char etag[48], head[512];
+    snprintf(etag, sizeof(etag), "\"%016llx-%ld\"", (unsigned long long)h, size);
+    char * inm = strcasestr(req, "\r\nIf-None-Match:");
+    int not_modified = is_get && inm && strstr(inm, etag);
+    int hlen = snprintf(head, sizeof(head),
+                        "HTTP/1.1 %s\r\nContent-Length: %ld\r\nContent-Type: application/octet-stream\r\n"
+                        "ETag: %s\r\nLast-Modified: %s\r\n",
+                        !is_get ? "405 Method Not Allowed" : not_modified ? "304 Not Modified" : "200 OK",
+                        is_get && !not_modified ? size : 0, etag, last_modified);
+    if (max_age >= 0)
+        hlen += snprintf(head + hlen, sizeof(head) - hlen, "Cache-Control: max-age=%ld\r\n", max_age);
+    else
+        hlen += snprintf(head + hlen, sizeof(head) - hlen, "Cache-Control: no-store\r\n");
+    hlen += snprintf(head + hlen, sizeof(head) - hlen, "Connection: %s\r\n\r\n",
+                     keepalive ? "keep-alive" : "close");
+    if (send_all(fd, head, hlen) < 0)
+        return -1;
+    if (is_get && !not_modified) {
+        for (long left = size; left > 0; left -= BODY_CHUNK) {
+            if (send_all(fd, body_pattern, left < BODY_CHUNK ? left : BODY_CHUNK) < 0)
+                return -1;
+        }
+    }
+    return keepalive && is_get ? 0 : -1;
+}
+
+/*serve requests on one connection until the client closes it*/
+static void * serve(void * vargp){
+    int fd = (int)(intptr_t)vargp;
+    char * buf = malloc(HEAD_MAX + 1);
+    size_t len = 0;
+    for (;;) {
+        buf[len] = 0;
+        char * eoh = strstr(buf, "\r\n\r\n");
+        if (eoh) {
+            size_t head_len = eoh + 4 - buf;
+            char next = buf[head_len];
+            buf[head_len] = 0;
+            if (respond(fd, buf, head_len) < 0)
+                break;
+            buf[head_len] = next;
+            memmove(buf, buf + head_len, len - head_len);
+            len -= head_len;
+            continue;
+        }
+        if (len == HEAD_MAX)
+            break;
+        ssize_t n = recv(fd, buf + len, HEAD_MAX - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static struct option long_options[] = {
+    {"size", required_argument, NULL, 's'},
+    {"size-dist", required_argument, NULL, 'd'},
+    {"latency", required_argument, NULL, 'l'},
+    {"jitter", required_argument, NULL, 'j'},
+    {"max-age", required_argument, NULL, 'a'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+    int opt, bad = 0;
+    while ((opt = getopt_long(argc, argv, "s:d:l:j:a:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                if (sscanf(optarg, "%ld-%ld", &config.min_size, &config.max_size) == 1)
+                    config.max_size = config.min_size;
+                break;
+            case 'd':
+                if (strcmp(optarg, "fixed") == 0)
+                    config.dist = SIZE_FIXED;
+                else if (strcmp(optarg, "uniform") == 0)
+                    config.dist = SIZE_UNIFORM;
+                else if (strcmp(optarg, "pareto") == 0)
+                    config.dist = SIZE_PARETO;
+                else
+                    bad = 1;
+                break;
+            case 'l':
+                config.latency_ms = atol(optarg);
+                break;
+            case 'j':
+                config.jitter_ms = atol(optarg);
+                break;
+            case 'a':
+                config.max_age = atol(optarg);
+                break;
+            default:
+                bad = 1;
+        }
+    }
+    if (bad || argc - optind != 1 || config.min_size < 0 || config.max_size < config.min_size ||
+        (config.dist == SIZE_PARETO && config.min_size < 1) || config.latency_ms < 0 ||
+        config.jitter_ms < 0 || config.max_age < -1) {
+        fprintf(stderr, "usage: %s <port> [--size BYTES|MIN-MAX] [--size-dist fixed|uniform|pareto] "
+                        "[--latency MS] [--jitter MS] [--max-age SECONDS|-1]\n", argv[0]);
+        exit(1);
+    }
+    for (int i = 0; i < BODY_CHUNK; i++)
+        body_pattern[i] = 'a' + i % 26;
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0), optval = 1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY),
+                               .sin_port = htons(atoi(argv[optind]))};
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 1024) < 0) {
+        perror("origin");
+        exit(1);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    for (;;) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, serve, (void *)(intptr_t)fd) != 0)
+            close(fd);
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * parse_bench.c - measure request parse throughput of http_parse_request
+ * usage: parse_bench [iterations]
+ */
+
+#define main proxy_main
+#include "../httpechosrv.c"
+#undef main
+
+static const char browser_request[] =
+    "GET http://www.example.com/static/js/app.3f9c1e.js?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=8c1f0e2a9b7d4c3e; theme=dark; _ga=GA1.2.1234567890.1700000000\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*parse buf iterations times, handing it over chunk bytes at a time*/
+static void run(const char * name, char * buf, size_t len, size_t chunk, long iterations){
+    struct http_header headers[MAX_HEADERS];
+    struct http_request req = {.headers = headers};
+    long fields = 0;
+
+    double start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        http_request_reset(&req);
+        size_t have = chunk < len ? chunk : len;
+        while (http_parse_request(&req, buf, have) == 0)
+            have = have + chunk < len ? have + chunk : len;
+        fields += req.nheaders;
+    }
+    double elapsed = now_sec() - start;
+    if (req.state != REQ_DONE || fields != iterations * req.nheaders) {
+        fprintf(stderr, "%s: parse failed\n", name);
+        exit(1);
+    }
+    printf("%-24s %6zu bytes  %7.3f GB/s  %8.1f ns/request\n", name, len,
+           len * (double)iterations / elapsed / 1e9, elapsed / iterations * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    char buf[MAX_HEAD_SIZE];
+    size_t len = strlen(browser_request);
+
+    memcpy(buf, browser_request, len);
+    run("browser request", buf, len, len, iterations);
+    run("browser request, 64B", buf, len, 64, iterations);
+    run("browser request, 1B", buf, len, 1, iterations / 10);
+
+    //a long query string dominates the request line
+    len = sprintf(buf, "GET http://www.example.com/search?q=");
+    memset(buf + len, 'a', 6000);
+    len += 6000;
+    len += sprintf(buf + len, " HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+    run("long URI", buf, len, len, iterations / 4);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# run_bench.sh - run the standard load scenarios against the proxy and write
+# the results as JSON, one object per scenario with the load generator's
+# numbers and the proxy's own /__proxy/stats at the end of the run
+# usage: bench/run_bench.sh [BIN_DIR] [RESULTS_JSON]
+#
+# BIN_DIR holds proxy (or proxyserver), origin and loadgen, RESULTS_JSON
+# defaults to bench-results.json. Each scenario gets a fresh origin, proxy
+# and Cache/ directory. Tunable from the environment:
+#   SCENARIOS    subset to run (all_hit all_miss zipf large idle)
+#   DURATION     seconds per scenario (10)
+#   CONNECTIONS  load generator connections (32)
+#   RATE         requests per second of the open loop zipf scenario (2000)
+#   IDLE         idle connections held open in the idle scenario (1000)
+#   PROXY_ARGS   extra proxy options, e.g. "--mode pool"
+#   ORIGIN_PORT, PROXY_PORT (18080, 18081)
+
+set -u
+BIN=${1:-build}
+OUT=${2:-bench-results.json}
+SCENARIOS=${SCENARIOS:-all_hit all_miss zipf large idle}
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-32}
+RATE=${RATE:-2000}
+IDLE=${IDLE:-1000}
+PROXY_ARGS=${PROXY_ARGS:-}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+PROXY_PORT=${PROXY_PORT:-18081}
+
+PROXY=$BIN/proxy
+[ -x "$PROXY" ] || PROXY=$BIN/proxyserver
+for tool in "$PROXY" "$BIN/origin" "$BIN/loadgen"; do
+    if [ ! -x "$tool" ]; then
+        echo "run_bench: $tool not built" >&2
+        exit 1
+    fi
+done
+PROXY=$(cd "$(dirname "$PROXY")" && pwd)/$(basename "$PROXY")
+
+WORK=$(mktemp -d /tmp/proxybench.XXXXXX)
+ORIGIN_PID=
+PROXY_PID=
+stop(){
+    [ -n "$PROXY_PID" ] && kill $PROXY_PID 2>/dev/null
+    [ -n "$ORIGIN_PID" ] && kill $ORIGIN_PID 2>/dev/null
+    wait 2>/dev/null
+    ORIGIN_PID=
+    PROXY_PID=
+}
+trap 'stop; rm -rf "$WORK"' EXIT
+
+wait_port(){
+    for i in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    echo "run_bench: nothing listening on port $1" >&2
+    return 1
+}
+
+#the proxy's metrics, the body of an HTTP/1.0 response that ends with the connection
+proxy_stats(){
+    exec 3<>/dev/tcp/127.0.0.1/$PROXY_PORT || { echo null; return; }
+    printf 'GET /__proxy/stats?format=json HTTP/1.0\r\nHost: localhost\r\n\r\n' >&3
+    sed '1,/^\r$/d' <&3
+    exec 3<&-
+}
+
+# scenario NAME ORIGIN_ARGS PROXY_ARGS LOADGEN_ARGS
+RESULTS=
+scenario(){
+    local name=$1
+    case " $SCENARIOS " in
+        *" $name "*) ;;
+        *) return ;;
+    esac
+    echo "== $name" >&2
+    "$BIN/origin" $ORIGIN_PORT $2 > "$WORK/origin.log" 2>&1 &
+    ORIGIN_PID=$!
+    mkdir -p "$WORK/$name/Cache"
+    (cd "$WORK/$name" && exec "$PROXY" $PROXY_PORT 600 $3 $PROXY_ARGS > /dev/null 2> proxy.log) &
+    PROXY_PID=$!
+    if wait_port $ORIGIN_PORT && wait_port $PROXY_PORT; then
+        local load
+        load=$("$BIN/loadgen" --target 127.0.0.1:$ORIGIN_PORT --proxy 127.0.0.1:$PROXY_PORT \
+               --duration $DURATION $4)
+        RESULTS="$RESULTS${RESULTS:+,}\"$name\":{\"load\":${load:-null},\"proxy\":$(proxy_stats)}"
+    fi
+    stop
+}
+
+scenario all_hit "--size 4096" "" \
+         "--connections $CONNECTIONS --keys 100 --warmup"
+scenario all_miss "--size 4096" "" \
+         "--connections $CONNECTIONS --keys 0"
+scenario zipf "--size 1024-262144 --size-dist pareto --latency 2 --jitter 8" \
+         "--cache-size 67108864 --max-obj-size 1048576" \
+         "--connections $CONNECTIONS --rate $RATE --keys 100000 --zipf 0.99"
+scenario large "--size 4194304" "--cache-size 268435456 --max-obj-size 8388608" \
+         "--connections 8 --keys 16 --warmup"
+scenario idle "--size 4096" "" \
+         "--connections $CONNECTIONS --keys 100 --warmup --idle $IDLE"
+
+COMMIT=$(git -C "$(dirname "$0")" rev-parse --short HEAD 2>/dev/null || echo unknown)
+printf '{"commit":"%s","date":"%s","cpus":%s,"duration":%s,"proxy_args":"%s","scenarios":{%s}}\n' \
+       "$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(nproc)" "$DURATION" "$PROXY_ARGS" "$RESULTS" > "$OUT"
+echo "results in $OUT" >&2
@@ -1,21 +1,44 @@
 /*
- * tcpechosrv.c - A concurrent TCP echo server using threads
+ * httpechosrv.c - A concurrent HTTP proxy server driven by epoll event loops
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>      /* for fgets */
 #include <strings.h>     /* for bzero, bcopy */
 #include <unistd.h>      /* for read, write */
 #include <sys/socket.h>  /* for socket use */
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <dirent.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <signal.h>
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <assert.h>
 #include <openssl/md5.h>
+#include <zlib.h>
 
 
 
@@ -25,514 +48,8669 @@
 #define LISTENQ  1024  /* second argument to listen() */
 #define MAX_CACHE_SIZE 2098000
 #define MAX_OBJ_SIZE 104900
+#define RELAYBUF (1<<14) /* per connection relay buffer */
+#define MAX_HEAD_SIZE 16384 /* default limit on a request line plus headers */
+#define MAX_URI_SIZE 8192  /* default limit on a request target */
+#define MAX_HEADERS 100    /* default limit on request header fields */
+#define MAX_METHOD_SIZE 16
+#define MAX_HOST 255       /* longest DNS name */
+#define MAX_EVENTS 256   /* events handled per epoll_wait */
+#define IDLE_TIMEOUT 60  /* seconds before an idle connection is dropped */
+#define CLIENT_IDLE_TIMEOUT 15 /* default seconds a keep-alive client may sit between requests */
+#define MAX_REQUESTS 100 /* default requests served on one client connection */
+#define TUNNEL_IDLE_TIMEOUT 300 /* default seconds a CONNECT tunnel may carry nothing */
+#define CHUNK_ROOM 16    /* room left ahead of relayed body bytes for a chunk size line */
+#define RELAY_PIPE_SIZE (1<<18) /* capacity asked for the splice relay pipes */
+#define RELAY_PIPES_KEPT 16 /* idle splice relay pipe pairs a thread keeps */
+#define QUEUE_DEPTH 1024 /* default per worker queue depth in pool mode */
+#define CACHE_SHARDS 64  /* independently locked slices of the web cache index */
+#define SHARD_SLOTS 64   /* initial open addressing slots per shard */
+#define SLRU_PROTECTED 0.8 /* share of the cache budget for SLRU protected */
+#define MMAP_MAX_SIZE (1<<16) /* hot objects up to this size are served from a mapping */
+#define MMAP_HOT_HITS 8    /* hits before an object counts as hot */
+#define GZIP_MIN_SIZE 256  /* smaller bodies are not worth a gzip variant */
+#define GZIP_MAX_SIZE (1<<22) /* larger ones are not compressed */
+#define GZIP_LEVEL 6
+#define VARIANT_THREADS 2  /* threads making gzip and identity copies */
+#define VARIANT_QUEUE 256  /* copies waiting to be made, more are not asked for */
+#define UPSTREAM_BUCKETS 256 /* hash buckets of idle end server connections */
+#define UPSTREAM_MAX_IDLE 8  /* default idle connections kept per end server */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* default seconds an idle connection is kept */
+#define FLIGHT_BUCKETS 64  /* hash buckets of misses being fetched */
+#define WHEEL_BITS 6       /* 64 slots per timer wheel level */
+#define WHEEL_LEVELS 4     /* 64^4 seconds, about 194 days, before deadlines are clamped */
+#define STALE_RETAIN 3600  /* seconds a stale copy with validators is kept to revalidate */
+#define INDEX_BASE "Cache/index" /* .ckpt and .journal, worker processes past the first add .<index> */
+#define INDEX_MAGIC 0x32584449 /* "IDX2" */
+#define CHECKPOINT_INTERVAL 300 /* seconds between checkpoints of a growing journal */
+#define SEGMENT_DIR "Cache/seg"
+#define SEGMENT_SIZE (64<<20) /* most bytes appended to one log segment, at most an eighth of the cache */
+#define SEGMENT_MIN_SIZE (1<<20)
+#define SEGMENT_OBJ_MAX (1<<16) /* larger objects get a file of their own */
+#define COMPACT_LIVE 0.5   /* sealed segments with less of their bytes indexed are compacted */
+#define SEGMENT_WORKER_SHIFT 24 /* worker process n numbers its segments from n << 24 */
+#define MAX_PROCESSES 64
+#define SHARED_SETS 2048   /* sets of the web cache index shared by worker processes */
+#define SHARED_WAYS 8      /* entries per set, the one going stale first makes room */
+#define SHARED_RECORD_MAX 2048 /* larger index records, big heads mostly, are not shared */
+#define BORROWED_MAX 4096  /* entries of other worker processes kept at once, least recently used go first */
+#define SHARED_HOST_SETS 1024 /* sets of the ip cache shared by worker processes */
+#define SHARED_HOST_WAYS 4
+#define IPCACHE_BUCKETS 256 /* hash buckets of the ip cache */
+#define DNS_THREADS 4      /* resolver threads */
+#define DNS_TIMEOUT_MS 1000 /* wait for a nameserver reply, per try */
+#define DNS_TRIES 2
+#define DNS_MAX_TTL 3600   /* longest an answer is trusted, seconds */
+#define DNS_DEFAULT_TTL 60 /* for answers from getaddrinfo, which has no TTL */
+#define DNS_NEGATIVE_TTL 30 /* default seconds a failed lookup is remembered */
+#define BLACKLIST_FNV 0xcbf29ce484222325ULL
+#define RANGE_MAX 16       /* Range headers asking for more ranges are ignored */
+#define RANGE_MULTI_MAX (1<<20) /* largest multipart/byteranges body built, else the whole body is sent */
+#define PREFETCH_THREADS 4 /* background fetchers of links found in pages */
+#define PREFETCH_QUEUE 1024 /* links waiting to be fetched, more are dropped */
+#define PREFETCH_PER_ORIGIN 2 /* prefetches running at once against one host:port */
+#define PREFETCH_PER_PAGE 32 /* links queued from one page */
+#define PREFETCH_URI_MAX 1024 /* longer links are skipped */
+#define PREFETCH_HEADER "X-Proxy-Prefetch" /* marks the proxy's own prefetch requests */
+#define METRICS_PATH "/__proxy/stats" /* origin-form target the proxy answers with its metrics */
+#define HIST_SUB_BITS 3    /* latency histogram buckets per power of two, log2 */
+#define HIST_MAX_BITS 40   /* microseconds, longer latencies land in the last bucket */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define LOG_RING_SIZE (1<<18) /* bytes of log lines buffered per thread and stream, a power of two */
+#define LOG_LINE_MAX 2048  /* longer log lines are cut short */
+#define LOG_FLUSH_MS 50    /* longest a log line waits for the writer thread */
 
 /*structs*/
+/*a run of bytes in a buffer, not NUL terminated*/
+struct slice{
+    char * p;
+    size_t len;
+};
+
+/*first and last byte of a range, inclusive*/
+struct byte_range{
+    size_t first, last;
+};
+
 struct uri_info{
-    char host[100];
-    char path[300];
+    char host[MAX_HOST + 1];
+    struct slice path;              /* into the request URI */
     int port;
 };
 
+struct http_header{
+    struct slice name;
+    struct slice value;
+};
+
+enum req_state{
+    REQ_METHOD,
+    REQ_TARGET,
+    REQ_VERSION,
+    REQ_LINE_LF,        /* CR seen at the end of a line */
+    REQ_HEADER,         /* start of a header line or the blank line */
+    REQ_NAME,
+    REQ_VALUE_WS,       /* spaces ahead of a value */
+    REQ_VALUE,
+    REQ_END_LF,         /* CR of the blank line seen */
+    REQ_DONE,
+    REQ_ERROR
+};
+
+/*
+ * a request head parsed in place as it arrives, every field is a slice
+ * into the receive buffer
+ */
+struct http_request{
+    enum req_state state;
+    size_t pos;                     /* bytes looked at so far */
+    size_t mark;                    /* start of the field being read */
+    struct slice method;
+    struct slice target;
+    struct slice version;
+    int minor;                      /* HTTP/1.x */
+    struct http_header * headers;   /* room for parse_limits.max_headers */
+    int nheaders;
+    size_t head_len;                /* once done */
+    char * status;                  /* error to answer with */
+};
+
+struct parse_limits{
+    size_t max_head;
+    size_t max_target;
+    int max_headers;
+};
+
+enum ipcache_state{
+    IPCACHE_PENDING,    /* a resolver thread is looking it up */
+    IPCACHE_OK,
+    IPCACHE_FAILED      /* negative entry, the name did not resolve */
+};
+
+/*a hostname's address, good until expires (CLOCK_MONOTONIC seconds)*/
 struct ip_cache{
-    char hostname[100];
-    char ip[25];
-    pthread_rwlock_t rwlock;
-    struct ip_cache *next;
+    char hostname[MAX_HOST + 1];
+    struct in_addr addr;
+    enum ipcache_state state;
+    time_t expires;
+    struct conn * waiters;          /* connections parked on the pending lookup */
+    struct ip_cache *next;          /* hash chain */
+    struct ip_cache * job_next;     /* resolver queue */
+};
+
+struct ipcache_bucket{
+    pthread_mutex_t lock;
+    struct ip_cache * chain;
+};
+
+/*
+ * the ip cache and the resolver threads that fill it. Names are looked up
+ * with an A query to nameserver over UDP so answers carry a TTL, getaddrinfo
+ * is the fallback when there is no nameserver or it gives no usable answer
+ */
+struct resolver{
+    struct ipcache_bucket buckets[IPCACHE_BUCKETS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ip_cache * jobs;
+    struct ip_cache * jobs_tail;
+    struct sockaddr_in nameserver;  /* sin_port is 0 without one */
+    int negative_ttl;
+    atomic_ulong hits;
+    atomic_ulong negative_hits;     /* answered from a failed lookup */
+    atomic_ulong misses;
+    atomic_ulong coalesced;         /* joined a lookup already in flight */
+    atomic_ulong queries;           /* sent to the nameserver */
+    atomic_ulong failures;
+    atomic_ulong shared_hits;       /* answered by another worker process's lookup */
+};
+
+/*
+ * what the caching headers of a response say. Requests reuse no_store,
+ * no_cache and max_age for their own Cache-Control
+ */
+struct cache_meta{
+    int status;
+    int no_store;           /* no-store, private, or a Vary this cache cannot honour */
+    int no_cache;           /* revalidate before every use */
+    int shared;             /* public or must-revalidate, 2 for s-maxage. May be stored for an authorized request */
+    long max_age;           /* s-maxage, else max-age, -1 if absent */
+    long age;               /* Age, -1 if absent */
+    time_t date;            /* HTTP dates, -1 if absent */
+    time_t expires;         /* 0 if present but invalid, which means already expired */
+    time_t last_modified;
+    struct slice etag;      /* points into the stored head */
+    int prefetched;         /* the response to a prefetch, not from the headers */
 };
 
 struct web_cache{
-    char uri[120];
-    clock_t tick_start;
-    pthread_rwlock_t rwlock;
+    unsigned char key[MD5_DIGEST_LENGTH];   /* md5(uri), also names its own file */
+    int status;
+    time_t stored;                          /* monotonic seconds when received */
+    time_t fresh_until;                     /* monotonic seconds, stale from then on */
+    long initial_age;                       /* age when received */
+    char * etag;                            /* validators, NULL and -1 if absent */
+    time_t last_modified;
+    atomic_int refcnt;                      /* one for the index, one per user */
+    size_t size;                            /* bytes stored, head and body */
+    atomic_int fd;                          /* kept open once hit, -1 until then */
+    _Atomic(char *) map;                    /* whole file, for small hot objects */
+    atomic_ulong hits;
+    atomic_int prefetched;                  /* stored by a prefetch and not used since */
+    char * hdr;                             /* stored response head, ends in a blank line */
+    size_t hdr_len;
+    size_t body_off;                        /* body starts this far into the object */
+    struct segment * seg;                   /* log segment holding it, NULL for its own file */
+    size_t seg_off;                         /* where it starts in seg */
+    int mapped;                             /* hdr and etag point into a mapped index file */
+    int borrowed;                           /* taken from another worker process, which owns its storage */
+    int owner;                              /* that worker process's index */
+    uint64_t file_ino;                      /* its own file, so a later copy under the name is told apart */
+    int64_t file_mtime;                     /* ns, both 0 if unknown */
+
+    /*expiry timer, guarded by wheel.lock*/
+    time_t retire_at;                       /* monotonic second the sweeper drops it */
+    struct web_cache * timer_next;
+    struct web_cache ** timer_pprev;        /* NULL when not on the wheel */
+
+    /*eviction state, guarded by cache_policy.lock*/
+    int in_policy;
+    int protected;                          /* SLRU segment */
+    unsigned long freq;                     /* GDSF reference count */
+    double priority;                        /* GDSF H value */
+    size_t heap_idx;
+    struct web_cache * prev;
     struct web_cache * next;
 };
 
+enum evict_kind{
+    EVICT_LRU,
+    EVICT_SLRU,
+    EVICT_GDSF
+};
+
+/*a doubly linked recency list, head is most recently used*/
+struct cache_list{
+    struct web_cache * head;
+    struct web_cache * tail;
+    size_t bytes;
+};
+
+/*
+ * size aware eviction over every indexed object. LRU uses lru, SLRU splits
+ * objects into probation (lru) and protect, GDSF keeps a min-heap on priority
+ */
+struct cache_policy{
+    pthread_mutex_t lock;
+    enum evict_kind kind;
+    size_t capacity;                /* byte budget for Cache/ */
+    size_t max_obj;                 /* larger objects are never cached */
+    size_t bytes;
+    struct cache_list lru;
+    struct cache_list protect;
+    struct web_cache ** heap;
+    size_t heap_len, heap_cap;
+    double inflation;               /* GDSF L, priority of the last victim */
+    struct cache_list borrowed;     /* other workers' entries, outside the byte budget */
+    size_t borrowed_len;
+};
+
+struct cache_stats{
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong expired;           /* misses on an entry past its freshness lifetime */
+    atomic_ulong insertions;
+    atomic_ulong rejected;          /* objects over max_obj */
+    atomic_ulong evictions;
+    atomic_ulong evicted_bytes;
+    atomic_ulong coalesced;         /* misses that waited on another client's fetch */
+    atomic_ulong tailed;            /* of them, read along while it downloaded */
+    atomic_ulong uncacheable;       /* responses not stored for what their headers say */
+    atomic_ulong revalidated;       /* stale entries the end server confirmed with a 304 */
+    atomic_ulong not_modified;      /* client conditional requests answered with a 304 */
+    atomic_ulong retired;           /* expired entries dropped by the sweeper */
+    atomic_ulong gzipped;           /* gzip variants made from identity copies */
+    atomic_ulong gunzipped;         /* identity variants made from gzip copies */
+    atomic_ulong ranges;            /* Range requests answered with a 206 or 416 from stored copies */
+    atomic_ulong published;         /* entries offered to the other worker processes */
+    atomic_ulong borrowed;          /* entries taken from another worker process */
+};
+
+/*content codings of stored bodies*/
+enum content_coding{
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_OTHER        /* left as it is */
+};
+
+/*
+ * an append-only file small objects are packed into. The current segment
+ * takes appends until it is full, sealed ones only lose objects and are
+ * compacted once mostly dead
+ */
+struct segment{
+    uint32_t id;                    /* names SEGMENT_DIR/<id> */
+    int fd;
+    char * map;                     /* the whole segment, objects are sent from here */
+    size_t map_len;
+    size_t tail;                    /* bytes appended, guarded by store.lock */
+    atomic_size_t live;             /* bytes of indexed objects */
+    atomic_int refcnt;              /* one while listed, one per entry */
+    atomic_int dirty;               /* appended to since the last checkpoint */
+    int borrowed;                   /* another worker process's, never deleted here */
+    struct segment * next;
+};
+
+struct segment_store{
+    pthread_mutex_t lock;
+    struct segment * segments;      /* every listed segment, the current one too */
+    struct segment * current;
+    struct segment * borrowed;      /* other worker processes' segments entries were taken from */
+    uint32_t next_id;
+    size_t seg_size;
+    atomic_ulong compactions;
+    atomic_ulong moved_bytes;       /* copied out of compacted segments */
+};
+
+enum index_op{
+    INDEX_ADD = 1,
+    INDEX_DEL
+};
+
+/*
+ * a web cache index change in the journal, or an entry in a checkpoint.
+ * The entity tag and stored head follow it, each ending in a NUL so entries
+ * can use them where they are mapped, and the record is padded to 8 bytes.
+ * Times are wall clock so they survive a reboot
+ */
+struct index_record{
+    uint32_t op;
+    uint32_t len;                   /* with what follows */
+    unsigned char key[MD5_DIGEST_LENGTH];
+    int64_t fresh_until;
+    int64_t born;                   /* when the response was generated, for its age */
+    int64_t last_modified;
+    uint64_t size;
+    uint64_t body_off;
+    uint32_t status;
+    uint32_t etag_len;
+    uint32_t hdr_len;
+    uint32_t segment;               /* id of the log segment holding it, 0 for its own file */
+    uint64_t seg_off;
+    uint64_t file_ino;              /* its own file's inode and mtime in ns, 0 if unknown */
+    int64_t file_mtime;
+};
+
+/*start of the checkpoint and journal files*/
+struct index_file{
+    uint32_t magic;
+    uint32_t record_size;           /* sizeof(struct index_record), the layout */
+    uint64_t records;               /* in a checkpoint, 0 for the journal */
+};
+
+/*
+ * the on-disk web cache index. Index changes are buffered here, written to
+ * the journal once a second and folded into a new checkpoint now and then
+ */
+struct index_journal{
+    pthread_mutex_t lock;
+    int fd;                         /* -1 while the index is loaded */
+    char * buf;                     /* records not yet written */
+    size_t len, cap;
+    unsigned long records;          /* journaled since the last checkpoint */
+    int failed;                     /* the last flush did not get everything out, checkpoint soon */
+    time_t checkpointed;            /* monotonic */
+    unsigned long loaded;           /* entries restored at startup */
+    double load_ms;
+    char checkpoint[40], checkpoint_tmp[40];
+    char path[40], old_path[40];    /* the journal, and the one a failed checkpoint left */
+};
+
+/*
+ * the entries restored at startup, allocated in one block, and the index
+ * files their heads point into. Both go once the last of them is released
+ */
+struct index_arena{
+    struct web_cache * entries;
+    atomic_size_t live;
+    char * maps[3];
+    size_t lens[3];
+};
+
+/*
+ * hierarchical timing wheel of cache entry deadlines. A level 0 slot is one
+ * second, a level n slot spans 64^n seconds and is cascaded into the levels
+ * below once they come round to it
+ */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+struct timer_wheel{
+    pthread_mutex_t lock;
+    time_t now;                     /* monotonic second the wheel has swept up to */
+    struct web_cache * slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long timers;
+};
+
+enum fill_state{
+    FILL_RUNNING,
+    FILL_DONE,                      /* every byte is stored */
+    FILL_FAILED
+};
+
+/*
+ * a response being stored while it is relayed. Once its length is known it
+ * is published on the fetch and other clients read along as it grows, the
+ * buffer or file it goes to is then fixed and bytes below len never change
+ */
+struct fill{
+    pthread_mutex_t lock;
+    atomic_int refcnt;              /* the fetcher, the flight and each reader */
+    char * buf;                     /* the object while it may go in a segment */
+    size_t cap;
+    int fd;                         /* else the file it is written to, -1 before */
+    size_t len;                     /* bytes stored, head and body */
+    enum fill_state state;          /* len and state are guarded by lock once published */
+    int published;
+    char * hdr;                     /* stored head, for readers */
+    size_t hdr_len;
+    long content_length;
+    long age;
+    struct conn * readers;          /* parked until more is stored */
+};
+
+/*
+ * a pipe the end server response is spliced into on its way to the client
+ * and one it is teed into on its way to the cache file
+ */
+struct relay_pipes{
+    int to_client[2];
+    int to_cache[2];
+    size_t size;                    /* bytes either pipe holds */
+    size_t queued;                  /* in to_client, not yet sent */
+    int spoiled;                    /* to_cache may not be empty, close rather than keep */
+    struct relay_pipes * next;      /* on the thread's idle list */
+};
+
+/*
+ * a miss being fetched by one client, others asking for the same key wait on
+ * it and are answered from the cache once it is stored, or read along from
+ * its fill once that is published
+ */
+struct flight{
+    unsigned char key[MD5_DIGEST_LENGTH];
+    struct conn * waiters;
+    struct fill * fill;
+    struct web_cache * source;      /* a variant being made from this copy, NULL for a fetch */
+    enum content_coding want;       /* and its coding */
+    struct flight * next;
+    struct flight * job_next;       /* on the variant queue */
+};
+
+/*variants waiting for a variant thread, each is the flight of its key*/
+struct variant_queue{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct flight * jobs;
+    struct flight * jobs_tail;
+    int queued;
+};
+
+struct flight_bucket{
+    pthread_mutex_t lock;
+    struct flight * chain;
+};
+
+/*
+ * one slice of the web cache index, an open addressing table with linear
+ * probing. Deleted slots hold WEBCACHE_TOMBSTONE so probe chains stay intact
+ */
+struct cache_shard{
+    pthread_rwlock_t rwlock;
+    struct web_cache ** slots;
+    size_t capacity;                /* always a power of two */
+    size_t used;                    /* live entries plus tombstones */
+};
+
+/*an index record a worker process offers the others*/
+struct shared_slot{
+    uint32_t owner;                 /* worker index + 1, 0 if free */
+    uint32_t len;                   /* of record */
+    uint64_t tag;                   /* the owner's entry, to tell its copies apart */
+    int64_t fresh_until;            /* wall clock, the first to go stale makes room */
+    unsigned char key[MD5_DIGEST_LENGTH];
+    uint64_t record[SHARED_RECORD_MAX / 8];
+};
+
+struct shared_set{
+    pthread_mutex_t lock;           /* robust and process shared */
+    struct shared_slot slots[SHARED_WAYS];
+};
+
+/*a resolver answer a worker process offers the others*/
+struct shared_host{
+    char hostname[MAX_HOST + 1];
+    struct in_addr addr;
+    int ok;
+    time_t expires;                 /* monotonic, 0 if free */
+};
+
+struct shared_host_set{
+    pthread_mutex_t lock;
+    struct shared_host hosts[SHARED_HOST_WAYS];
+};
+
+/*
+ * what the worker processes of --processes share, mapped before they are
+ * forked. Both tables are set associative so nothing in them points
+ * anywhere. Every worker keeps its own index and ip cache in front of them
+ * and only looks here on a miss
+ */
+struct shared_index{
+    struct shared_set sets[SHARED_SETS];
+    struct shared_host_set hosts[SHARED_HOST_SETS];
+};
+
+/*how the end of a response body is found*/
+enum body_framing{
+    BODY_NONE,          /* 1xx, 204 and 304 */
+    BODY_LENGTH,        /* Content-Length */
+    BODY_CHUNKED,       /* Transfer-Encoding: chunked */
+    BODY_UNTIL_CLOSE
+};
+
+enum chunk_state{
+    CHUNK_SIZE,
+    CHUNK_EXT,          /* chunk extension up to the end of the size line */
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,      /* start of a trailer line */
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF
+};
+
+/*decoder for an end server response body*/
+struct http_body{
+    enum body_framing framing;
+    enum chunk_state chunk;
+    size_t left;                    /* bytes left in the body or current chunk */
+    int done;
+    int extra;                      /* bytes arrived past the end of the body */
+};
+
+enum blacklist_kind{
+    BLACKLIST_EXACT,    /* www.example.com */
+    BLACKLIST_SUFFIX,   /* .example.com, the domain and every subdomain */
+    BLACKLIST_WILDCARD  /* *.example.com, subdomains only */
+};
+
+#define BLACKLIST_NODE_SUFFIX 1
+#define BLACKLIST_NODE_WILDCARD 2
+
+struct blacklist_node{
+    uint32_t parent;
+    uint32_t label;                 /* arena offset, not NUL terminated */
+    uint16_t label_len;
+    uint8_t flags;
+};
+
+/*
+ * a compiled, read only blacklist. Exact hosts are an open addressing set,
+ * domain rules a trie over reversed labels (com, example, www) whose edges
+ * are hashed on parent and label. Every name is an offset into arena
+ */
+struct blacklist{
+    char * arena;
+    size_t arena_len, arena_cap;
+    uint32_t * hosts;               /* arena offset + 1 of each host, 0 if empty */
+    size_t hosts_cap, nhosts;
+    uint32_t * edges;               /* child node index, 0 if empty */
+    size_t edges_cap;
+    struct blacklist_node * nodes;  /* nodes[0] is the root */
+    size_t nnodes, nrules;
+};
+
+/*an idle keep-alive connection to an end server*/
+struct upstream_conn{
+    int fd;
+    char host[MAX_HOST + 1];
+    int port;
+    time_t idle_since;              /* monotonic */
+    struct upstream_conn * next;
+};
+
+struct upstream_bucket{
+    pthread_mutex_t lock;
+    struct upstream_conn * idle;
+};
+
+/*idle HTTP/1.1 end server connections hashed by host:port*/
+struct upstream_pool{
+    struct upstream_bucket buckets[UPSTREAM_BUCKETS];
+    int max_idle;                   /* per host:port */
+    int idle_timeout;
+    atomic_ulong opened;
+    atomic_ulong reused;
+    atomic_ulong discarded;         /* failed the health check or timed out */
+};
+
+/*states a client/end server connection pair moves through*/
+enum conn_state{
+    CONN_READ_REQUEST,  /* reading the request header from the client */
+    CONN_FLIGHT_WAIT,   /* waiting on another client's fetch of the same page */
+    CONN_RESOLVE,       /* looking up the end server address */
+    CONN_RESOLVE_WAIT,  /* parked until a resolver thread has the address */
+    CONN_CONNECT,       /* waiting on a non-blocking connect */
+    CONN_SEND_REQUEST,  /* forwarding the modified request to the end server */
+    CONN_RELAY,         /* relaying the end server response to the client */
+    CONN_SEND_CACHED,   /* sending a cached webpage to the client */
+    CONN_TAIL,          /* sending a webpage another client is still downloading */
+    CONN_TAIL_WAIT,     /* parked until more of it is downloaded */
+    CONN_TUNNEL,        /* relaying a CONNECT tunnel both ways */
+    CONN_SEND_ERROR,    /* flushing an error response to the client */
+    CONN_CLOSE
+};
+
+enum ev_kind{
+    EV_LISTEN,
+    EV_CLIENT,
+    EV_SERVER,
+    EV_WAKE             /* the loop's eventfd, resolver threads write to it */
+};
+
+/*what epoll hands back for every registered fd*/
+struct ev_handle{
+    enum ev_kind kind;
+    struct conn * c;
+};
+
+/*how a request was answered, for the access log*/
+enum cache_status{
+    CACHE_NONE,         /* not looked up: errors and the metrics endpoint */
+    CACHE_HIT,
+    CACHE_MISS,
+    CACHE_EXPIRED,      /* a stale copy the end server replaced */
+    CACHE_REVALIDATED,  /* a stale copy the end server confirmed with a 304 */
+    CACHE_COALESCED,    /* stored by another client's fetch while c waited */
+    CACHE_TAILED,       /* read along with another client's fetch */
+    CACHE_TUNNEL        /* a CONNECT tunnel, never cached */
+};
+
+/*one direction of a CONNECT tunnel*/
+struct tunnel_dir{
+    int from, to;
+    int pipe[2];                    /* bytes are spliced through it, -1 when copying */
+    size_t queued;                  /* in pipe, not yet written to to */
+    char * buf;                     /* or copied through this, RELAYBUF bytes */
+    size_t off, len;                /* of the bytes in buf not yet written */
+    int eof;                        /* from is done, to is shut down once the rest is out */
+    int shut;
+};
+
+struct tunnel{
+    struct tunnel_dir up;           /* client to end server */
+    struct tunnel_dir down;         /* end server to client */
+};
+
+enum scan_state{
+    SCAN_TEXT,
+    SCAN_TAG,           /* the tag name after < */
+    SCAN_ATTR,          /* attribute names and the space between them */
+    SCAN_VALUE_START,   /* after an attribute's = */
+    SCAN_VALUE
+};
+
+/*
+ * a streaming tokenizer over an HTML body as it is relayed, no DOM. It
+ * picks up the src of any tag and the href of link tags, carrying its state
+ * from one piece of the body to the next. Gzipped bodies are inflated
+ * through it a piece at a time
+ */
+struct link_scan{
+    enum scan_state state;
+    char tag[8];                    /* lower case, cut short */
+    char attr[8];
+    int tag_len, attr_len;
+    int wanted;                     /* the value being read is a link */
+    char quote;                     /* that ends the value, 0 if unquoted */
+    char link[PREFETCH_URI_MAX];
+    size_t link_len;                /* past the buffer for a link that is too long */
+    int links;                      /* queued from this page */
+    int gzip;
+    z_stream zs;
+};
+
+/*a link waiting for a prefetch thread*/
+struct prefetch_job{
+    char * uri;
+    unsigned char key[MD5_DIGEST_LENGTH];
+    char host[MAX_HOST + 1];
+    int port;
+    int gzip;                       /* ask for gzip, as the page's client did */
+    struct prefetch_job * next;
+};
+
+/*
+ * links found in HTML pages, fetched into the web cache by PREFETCH_THREADS
+ * threads. They send their requests to the proxy's own port, so a prefetch
+ * takes the path of any miss, and no more than PREFETCH_PER_ORIGIN of them
+ * run at once against one host:port
+ */
+struct prefetcher{
+    int enabled;
+    int port;                       /* the proxy's listening port */
+    char * origins;                 /* hosts besides the page's own, comma separated */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct prefetch_job * jobs;
+    struct prefetch_job * jobs_tail;
+    int queued;
+    struct prefetch_job * running[PREFETCH_THREADS];
+    atomic_ulong found;             /* links queued */
+    atomic_ulong skipped;           /* already cached or queued */
+    atomic_ulong dropped;           /* the queue was full */
+    atomic_ulong fetched;
+    atomic_ulong failed;
+    atomic_ulong used;              /* prefetched entries a client went on to hit */
+};
+
+struct conn{
+    enum conn_state state;
+    int connfd;                     /* client socket */
+    int client_http11;
+    int client_keepalive;           /* read another request after this response */
+    int chunk_out;                  /* response body goes to the client chunked */
+    int requests;                   /* responses completed on this connection */
+    size_t req_body_left;           /* request body bytes still to skip */
+    int serv_sockfd;                /* end server socket */
+    int serv_reused;                /* serv_sockfd came from the upstream pool */
+    int serv_fresh_only;            /* a reused connection failed, do not reuse again */
+    int serv_keepalive;             /* serv_sockfd can go back to the pool */
+    char * head;                    /* end server response head being read, then */
+    size_t head_len;                /* the stored head once head_done is set */
+    int head_done;
+    size_t cached_hdr_len;
+    struct cache_meta meta;         /* of the response being relayed */
+    struct http_body body;
+    struct sockaddr_in serveraddr;
+    struct flight * flight;         /* miss c is fetching or waiting on */
+    unsigned char flight_key[MD5_DIGEST_LENGTH]; /* of the flight c waits on, c->key or a variant's */
+    int flight_fetcher;
+    atomic_int flight_done;         /* the fetch is over, flight_cached says how */
+    int flight_cached;
+    struct conn * flight_next;      /* next waiter on the same fetch */
+    struct ip_cache * dns_entry;    /* lookup c is parked on */
+    struct conn * dns_next;         /* next waiter on the same lookup */
+    atomic_int dns_done;            /* the resolver has set dns_ok and dns_addr */
+    int dns_ok;
+    struct in_addr dns_addr;
+    int wake_fd;                    /* pool mode, written once the lookup is done */
+    int in_ready;                   /* on loop->ready */
+    struct conn * ready_next;
+    struct ev_loop * loop;
+    struct ev_handle client_ev;
+    struct ev_handle serv_ev;
+    char * request_uri;             /* absolute URI, the cache key */
+    struct http_request req;
+    struct uri_info serv_info;
+    unsigned char key[MD5_DIGEST_LENGTH];
+    char * if_none_match;           /* client's validators, NULL and -1 if absent */
+    time_t if_modified_since;
+    long max_age;                   /* oldest copy the client accepts, -1 to always revalidate */
+    int no_store;                   /* client asked that the response not be stored */
+    int connect_method;             /* CONNECT, the end server connection becomes a tunnel */
+    int accept_gzip;                /* client's Accept-Encoding takes gzip */
+    int vary_coding;                /* the response is for a key with copies picked by coding */
+    char * range;                   /* client's Range and If-Range, NULL if absent */
+    char * if_range;
+    int windowed;                   /* the client gets a range of the response being relayed */
+    size_t win_skip;                /* body bytes still to skip before it */
+    size_t win_left;                /* and still to send */
+    int prefetch;                   /* one of the proxy's own prefetch requests */
+    struct link_scan * scan;        /* the HTML response is scanned for links */
+    struct tunnel * tunnel;         /* once it is established */
+    int authorized;                 /* request carries Authorization */
+    char filename[48];              /* Cache/xx/yy/<md5(uri)>[.<worker index>] */
+    char tmpname[56];               /* written here then renamed to filename */
+    struct web_cache * entry;       /* held while a cached page is sent or revalidated */
+    int file_fd;                    /* entry's descriptor for sendfile */
+    int own_fd;                     /* file_fd is ours to close */
+    char * map;                     /* or entry's mapping */
+    off_t file_off;
+    size_t file_left;
+    size_t buf_len;                 /* request(s) from client in buf, pipelined ones queue there */
+    char * new_request;             /* modified request for the end server */
+    size_t req_len, req_off;
+    char * response;                /* RELAYBUF bytes on the way to the client */
+    size_t resp_len, resp_off;
+    struct relay_pipes * pipes;     /* the body is being spliced, not copied */
+    struct fill * fill;             /* response being stored */
+    struct fill * tail;             /* another client's download c reads along */
+    atomic_int tail_ready;          /* more of tail is stored */
+    struct conn * tail_next;        /* next reader parked on the same fill */
+    uint64_t req_start;             /* monotonic us the request head began, 0 if not timed */
+    uint64_t phase_start;           /* of the lookup or connect under way */
+    int responded;                  /* the first response byte is out */
+    uint64_t ttfb;                  /* us to it */
+    char peer[24];                  /* client address, for the access log */
+    char method[MAX_METHOD_SIZE + 1];
+    int status;                     /* of the response to the client */
+    enum cache_status cache_status;
+    size_t bytes_out;               /* of the response, head and body */
+    int wait_fd;                    /* what a pool worker polls for next */
+    short wait_events;
+    time_t last_active;
+    int parked;                     /* pool mode, on pool.parked */
+    struct conn * prev;
+    struct conn * next;
+    char buf[];                     /* parse_limits.max_head bytes, then the header array */
+};
+
+struct ev_loop{
+    int epfd;
+    pthread_t tid;
+    struct conn * conns;            /* open connections, swept for idleness */
+    struct conn * closed;           /* freed once the current batch is done */
+    int wake_fd;                    /* eventfd, written when ready gets a connection */
+    struct ev_handle wake_ev;
+    pthread_mutex_t ready_lock;
+    struct conn * ready;            /* connections whose lookup finished */
+};
+
+/*an accepted connection, or a parked one, waiting for a pool worker*/
+struct work_item{
+    int connfd;
+    struct conn * c;                /* NULL until the connection has been run */
+    struct timespec enqueued;
+};
+
+/*
+ * each worker owns a bounded deque, it takes work from the front while
+ * idle workers steal from the back
+ */
+struct worker{
+    pthread_t tid;
+    pthread_mutex_t lock;
+    int wake_fd;                    /* eventfd the running connection's lookup wakes */
+    struct work_item * items;
+    int head;
+    int count;
+    unsigned long executed;
+    unsigned long steals;
+    unsigned long long wait_ns;     /* total time items sat in a queue */
+    unsigned long long max_wait_ns;
+};
+
+struct worker_pool{
+    struct worker * workers;
+    int nworkers;
+    int depth;
+    int pending;                    /* items queued across all workers */
+    unsigned long rejected;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int park_fd;                    /* epoll of connections waiting on their client */
+    pthread_mutex_t park_lock;
+    struct conn * parked;
+    unsigned long parks;
+    atomic_ulong requeued;          /* handed back with a pipelined request buffered */
+};
+
+/*request phases timed in the latency histograms*/
+enum phase{
+    PHASE_PARSE,        /* first byte of the request head to the head parsed */
+    PHASE_BLACKLIST,
+    PHASE_DNS_HIT,      /* answered from the ip cache */
+    PHASE_DNS_MISS,     /* waited on a resolver thread */
+    PHASE_CONNECT,      /* new end server connections, pooled ones skip it */
+    PHASE_TTFB,         /* request head to the first response byte sent */
+    PHASE_TOTAL,        /* request head to the last response byte sent */
+    PHASE_TUNNEL,       /* CONNECT head to the tunnel closing, instead of total */
+    PHASES
+};
+
+/*
+ * log-linear histogram of microseconds, HDR style. Values below
+ * 1 << HIST_SUB_BITS get a bucket each, every power of two above that is
+ * split in 1 << HIST_SUB_BITS, so a bucket is within 12.5% of its values
+ */
+struct histogram{
+    atomic_ulong counts[HIST_BUCKETS];
+    atomic_ulong sum;
+    atomic_ulong max;
+};
+
+/*
+ * counters of one thread. Only that thread writes them so an update is a
+ * relaxed load and store with no locked instruction, readers sum the shards
+ */
+struct metrics_shard{
+    struct histogram phases[PHASES];
+    atomic_ulong requests;          /* responses completed */
+    atomic_ulong conns_opened;
+    atomic_ulong conns_closed;
+    atomic_ulong client_in;         /* bytes */
+    atomic_ulong client_out;
+    atomic_ulong upstream_in;
+    atomic_ulong upstream_out;
+    atomic_ulong upstream_spliced;  /* of upstream_in, moved with splice */
+    atomic_ulong tunnels_opened;
+    atomic_ulong tunnels_closed;
+    atomic_ulong tunnel_up;         /* bytes, client to end server */
+    atomic_ulong tunnel_down;
+    struct metrics_shard * next;
+};
+
+enum log_level{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+enum log_stream{
+    LOG_ACCESS,         /* a line per request */
+    LOG_DIAG,           /* leveled messages */
+    LOG_STREAMS
+};
+
+/*
+ * lines one thread logged to one stream. Only that thread appends, at head,
+ * and only the writer thread writes them out and moves tail, so neither
+ * side takes a lock. Lines that do not fit are dropped and counted
+ */
+struct log_ring{
+    char * buf;                     /* LOG_RING_SIZE bytes */
+    atomic_size_t head;             /* bytes ever appended */
+    atomic_size_t tail;             /* bytes ever written out */
+    atomic_ulong dropped;
+    unsigned long reported;         /* drops already warned about, writer only */
+};
+
+struct log_thread{
+    struct log_ring rings[LOG_STREAMS];
+    time_t stamp_sec;               /* the second stamp holds */
+    char stamp[24];
+    struct log_thread * next;
+};
+
+struct logger{
+    pthread_mutex_t lock;           /* guards threads */
+    pthread_mutex_t drain_lock;     /* held while the rings are written out */
+    struct log_thread * threads;    /* one per thread that logged anything */
+    enum log_level level;
+    int fds[LOG_STREAMS];           /* -1 discards the stream */
+    int wake_fd;                    /* eventfd, written when a ring is half full */
+    int debug_bodies;               /* also copy response heads and bodies to stdout */
+};
+
+struct metrics{
+    pthread_mutex_t lock;
+    struct metrics_shard * shards;  /* one per thread that recorded anything */
+    uint64_t started;               /* monotonic us */
+};
+
 /*globals*/
 static volatile int keep_running = 1;
-pthread_rwlock_t ipcache_start_rwlock;
-pthread_rwlock_t webcache_start_rwlock;
-pthread_rwlock_t blacklist_rwlock;
+atomic_int stop_requested;          /* set by SIGINT, the sweeper shuts down */
+atomic_int stats_requested;         /* set by SIGUSR1, the sweeper prints the counters */
+_Atomic(struct blacklist *) blacklist_current;
+atomic_long blacklist_readers[2];   /* lookups in flight, by the phase they started in */
+atomic_int blacklist_phase;
+char * blacklist_path;
+atomic_int blacklist_reload;        /* set by SIGHUP */
+atomic_ulong blacklist_blocked;
+atomic_ulong blacklist_reloads;
 int timeout = 0;
+int listenfd = -1;
+struct ev_handle listen_ev = {EV_LISTEN, NULL};
+struct worker_pool pool;
+struct upstream_pool upstream;
+int client_idle_timeout = CLIENT_IDLE_TIMEOUT;
+int max_requests = MAX_REQUESTS;
+int tunnel_idle_timeout = TUNNEL_IDLE_TIMEOUT;
+int range_fetch_whole = 0;          /* misses with a Range fetch the whole object to store it */
 
-//head ptr for ip cache and web cache
-struct ip_cache  *ipCache_start = NULL;
-struct web_cache *webCache_start = NULL;
+//ip cache and resolver, shards for web cache
+struct resolver resolver;
+struct cache_shard webCache[CACHE_SHARDS];
+struct flight_bucket flights[FLIGHT_BUCKETS];
+struct variant_queue variants;
+struct cache_policy cache_policy;
+struct cache_stats cache_stats;
+struct timer_wheel wheel;
+struct index_journal journal;
+struct index_arena arena;
+struct segment_store store;
+struct metrics metrics;
+struct prefetcher prefetcher;
+static __thread struct metrics_shard * thread_metrics;
+struct logger logger;
+static __thread struct log_thread * thread_log;
+atomic_int splice_enabled = 1;      /* cleared with --no-splice or if the kernel refuses */
+static __thread struct relay_pipes * idle_pipes;
+static __thread int idle_pipes_count;
+atomic_int cache_fds;               /* descriptors held open by entries */
+int max_cache_fds;
+struct shared_index * shared;       /* NULL unless there are worker processes */
+int worker_index = 0;               /* this worker process, 0 without --processes */
+int worker_processes = 1;
+#define WEBCACHE_TOMBSTONE ((struct web_cache *)1)
 
 
 /*function prototypes*/
-int open_listenfd(int port);
-void service_http_request(int connfd);
-void *thread(void *vargp);
+int open_listenfd(int port, int reuseport);
+void supervise(int nprocs);
+void * ev_loop_thread(void * vargp);
+void accept_connections(struct ev_loop * loop);
+struct conn * conn_new(int connfd, struct ev_loop * loop);
+void conn_run(struct conn * c);
+int conn_timeout(struct conn * c);
+void conn_close(struct conn * c);
+int conn_open(struct conn * c);
+void conn_wake(struct conn * c, atomic_int * done);
+void conn_unready(struct conn * c);
+int conn_await(struct conn * c, atomic_int * done);
+int conn_serve_cached(struct conn * c, int any);
+void conn_queue_cached(struct conn * c);
+void relay_not_modified(struct conn * c, char * hdr, size_t hdr_len);
+void abandon_cache_file(struct conn * c);
+void relay_pipes_put(struct relay_pipes * p);
+int tunnel_start(struct conn * c);
+void tunnel_poll(struct conn * c, struct pollfd * pfd);
+void tunnel_end(struct conn * c);
+void scan_start(struct conn * c, char * hdr, size_t hdr_len);
+void scan_body(struct conn * c, char * data, size_t n);
+void scan_end(struct conn * c);
+void init_prefetcher(int port, char * origins);
+void * prefetch_thread(void * vargp);
+void print_prefetch_stats(void);
+uint64_t monotonic_us(void);
+static time_t monotonic_now(void);
+struct metrics_shard * metrics_shard(void);
+void metric_add(atomic_ulong * counter, unsigned long n);
+uint64_t metrics_phase(enum phase phase, uint64_t start);
+void metrics_request_done(struct conn * c);
+void serve_metrics(struct conn * c, int json);
+void print_metrics_stats(void);
+int init_logger(enum log_level level, char * access_log, int debug_bodies);
+void log_msg(enum log_level level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_access(struct conn * c);
+void log_drain(void);
+void * log_writer(void * vargp);
+void pool_start(int nworkers, int depth);
+int pool_submit(int connfd);
+void pool_park(struct conn * c, struct pollfd * pfd);
+void * pool_parker(void * vargp);
+void * worker_thread(void * vargp);
+void print_pool_stats(void);
+void service_http_request(struct conn * c);
 void intHandler(int dummy);
-int connect_via_ip(char * ip, int port);
-int connect_via_name(char * hostname, int port);
-void parse_uri(char * uri, struct uri_info * server_info);
-void parse_hdr_info(char * hdr_line, char * data, int * host_provided);
-void addto_ipcache(char * hostname, char * ip);
-struct ip_cache * get_ipcache(char * hostname);
-void addto_webcache(char * uri, clock_t tickstart);
-struct web_cache * get_webcache(char * uri);
-int check_blacklisted(char * hostname);
+void statsHandler(int dummy);
+void print_all_stats(void);
+void shutdown_proxy(void);
+int parse_nameserver(char * arg, struct sockaddr_in * nameserver);
+void init_resolver(struct sockaddr_in * nameserver, char * hosts_file, int negative_ttl);
+int resolve_host(struct conn * c, char * hostname, struct in_addr * addr);
+void resolve_cancel(struct conn * c);
+void * resolver_thread(void * vargp);
+void print_dns_stats(void);
+int connect_via_ip(struct conn * c, struct in_addr * addr, int port);
+void init_upstream(int max_idle, int idle_timeout);
+int upstream_acquire(char * host, int port);
+void upstream_release(struct conn * c);
+void * upstream_reaper(void * vargp);
+void print_upstream_stats(void);
+int parse_response_head(char * head, size_t len, char * hdr, size_t * hdr_len,
+                        struct http_body * body, int * keepalive, struct cache_meta * meta);
+time_t parse_http_date(char * value, size_t len);
+size_t format_http_date(char * dst, time_t t);
+void parse_cache_control(char * value, size_t len, struct cache_meta * meta);
+int etag_match(char * list, char * etag);
+size_t body_decode(struct http_body * body, char * buf, size_t len);
+/*
+ * init_upstream - keep up to max_idle idle connections per end server for
+ * idle_timeout seconds
+ */
+void init_upstream(int max_idle, int idle_timeout){
+    pthread_t tid;
+    upstream.max_idle = max_idle;
+    upstream.idle_timeout = idle_timeout;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++)
+        pthread_mutex_init(&upstream.buckets[i].lock, NULL);
+    pthread_create(&tid, NULL, upstream_reaper, NULL);
+    pthread_detach(tid);
+}
+
+static struct upstream_bucket * upstream_bucket(char * host, int port){
+    unsigned long h = 5381;
+    for (char * p = host; *p; p++)
+        h = h * 33 + (*p | 0x20);
+    h = h * 33 + port;
+    return &upstream.buckets[h % UPSTREAM_BUCKETS];
+}
+
+/*
+ * upstream_acquire - take an idle connection to host:port that is still
+ * open and has nothing unread on it
+ * Returns -1 if there is none
+ */
+int upstream_acquire(char * host, int port){
+    if (!port)
+        port = 80;
+    struct upstream_bucket * bucket = upstream_bucket(host, port);
+    time_t now = monotonic_now();
+    for (;;) {
+        struct upstream_conn * u, ** pp;
+        pthread_mutex_lock(&bucket->lock);
+        for (pp = &bucket->idle; (u = *pp); pp = &u->next)
+            if (u->port == port && strcasecmp(u->host, host) == 0)
+                break;
+        if (u)
+            *pp = u->next;
+        pthread_mutex_unlock(&bucket->lock);
+        if (!u)
+            return -1;
+
+        //health check, a live idle connection has nothing to read
+        char byte;
+        int fd = u->fd;
+        int alive = now - u->idle_since < upstream.idle_timeout &&
+                    recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK);
+        free(u);
+        if (alive) {
+            atomic_fetch_add(&upstream.reused, 1);
+            return fd;
+        }
+        close(fd);
+        atomic_fetch_add(&upstream.discarded, 1);
+    }
+}
+
+/*park c's end server connection for the next request to the same host*/
+void upstream_release(struct conn * c){
+    int port = c->serv_info.port ? c->serv_info.port : 80;
+    struct upstream_bucket * bucket = upstream_bucket(c->serv_info.host, port);
+    int idle = 0;
+
+    //the handle in the event set belongs to c, which is going away
+    if (c->loop)
+        epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->serv_sockfd, NULL);
+
+    pthread_mutex_lock(&bucket->lock);
+    for (struct upstream_conn * u = bucket->idle; u; u = u->next)
+        if (u->port == port && strcasecmp(u->host, c->serv_info.host) == 0)
+            idle++;
+    if (idle >= upstream.max_idle) {
+        pthread_mutex_unlock(&bucket->lock);
+        close(c->serv_sockfd);
+        return;
+    }
+    struct upstream_conn * u = malloc(sizeof(struct upstream_conn));
+    u->fd = c->serv_sockfd;
+    strcpy(u->host, c->serv_info.host);
+    u->port = port;
+    u->idle_since = monotonic_now();
+    u->next = bucket->idle;
+    bucket->idle = u;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/* closes pooled connections that sat idle too long */
+void * upstream_reaper(void * vargp)
+{
+    while (keep_running) {
+        sleep(1);
+        time_t now = monotonic_now();
+        for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+            struct upstream_bucket * bucket = &upstream.buckets[i];
+            struct upstream_conn * u, ** pp = &bucket->idle;
+            pthread_mutex_lock(&bucket->lock);
+            while ((u = *pp)) {
+                if (now - u->idle_since >= upstream.idle_timeout) {
+                    *pp = u->next;
+                    close(u->fd);
+                    free(u);
+                    atomic_fetch_add(&upstream.discarded, 1);
+                }
+                else
+                    pp = &u->next;
+            }
+            pthread_mutex_unlock(&bucket->lock);
+        }
+    }
+    return NULL;
+}
+
+void print_upstream_stats(void){
+    printf("upstream: %lu opened, %lu reused, %lu discarded\n",
+           atomic_load(&upstream.opened), atomic_load(&upstream.reused),
+           atomic_load(&upstream.discarded));
+}
+
+/*hop-by-hop headers that are not passed on or stored*/
+static int hop_by_hop(char * name, size_t len){
+    static const char * names[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+                                   "Transfer-Encoding", "TE", "Trailer", "Upgrade",
+                                   "Content-Length", NULL};
+    for (int i = 0; names[i]; i++)
+        if (strlen(names[i]) == len && strncasecmp(name, names[i], len) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * parse_http_date - parse an HTTP-date in any of the three formats senders
+ * are allowed to use
+ * Returns seconds since the epoch, or -1 if it is not a date
+ */
+time_t parse_http_date(char * value, size_t len){
+    static const char * formats[] = {"%a, %d %b %Y %H:%M:%S GMT",  /* IMF-fixdate */
+                                     "%A, %d-%b-%y %H:%M:%S GMT",  /* RFC 850 */
+                                     "%a %b %e %H:%M:%S %Y", NULL}; /* asctime */
+    char date[64];
+    struct tm tm;
+
+    if (len >= sizeof(date))
+        return -1;
+    memcpy(date, value, len);
+    date[len] = 0;
+    for (int i = 0; formats[i]; i++) {
+        bzero(&tm, sizeof(tm));
+        char * end = strptime(date, formats[i], &tm);
+        if (end && *end == 0)
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/*
+ * format_http_date - write t as an IMF-fixdate
+ * Returns its length
+ */
+size_t format_http_date(char * dst, time_t t){
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(dst, 30, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*seconds in a Cache-Control directive value, -1 if it is not a number*/
+static long delta_seconds(char * p, char * end){
+    long n = 0;
+    if (p < end && *p == '"')
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        n = n < LONG_MAX / 10 ? n * 10 + *p - '0' : LONG_MAX;
+    return n;
+}
+
+/*
+ * parse_cache_control - apply the directives of one Cache-Control value to
+ * meta. A shared cache treats private like no-store and s-maxage wins over
+ * max-age
+ */
+void parse_cache_control(char * value, size_t len, struct cache_meta * meta){
+    char * p = value, * end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        char * name = p;
+        while (p < end && *p != '=' && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        size_t name_len = p - name;
+        char * arg = NULL, * arg_end = NULL;
+        if (p < end && *p == '=') {
+            arg = ++p;
+            if (p < end && *p == '"') {
+                char * close = memchr(p + 1, '"', end - p - 1);
+                p = close ? close + 1 : end;
+            }
+            while (p < end && *p != ',')
+                p++;
+            arg_end = p;
+        }
+        if (name_len == 8 && strncasecmp(name, "no-store", 8) == 0)
+            meta->no_store = 1;
+        else if (name_len == 7 && strncasecmp(name, "private", 7) == 0)
+            meta->no_store = 1;
+        else if (name_len == 8 && strncasecmp(name, "no-cache", 8) == 0)
+            meta->no_cache = 1;
+        else if (name_len == 6 && strncasecmp(name, "public", 6) == 0)
+            meta->shared = 1;
+        else if (name_len == 15 && strncasecmp(name, "must-revalidate", 15) == 0)
+            meta->shared = 1;
+        else if (name_len == 8 && strncasecmp(name, "s-maxage", 8) == 0 && arg) {
+            meta->max_age = delta_seconds(arg, arg_end);
+            meta->shared = 2;
+        }
+        else if (name_len == 7 && strncasecmp(name, "max-age", 7) == 0 && arg && meta->shared != 2)
+            meta->max_age = delta_seconds(arg, arg_end);
+    }
+}
+
+/*
+ * vary_ok - whether every header a response varies on is one this proxy
+ * never passes on, so all clients share the same variant
+ */
+static int vary_ok(char * value, size_t len){
+    static const char * dropped[] = {"User-Agent", "Accept", "Accept-Encoding", NULL};
+    char * p = value, * end = value + len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        char * name = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        if (p == name)
+            break;
+        int i;
+        for (i = 0; dropped[i]; i++)
+            if (strlen(dropped[i]) == (size_t)(p - name) && strncasecmp(name, dropped[i], p - name) == 0)
+                break;
+        if (!dropped[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * etag_match - weak comparison of an If-None-Match list against a stored
+ * entity tag, which may be NULL
+ * Returns 1 if one of them matches
+ */
+int etag_match(char * list, char * etag){
+    if (etag && strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+    size_t etag_len = etag ? strlen(etag) : 0;
+    char * p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '*')
+            return 1;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        char * tag = p;
+        if (*p == '"') {
+            char * close = strchr(p + 1, '"');
+            p = close ? close + 1 : p + strlen(p);
+        }
+        else
+            p += strcspn(p, ",");
+        if (etag && (size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * parse_response_head - read the status line and headers of an end server
+ * response. The end-to-end headers are copied to hdr, ending in a blank line,
+ * and the body framing, whether the connection can be reused and what the
+ * caching headers say are set. Age is left out of hdr since every hop
+ * restates it
+ * Returns the status code, or -1 if the head is malformed
+ */
+int parse_response_head(char * head, size_t len, char * hdr, size_t * hdr_len,
+                        struct http_body * body, int * keepalive, struct cache_meta * meta){
+    int minor, status;
+    long content_length = -1;
+    int chunked = 0;
+    char * line = head, * end = head + len;
+
+    if (sscanf(head, "HTTP/1.%d %3d", &minor, &status) != 2)
+        return -1;
+    *keepalive = minor >= 1;
+    *hdr_len = 0;
+    bzero(meta, sizeof(*meta));
+    meta->status = status;
+    meta->max_age = meta->age = -1;
+    meta->date = meta->expires = meta->last_modified = -1;
+
+    while (line < end) {
+        char * eol = memchr(line, '\n', end - line);
+        size_t line_len = eol - line + 1;
+        size_t text_len = line_len - (eol > line && eol[-1] == '\r' ? 2 : 1);
+        char * colon = memchr(line, ':', text_len);
+        if (text_len == 0)
+            break;
+        if (line != head && colon) {
+            size_t name_len = colon - line;
+            char * value = colon + 1;
+            while (*value == ' ' || *value == '\t')
+                value++;
+            size_t value_len = line + text_len - value;
+            while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+                value_len--;
+            if (name_len == 13 && strncasecmp(line, "Cache-Control", 13) == 0)
+                parse_cache_control(value, value_len, meta);
+            else if (name_len == 7 && strncasecmp(line, "Expires", 7) == 0) {
+                meta->expires = parse_http_date(value, value_len);
+                if (meta->expires < 0)
+                    meta->expires = 0;
+            }
+            else if (name_len == 4 && strncasecmp(line, "Date", 4) == 0)
+                meta->date = parse_http_date(value, value_len);
+            else if (name_len == 13 && strncasecmp(line, "Last-Modified", 13) == 0)
+                meta->last_modified = parse_http_date(value, value_len);
+            else if (name_len == 4 && strncasecmp(line, "ETag", 4) == 0)
+                meta->etag = (struct slice){hdr + *hdr_len + (value - line), value_len};
+            else if (name_len == 4 && strncasecmp(line, "Vary", 4) == 0)
+                meta->no_store |= !vary_ok(value, value_len);
+            else if (name_len == 3 && strncasecmp(line, "Age", 3) == 0) {
+                meta->age = delta_seconds(value, value + value_len);
+                line = eol + 1;
+                continue;
+            }
+            else if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+                content_length = atol(value);
+            else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+                chunked = strcasestr(value, "chunked") != NULL;
+            else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                if (strncasecmp(value, "close", 5) == 0)
+                    *keepalive = 0;
+                else if (strncasecmp(value, "keep-alive", 10) == 0)
+                    *keepalive = 1;
+            }
+            if (hop_by_hop(line, name_len)) {
+                line = eol + 1;
+                continue;
+            }
+        }
+        memcpy(hdr + *hdr_len, line, text_len);
+        memcpy(hdr + *hdr_len + text_len, "\r\n", 2);
+        *hdr_len += text_len + 2;
+        line = eol + 1;
+    }
+    memcpy(hdr + *hdr_len, "\r\n", 2);
+    *hdr_len += 2;
+    hdr[*hdr_len] = 0;
+
+    bzero(body, sizeof(*body));
+    if (status < 200 || status == 204 || status == 304) {
+        body->framing = BODY_NONE;
+        body->done = 1;
+    }
+    else if (chunked) {
+        body->framing = BODY_CHUNKED;
+        body->chunk = CHUNK_SIZE;
+    }
+    else if (content_length >= 0) {
+        body->framing = BODY_LENGTH;
+        body->left = content_length;
+        body->done = content_length == 0;
+    }
+    else {
+        body->framing = BODY_UNTIL_CLOSE;
+        *keepalive = 0;
+    }
+    return status;
+}
+
+/*
+ * body_decode - strip the framing from len bytes of a response body,
+ * compacting the payload to the front of buf. Sets body->done at the end
+ * Returns the payload length
+ */
+size_t body_decode(struct http_body * body, char * buf, size_t len){
+    size_t in = 0, out = 0;
+
+    if (body->done) {
+        body->extra |= len > 0;
+        return 0;
+    }
+    switch (body->framing) {
+        case BODY_NONE:
+            body->extra |= len > 0;
+            return 0;
+        case BODY_UNTIL_CLOSE:
+            return len;
+        case BODY_LENGTH:
+            if (len >= body->left) {
+                body->extra |= len > body->left;
+                len = body->left;
+                body->done = 1;
+            }
+            body->left -= len;
+            return len;
+        case BODY_CHUNKED:
+            break;
+    }
+
+    while (in < len && !body->done) {
+        char ch = buf[in];
+        switch (body->chunk) {
+            case CHUNK_SIZE:
+                if (ch >= '0' && ch <= '9')
+                    body->left = body->left * 16 + (ch - '0');
+                else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+                    body->left = body->left * 16 + ((ch | 0x20) - 'a' + 10);
+                else if (ch == '\r')
+                    body->chunk = CHUNK_SIZE_LF;
+                else
+                    body->chunk = CHUNK_EXT;
+                in++;
+                break;
+            case CHUNK_EXT:
+                if (ch == '\r')
+                    body->chunk = CHUNK_SIZE_LF;
+                in++;
+                break;
+            case CHUNK_SIZE_LF:
+                body->chunk = body->left ? CHUNK_DATA : CHUNK_TRAILER;
+                in++;
+                break;
+            case CHUNK_DATA: {
+                size_t n = len - in < body->left ? len - in : body->left;
+                memmove(buf + out, buf + in, n);
+                in += n;
+                out += n;
+                body->left -= n;
+                if (!body->left)
+                    body->chunk = CHUNK_DATA_CR;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                body->chunk = CHUNK_DATA_LF;
+                in++;
+                break;
+            case CHUNK_DATA_LF:
+                body->chunk = CHUNK_SIZE;
+                in++;
+                break;
+            case CHUNK_TRAILER:
+                body->chunk = ch == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+                in++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (ch == '\n')
+                    body->chunk = CHUNK_TRAILER;
+                in++;
+                break;
+            case CHUNK_TRAILER_LF:
+                body->done = 1;
+                in++;
+                break;
+        }
+    }
+    body->extra |= in < len;
+    return out;
+}
+
+/*request parse limits, from the command line*/
+struct parse_limits parse_limits = {MAX_HEAD_SIZE, MAX_URI_SIZE, MAX_HEADERS};
+
+/*RFC 9110 token characters, for methods and header names*/
+static int is_tchar(unsigned char ch){
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+           (ch && strchr("!#$%&'*+-.^_`|~", ch));
+}
+
+/*anything but control characters may appear in a header value*/
+static int is_vchar(unsigned char ch){
+    return (ch >= ' ' && ch != 0x7f) || ch == '\t';
+}
+
+static struct slice slice_at(char * buf, size_t start, size_t end){
+    struct slice s = {buf + start, end - start};
+    return s;
+}
+
+/*case insensitive compare of a slice with a string*/
+int slice_eq(struct slice s, const char * str){
+    return strlen(str) == s.len && strncasecmp(s.p, str, s.len) == 0;
+}
+
+/*whether a comma separated header value lists token*/
+int slice_has_token(struct slice s, const char * token){
+    size_t len = strlen(token), i = 0;
+    while (i < s.len) {
+        while (i < s.len && (s.p[i] == ' ' || s.p[i] == '\t' || s.p[i] == ','))
+            i++;
+        size_t start = i;
+        while (i < s.len && s.p[i] != ',')
+            i++;
+        size_t end = i;
+        while (end > start && (s.p[end - 1] == ' ' || s.p[end - 1] == '\t'))
+            end--;
+        if (end - start == len && strncasecmp(s.p + start, token, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*get ready for the next request, keeping the header array*/
+void http_request_reset(struct http_request * req){
+    struct http_header * headers = req->headers;
+    bzero(req, sizeof(*req));
+    req->headers = headers;
+}
+
+struct http_header * http_find_header(struct http_request * req, const char * name){
+    for (int i = 0; i < req->nheaders; i++)
+        if (slice_eq(req->headers[i].name, name))
+            return &req->headers[i];
+    return NULL;
+}
+
+static int parse_fail(struct http_request * req, char * status){
+    req->state = REQ_ERROR;
+    req->status = status;
+    return -1;
+}
+
+/*
+ * http_parse_request - parse a request head from buf, which holds len bytes
+ * received so far. Resumes where the last call stopped, so it can be called
+ * again each time more bytes arrive. Method, target, version and headers are
+ * slices into buf
+ * Returns 1 once the head is complete (head_len bytes), 0 if more is needed,
+ * or -1 with status set to the error to answer with
+ */
+int http_parse_request(struct http_request * req, char * buf, size_t len){
+    size_t pos = req->pos, mark = req->mark, end;
+
+    if (req->state == REQ_DONE)
+        return 1;
+    if (req->state == REQ_ERROR)
+        return -1;
+    while (pos < len) {
+        unsigned char ch = buf[pos];
+        switch (req->state) {
+            case REQ_METHOD:
+                if (is_tchar(ch)) {
+                    if (++pos - mark > MAX_METHOD_SIZE)
+                        return parse_fail(req, "400 Bad Request");
+                    break;
+                }
+                if ((ch == '\r' || ch == '\n') && pos == mark) {
+                    //stray line ends before a request are ignored
+                    mark = ++pos;
+                    break;
+                }
+                if (ch != ' ' || pos == mark)
+                    return parse_fail(req, "400 Bad Request");
+                req->method = slice_at(buf, mark, pos);
+                mark = ++pos;
+                req->state = REQ_TARGET;
+                break;
+            case REQ_TARGET:
+                while (pos < len && (unsigned char)buf[pos] > ' ' && buf[pos] != 0x7f)
+                    pos++;
+                if (pos - mark > parse_limits.max_target)
+                    return parse_fail(req, "414 URI Too Long");
+                if (pos == len)
+                    break;
+                if (buf[pos] != ' ' || pos == mark)
+                    return parse_fail(req, "400 Bad Request");
+                req->target = slice_at(buf, mark, pos);
+                mark = ++pos;
+                req->state = REQ_VERSION;
+                break;
+            case REQ_VERSION:
+                while (pos < len && buf[pos] != '\r' && buf[pos] != '\n' && pos - mark <= 8)
+                    pos++;
+                if (pos - mark > 8)
+                    return parse_fail(req, "400 Bad Request");
+                if (pos == len)
+                    break;
+                req->version = slice_at(buf, mark, pos);
+                if (req->version.len != 8 || strncmp(req->version.p, "HTTP/", 5) != 0)
+                    return parse_fail(req, "400 Bad Request");
+                if (strncmp(req->version.p, "HTTP/1.", 7) != 0 ||
+                    req->version.p[7] < '0' || req->version.p[7] > '9')
+                    return parse_fail(req, "505 HTTP Version Not Supported");
+                req->minor = req->version.p[7] - '0';
+                req->state = buf[pos++] == '\r' ? REQ_LINE_LF : REQ_HEADER;
+                break;
+            case REQ_LINE_LF:
+                if (ch != '\n')
+                    return parse_fail(req, "400 Bad Request");
+                pos++;
+                req->state = REQ_HEADER;
+                break;
+            case REQ_HEADER:
+                if (ch == '\r') {
+                    pos++;
+                    req->state = REQ_END_LF;
+                    break;
+                }
+                if (ch == '\n') {
+                    pos++;
+                    goto done;
+                }
+                //this also refuses obsolete line folding
+                if (!is_tchar(ch))
+                    return parse_fail(req, "400 Bad Request");
+                if (req->nheaders == parse_limits.max_headers)
+                    return parse_fail(req, "431 Request Header Fields Too Large");
+                mark = pos;
+                req->state = REQ_NAME;
+                break;
+            case REQ_NAME:
+                while (pos < len && is_tchar(buf[pos]))
+                    pos++;
+                if (pos == len)
+                    break;
+                if (buf[pos] != ':')
+                    return parse_fail(req, "400 Bad Request");
+                req->headers[req->nheaders].name = slice_at(buf, mark, pos);
+                pos++;
+                req->state = REQ_VALUE_WS;
+                break;
+            case REQ_VALUE_WS:
+                if (ch == ' ' || ch == '\t') {
+                    pos++;
+                    break;
+                }
+                mark = pos;
+                req->state = REQ_VALUE;
+                break;
+            case REQ_VALUE:
+                while (pos < len && is_vchar(buf[pos]))
+                    pos++;
+                if (pos == len)
+                    break;
+                if (buf[pos] != '\r' && buf[pos] != '\n')
+                    return parse_fail(req, "400 Bad Request");
+                for (end = pos; end > mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'); end--)
+                    ;
+                req->headers[req->nheaders++].value = slice_at(buf, mark, end);
+                req->state = buf[pos++] == '\r' ? REQ_LINE_LF : REQ_HEADER;
+                break;
+            case REQ_END_LF:
+                if (ch != '\n')
+                    return parse_fail(req, "400 Bad Request");
+                pos++;
+                goto done;
+            case REQ_DONE:
+                return 1;
+            case REQ_ERROR:
+                return -1;
+        }
+    }
+    req->pos = pos;
+    req->mark = mark;
+    if (len >= parse_limits.max_head)
+        return parse_fail(req, "431 Request Header Fields Too Large");
+    return 0;
+
+done:
+    req->pos = req->head_len = pos;
+    req->state = REQ_DONE;
+    return 1;
+}
+
+int parse_uri(char * uri, struct uri_info * server_info);
+static char * uri_authority(char * uri);
+size_t parse_hdr_info(struct http_header * hdr, char * data);
+int http_parse_request(struct http_request * req, char * buf, size_t len);
+void http_request_reset(struct http_request * req);
+struct http_header * http_find_header(struct http_request * req, const char * name);
+int slice_eq(struct slice s, const char * str);
+int slice_has_token(struct slice s, const char * token);
+struct ip_cache * addto_ipcache(struct ipcache_bucket * bucket, char * hostname);
+struct ip_cache * get_ipcache(struct ipcache_bucket * bucket, char * hostname);
+void init_webcache(enum evict_kind kind, size_t capacity, size_t max_obj);
+void addto_webcache(unsigned char * key, size_t size, char * hdr, size_t hdr_len,
+                    struct cache_meta * meta, struct segment * seg, size_t seg_off, int fd);
+struct web_cache * refresh_webcache(struct web_cache * entry, char * hdr, size_t hdr_len,
+                                    struct cache_meta * meta, int * indexed);
+int webcache_storable(struct cache_meta * meta, int authorized);
+long webcache_age(struct web_cache * entry);
+struct web_cache * get_webcache(unsigned char * key, long max_age, int * fresh);
+static struct web_cache * webcache_lookup(unsigned char * key, long max_age, int * fresh, int counted);
+void release_webcache(struct web_cache * entry);
+void * cache_sweeper(void * vargp);
+void load_webcache_index(void);
+static size_t pow2_at_least(size_t n);
+static void random_bytes(void * buf, size_t len);
+static void uri_digest(const char * uri, size_t len, const char * suffix, unsigned char * key);
+static char * head_value(char * hdr, size_t hdr_len, const char * name, size_t * len);
+static enum content_coding head_coding(char * hdr, size_t hdr_len);
+static int head_compressible(char * hdr, size_t hdr_len, int status, long body_len);
+static struct segment * segment_find(uint32_t id);
+static void segment_recover(void);
+static void segment_sync(void);
+static void segment_compact(void);
+static struct segment * segment_borrow(uint32_t id, size_t end);
+static void segment_unborrow(void);
+struct shared_index * init_shared(void);
+static void shared_lock(pthread_mutex_t * lock);
+static void shared_publish(struct web_cache * e);
+static void shared_withdraw(struct web_cache * e);
+static struct web_cache * shared_import(unsigned char * key);
+static int shared_host_lookup(char * hostname, struct in_addr * addr, time_t * expires);
+static void shared_host_publish(char * hostname, struct in_addr addr, int ok, time_t expires);
+void shared_forget(int index);
+void print_shared_stats(void);
+void journal_flush(void);
+void checkpoint_webcache(void);
+int flight_join(struct conn * c);
+void flight_publish(struct conn * c);
+void flight_finish(struct conn * c, int cached);
+void flight_cancel(struct conn * c);
+static struct flight_bucket * flight_bucket(unsigned char * key);
+static void flight_end(struct flight * f, int cached);
+void * variant_thread(void * vargp);
+void fill_end(struct conn * c, enum fill_state state);
+void fill_release(struct fill * fill);
+void tail_cancel(struct conn * c);
+void webcache_filename(unsigned char * key, int owner, char * filename);
+struct segment * segment_append(char * data, size_t len, size_t * off);
+void segment_release(struct segment * seg);
+int webcache_open(struct web_cache * entry, int * owned);
+static int webcache_same_file(struct web_cache * entry, struct stat * st);
+char * webcache_map(struct web_cache * entry, int fd);
+void print_cache_stats(void);
+int check_blacklisted(char * hostname);
+void init_blacklist(char * path);
+struct blacklist * load_blacklist(char * path);
+void free_blacklist(struct blacklist * bl);
+void * blacklist_watcher(void * vargp);
+void print_blacklist_stats(void);
+void hupHandler(int dummy);
+
+static struct option long_options[] = {
+    {"loops", required_argument, NULL, 'l'},
+    {"mode", required_argument, NULL, 'm'},
+    {"workers", required_argument, NULL, 'w'},
+    {"queue-depth", required_argument, NULL, 'q'},
+    {"cache-policy", required_argument, NULL, 'p'},
+    {"cache-size", required_argument, NULL, 's'},
+    {"max-obj-size", required_argument, NULL, 'o'},
+    {"upstream-max-idle", required_argument, NULL, 'k'},
+    {"upstream-idle-timeout", required_argument, NULL, 't'},
+    {"client-idle-timeout", required_argument, NULL, 'c'},
+    {"max-requests", required_argument, NULL, 'r'},
+    {"tunnel-idle-timeout", required_argument, NULL, 'T'},
+    {"dns-server", required_argument, NULL, 'd'},
+    {"hosts-file", required_argument, NULL, 'f'},
+    {"dns-negative-ttl", required_argument, NULL, 'n'},
+    {"blacklist", required_argument, NULL, 'b'},
+    {"max-head-size", required_argument, NULL, 'a'},
+    {"max-uri", required_argument, NULL, 'u'},
+    {"max-headers", required_argument, NULL, 'x'},
+    {"log-level", required_argument, NULL, 'L'},
+    {"access-log", required_argument, NULL, 'A'},
+    {"debug-bodies", no_argument, NULL, 'B'},
+    {"no-splice", no_argument, NULL, 'N'},
+    {"range-fetch-whole", no_argument, NULL, 'R'},
+    {"prefetch", no_argument, NULL, 'P'},
+    {"prefetch-origins", required_argument, NULL, 'O'},
+    {"processes", required_argument, NULL, 'M'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char **argv)
+{
+    setbuf(stdout, 0);
+    int port, opt, use_pool = 0;
+    long nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    long nworkers = nloops, depth = QUEUE_DEPTH;
+    long cache_size = MAX_CACHE_SIZE, max_obj = MAX_OBJ_SIZE;
+    enum evict_kind evict = EVICT_LRU;
+    long upstream_idle = UPSTREAM_MAX_IDLE, upstream_timeout = UPSTREAM_IDLE_TIMEOUT;
+    long negative_ttl = DNS_NEGATIVE_TTL;
+    char * dns_server = NULL, * hosts_file = "/etc/hosts";
+    struct sockaddr_in nameserver;
+    struct rlimit rl;
+    char * blacklist_file = "blacklist.txt";
+    enum log_level log_level = LOG_INFO;
+    char * access_log = "-";
+    int debug_bodies = 0, prefetch = 0;
+    char * prefetch_origins = NULL;
+    long processes = 1;
+
+    while ((opt = getopt_long(argc, argv, "l:m:w:q:p:s:o:k:t:c:r:T:d:f:n:b:a:u:x:L:A:BNRPO:M:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l':
+                nloops = atoi(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "pool") == 0)
+                    use_pool = 1;
+                else if (strcmp(optarg, "epoll") != 0)
+                    nloops = 0;
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            case 'p':
+                if (strcasecmp(optarg, "lru") == 0)
+                    evict = EVICT_LRU;
+                else if (strcasecmp(optarg, "slru") == 0)
+                    evict = EVICT_SLRU;
+                else if (strcasecmp(optarg, "gdsf") == 0)
+                    evict = EVICT_GDSF;
+                else
+                    nloops = 0;
+                break;
+            case 's':
+                cache_size = atol(optarg);
+                break;
+            case 'o':
+                max_obj = atol(optarg);
+                break;
+            case 'k':
+                upstream_idle = atoi(optarg);
+                break;
+            case 't':
+                upstream_timeout = atoi(optarg);
+                break;
+            case 'c':
+                client_idle_timeout = atoi(optarg);
+                break;
+            case 'r':
+                max_requests = atoi(optarg);
+                break;
+            case 'T':
+                tunnel_idle_timeout = atoi(optarg);
+                break;
+            case 'd':
+                dns_server = optarg;
+                break;
+            case 'f':
+                hosts_file = optarg;
+                break;
+            case 'n':
+                negative_ttl = atoi(optarg);
+                break;
+            case 'b':
+                blacklist_file = optarg;
+                break;
+            case 'a':
+                parse_limits.max_head = atol(optarg);
+                break;
+            case 'u':
+                parse_limits.max_target = atol(optarg);
+                break;
+            case 'x':
+                parse_limits.max_headers = atoi(optarg);
+                break;
+            case 'L':
+                if (strcasecmp(optarg, "error") == 0)
+                    log_level = LOG_ERROR;
+                else if (strcasecmp(optarg, "warn") == 0)
+                    log_level = LOG_WARN;
+                else if (strcasecmp(optarg, "info") == 0)
+                    log_level = LOG_INFO;
+                else if (strcasecmp(optarg, "debug") == 0)
+                    log_level = LOG_DEBUG;
+                else
+                    nloops = 0;
+                break;
+            case 'A':
+                access_log = optarg;
+                break;
+            case 'B':
+                debug_bodies = 1;
+                break;
+            case 'N':
+                splice_enabled = 0;
+                break;
+            case 'R':
+                range_fetch_whole = 1;
+                break;
+            case 'P':
+                prefetch = 1;
+                break;
+            case 'O':
+                prefetch_origins = optarg;
+                break;
+            case 'M':
+                processes = atoi(optarg);
+                break;
+            default:
+                nloops = 0;
+        }
+    }
+    if (argc - optind != 2 || nloops < 1 || nworkers < 1 || depth < 1 ||
+        cache_size < 1 || max_obj < 1 || upstream_idle < 0 || upstream_timeout < 1 ||
+        client_idle_timeout < 1 || max_requests < 1 || tunnel_idle_timeout < 1 || negative_ttl < 0 ||
+        (long)parse_limits.max_head < 64 || (long)parse_limits.max_target < 1 ||
+        parse_limits.max_headers < 1 || processes < 1 || processes > MAX_PROCESSES ||
+        parse_nameserver(dns_server, &nameserver) < 0) {
+        fprintf(stderr, "usage: %s <port> <timeout> [--mode epoll|pool] [--loops N] "
+                        "[--workers N] [--queue-depth N] [--cache-policy lru|slru|gdsf] "
+                        "[--cache-size BYTES] [--max-obj-size BYTES] "
+                        "[--upstream-max-idle N] [--upstream-idle-timeout SECONDS] "
+                        "[--client-idle-timeout SECONDS] [--max-requests N] "
+                        "[--tunnel-idle-timeout SECONDS] "
+                        "[--dns-server IP[:PORT]|none] [--hosts-file PATH] "
+                        "[--dns-negative-ttl SECONDS] [--blacklist PATH] "
+                        "[--max-head-size BYTES] [--max-uri BYTES] [--max-headers N] "
+                        "[--log-level error|warn|info|debug] [--access-log PATH|-|off] "
+                        "[--debug-bodies] [--no-splice] [--range-fetch-whole] [--prefetch] [--prefetch-origins HOST,...] "
+                        "[--processes N]\n",
+                argv[0]);
+        exit(0);
+    }
+    //fork the worker processes before any thread is started
+    if (processes > 1) {
+        worker_processes = processes;
+        supervise(processes);
+    }
+    if (init_logger(log_level, access_log, debug_bodies) < 0) {
+        perror(access_log);
+        exit(1);
+    }
+    pthread_mutex_init(&metrics.lock, NULL);
+    metrics.started = monotonic_us();
+    //each worker process keeps its share of the budget
+    init_webcache(evict, cache_size / worker_processes, max_obj);
+    init_upstream(upstream_idle, upstream_timeout);
+    init_resolver(&nameserver, hosts_file, negative_ttl);
+    init_blacklist(blacklist_file);
+    port = atoi(argv[optind]);
+    timeout = atoi(argv[optind + 1]);
+
+    /*concurrency is bounded by descriptors, so take all we are allowed*/
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    //leave at least half of them for sockets
+    max_cache_fds = rl.rlim_cur / 2;
+    signal(SIGINT, intHandler);
+    signal(SIGUSR1, statsHandler);
+    signal(SIGHUP, hupHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    listenfd = open_listenfd(port, worker_processes > 1);
+    if (listenfd < 0) {
+        perror("open_listenfd");
+        exit(1);
+    }
+    if (prefetch)
+        init_prefetcher(port, prefetch_origins);
+
+    if (use_pool) {
+        /*the accept loop hands connections to a fixed pool of workers*/
+        pool_start(nworkers, depth);
+        while (keep_running) {
+            int connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+            if (connfd < 0)
+                continue;
+            if (pool_submit(connfd) < 0) {
+                char httperr[] = "HTTP/1.0 503 Service Unavailable\r\n\r\n";
+                send(connfd, httperr, strlen(httperr), 0);
+                close(connfd);
+            }
+        }
+        return 0;
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    /*start the event loops, each one accepts on the shared listening socket*/
+    struct ev_loop * loops = calloc(nloops, sizeof(struct ev_loop));
+    for (int i = 0; i < nloops; i++) {
+        struct epoll_event ev;
+        loops[i].epfd = epoll_create1(0);
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &listen_ev;
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev);
+        loops[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        loops[i].wake_ev.kind = EV_WAKE;
+        pthread_mutex_init(&loops[i].ready_lock, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loops[i].wake_ev;
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wake_fd, &ev);
+        pthread_create(&loops[i].tid, NULL, ev_loop_thread, &loops[i]);
+    }
+    for (int i = 0; i < nloops; i++)
+        pthread_join(loops[i].tid, NULL);
+    return 0;
+}
+
+/*
+ * run_ready - run the connections resolver threads handed back to loop
+ */
+void run_ready(struct ev_loop * loop){
+    uint64_t count;
+    read(loop->wake_fd, &count, sizeof(count));
+    pthread_mutex_lock(&loop->ready_lock);
+    struct conn * c = loop->ready;
+    loop->ready = NULL;
+    for (struct conn * r = c; r; r = r->ready_next)
+        r->in_ready = 0;
+    pthread_mutex_unlock(&loop->ready_lock);
+    while (c) {
+        struct conn * next = c->ready_next;
+        if (c->state != CONN_CLOSE)
+            conn_run(c);
+        c = next;
+    }
+}
+
+/* event loop routine */
+void * ev_loop_thread(void * vargp)
+{
+    struct ev_loop * loop = vargp;
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    while (keep_running) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < n; i++) {
+            struct ev_handle * h = events[i].data.ptr;
+            if (h->kind == EV_LISTEN)
+                accept_connections(loop);
+            else if (h->kind == EV_WAKE)
+                run_ready(loop);
+            else if (h->c->state != CONN_CLOSE)
+                conn_run(h->c);
+        }
+
+        //free connections closed during this batch
+        while (loop->closed) {
+            struct conn * c = loop->closed;
+            loop->closed = c->next;
+            free(c);
+        }
+
+        //drop connections that have gone quiet
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            struct conn * c = loop->conns;
+            while (c) {
+                struct conn * next = c->next;
+                if (now - c->last_active > conn_timeout(c))
+                    conn_close(c);
+                c = next;
+            }
+            last_sweep = now;
+        }
+    }
+    return NULL;
+}
+
+void ev_register(struct ev_loop * loop, int fd, struct ev_handle * h){
+    struct epoll_event ev;
+    if (!loop)
+        return;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = h;
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * conn_new - set up the state machine for an accepted client socket
+ * loop is NULL when a pool worker drives the connection
+ */
+struct conn * conn_new(int connfd, struct ev_loop * loop){
+    //the receive buffer and header array come in the same allocation
+    size_t hdr_off = (sizeof(struct conn) + parse_limits.max_head + 1 + 7) & ~(size_t)7;
+    struct conn * c = calloc(1, hdr_off + parse_limits.max_headers * sizeof(struct http_header));
+    //responses go out in pieces (head, then body), do not let Nagle hold the body back
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(connfd, (struct sockaddr *)&peer, &peer_len) == 0) {
+        inet_ntop(AF_INET, &peer.sin_addr, c->peer, 16);
+        sprintf(c->peer + strlen(c->peer), ":%u", ntohs(peer.sin_port));
+    }
+    c->req.headers = (struct http_header *)((char *)c + hdr_off);
+    c->state = CONN_READ_REQUEST;
+    c->connfd = connfd;
+    c->serv_sockfd = -1;
+    c->loop = loop;
+    c->client_ev.kind = EV_CLIENT;
+    c->client_ev.c = c;
+    c->serv_ev.kind = EV_SERVER;
+    c->serv_ev.c = c;
+    c->last_active = time(NULL);
+    metric_add(&metrics_shard()->conns_opened, 1);
+    if (loop) {
+        c->next = loop->conns;
+        if (loop->conns)
+            loop->conns->prev = c;
+        loop->conns = c;
+        ev_register(loop, connfd, &c->client_ev);
+    }
+    return c;
+}
+
+/*accept every pending connection and hand it a state machine*/
+void accept_connections(struct ev_loop * loop){
+    int connfd;
+    while ((connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+        conn_new(connfd, loop);
+    if (errno == EMFILE || errno == ENFILE)
+        log_msg(LOG_ERROR, "accept: %s", strerror(errno));
+}
+
+/*
+ * pool_start - create nworkers threads, each with a deque of depth items
+ */
+void pool_start(int nworkers, int depth){
+    pool.nworkers = nworkers;
+    pool.depth = depth;
+    pool.workers = calloc(nworkers, sizeof(struct worker));
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+        pool.workers[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        pool.workers[i].items = malloc(depth * sizeof(struct work_item));
+    }
+    pool.park_fd = epoll_create1(0);
+    pthread_mutex_init(&pool.park_lock, NULL);
+    for (int i = 0; i < nworkers; i++)
+        pthread_create(&pool.workers[i].tid, NULL, worker_thread, &pool.workers[i]);
+    pthread_t tid;
+    pthread_create(&tid, NULL, pool_parker, NULL);
+    pthread_detach(tid);
+}
+
+/*
+ * pool_push - queue connfd, or a connection already run, on the next worker
+ * with room
+ * Returns -1 if every queue is full
+ */
+static int pool_push(int connfd, struct conn * c){
+    static unsigned int next = 0;
+    for (int tries = 0; tries < pool.nworkers; tries++) {
+        struct worker * w = &pool.workers[next++ % pool.nworkers];
+        pthread_mutex_lock(&w->lock);
+        if (w->count < pool.depth) {
+            struct work_item * item = &w->items[(w->head + w->count) % pool.depth];
+            item->connfd = connfd;
+            item->c = c;
+            clock_gettime(CLOCK_MONOTONIC, &item->enqueued);
+            w->count++;
+            pthread_mutex_unlock(&w->lock);
+
+            pthread_mutex_lock(&pool.idle_lock);
+            pool.pending++;
+            pthread_cond_signal(&pool.idle_cond);
+            pthread_mutex_unlock(&pool.idle_lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    return -1;
+}
+
+/*
+ * pool_submit - queue a newly accepted connfd
+ * Returns -1 if every queue is full
+ */
+int pool_submit(int connfd){
+    if (pool_push(connfd, NULL) == 0)
+        return 0;
+    pool.rejected++;
+    return -1;
+}
+
+/*
+ * pool_park - give back the worker while c waits on its client, or on either
+ * end of a tunnel, for what pfd[0] and pfd[1] say. The parker queues c again
+ * once one of them is ready, or closes it when it times out
+ */
+void pool_park(struct conn * c, struct pollfd * pfd){
+    pthread_mutex_lock(&pool.park_lock);
+    c->parked = 1;
+    c->prev = NULL;
+    c->next = pool.parked;
+    if (pool.parked)
+        pool.parked->prev = c;
+    pool.parked = c;
+    pool.parks++;
+    for (int i = 0; i < 2 && pfd[i].fd >= 0; i++) {
+        struct epoll_event ev;
+        ev.events = (pfd[i].events & POLLIN ? EPOLLIN | EPOLLRDHUP : 0) |
+                    (pfd[i].events & POLLOUT ? EPOLLOUT : 0) | EPOLLONESHOT;
+        ev.data.ptr = c;
+        epoll_ctl(pool.park_fd, EPOLL_CTL_ADD, pfd[i].fd, &ev);
+    }
+    pthread_mutex_unlock(&pool.park_lock);
+}
+
+/*take c off the parked list, caller holds park_lock*/
+static void pool_unpark(struct conn * c){
+    epoll_ctl(pool.park_fd, EPOLL_CTL_DEL, c->connfd, NULL);
+    if (c->state == CONN_TUNNEL)
+        epoll_ctl(pool.park_fd, EPOLL_CTL_DEL, c->serv_sockfd, NULL);
+    c->parked = 0;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        pool.parked = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+}
+
+/*
+ * waits on every parked connection. Ready ones are taken off the list before
+ * any is queued, so a connection that shows up twice in one batch is only
+ * queued once and never touched after a worker may have freed it
+ */
+void * pool_parker(void * vargp){
+    struct epoll_event events[64];
+    struct conn * ready[64];
+    time_t last_sweep = 0;
+
+    while (keep_running) {
+        int n = epoll_wait(pool.park_fd, events, 64, 1000), nready = 0;
+        struct conn * expired = NULL;
+        pthread_mutex_lock(&pool.park_lock);
+        for (int i = 0; i < n; i++) {
+            struct conn * c = events[i].data.ptr;
+            if (!c->parked)
+                continue;
+            pool_unpark(c);
+            ready[nready++] = c;
+        }
+        //drop connections that have gone quiet
+        time_t now = time(NULL);
+        if (now != last_sweep) {
+            struct conn * c = pool.parked;
+            while (c) {
+                struct conn * next = c->next;
+                if (now - c->last_active > conn_timeout(c)) {
+                    pool_unpark(c);
+                    c->next = expired;
+                    expired = c;
+                }
+                c = next;
+            }
+            last_sweep = now;
+        }
+        pthread_mutex_unlock(&pool.park_lock);
+
+        for (int i = 0; i < nready; i++)
+            if (pool_push(ready[i]->connfd, ready[i]) < 0) {
+                conn_close(ready[i]);
+                free(ready[i]);
+            }
+        while (expired) {
+            struct conn * c = expired;
+            expired = c->next;
+            conn_close(c);
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+/*take from the front of our own deque*/
+int pool_pop(struct worker * w, struct work_item * item){
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->count) {
+        *item = w->items[w->head];
+        w->head = (w->head + 1) % pool.depth;
+        w->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/*take from the back of another worker's deque*/
+int pool_steal(struct worker * thief, struct work_item * item){
+    int self = thief - pool.workers;
+    for (int i = 1; i < pool.nworkers; i++) {
+        struct worker * victim = &pool.workers[(self + i) % pool.nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->count) {
+            victim->count--;
+            *item = victim->items[(victim->head + victim->count) % pool.depth];
+            pthread_mutex_unlock(&victim->lock);
+            thief->steals++;
+            return 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return 0;
+}
+
+/*
+ * conn_drive - run a connection on the calling thread, polling for whatever
+ * the state machine is waiting on, until it closes or waits on its client or
+ * a tunnel. Then the worker is given back: an idle or partly read connection
+ * or a waiting tunnel is parked, and one with a pipelined request buffered
+ * goes back in the queue
+ */
+void conn_drive(struct conn * c){
+    int requests = c->requests;
+    conn_run(c);
+    while (c->state != CONN_CLOSE) {
+        struct pollfd pfd[2] = {{c->wait_fd, c->wait_events, 0}, {-1, 0, 0}};
+        if (c->state == CONN_READ_REQUEST && c->requests != requests && c->buf_len) {
+            if (pool_push(c->connfd, c) == 0) {
+                atomic_fetch_add(&pool.requeued, 1);
+                return;
+            }
+            requests = c->requests;
+            conn_run(c);
+            continue;
+        }
+        if (c->state == CONN_READ_REQUEST) {
+            pfd[0].fd = c->connfd;
+            pfd[0].events = POLLIN;
+            pool_park(c, pfd);
+            return;
+        }
+        //a tunnel waits on both sockets at once
+        if (c->state == CONN_TUNNEL) {
+            tunnel_poll(c, pfd);
+            pool_park(c, pfd);
+            return;
+        }
+        if (poll(pfd, 2, conn_timeout(c) * 1000) <= 0) {
+            conn_close(c);
+            break;
+        }
+        conn_run(c);
+    }
+    free(c);
+}
+
+/* worker routine */
+void * worker_thread(void * vargp)
+{
+    struct worker * w = vargp;
+    struct work_item item;
+    struct timespec now;
+
+    while (keep_running) {
+        pthread_mutex_lock(&pool.idle_lock);
+        while (pool.pending == 0)
+            pthread_cond_wait(&pool.idle_cond, &pool.idle_lock);
+        pthread_mutex_unlock(&pool.idle_lock);
+
+        if (!pool_pop(w, &item) && !pool_steal(w, &item))
+            continue;
+        pthread_mutex_lock(&pool.idle_lock);
+        pool.pending--;
+        pthread_mutex_unlock(&pool.idle_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long long waited = (now.tv_sec - item.enqueued.tv_sec) * 1000000000ULL
+                                    + now.tv_nsec - item.enqueued.tv_nsec;
+        w->wait_ns += waited;
+        if (waited > w->max_wait_ns)
+            w->max_wait_ns = waited;
+        w->executed++;
+        struct conn * c = item.c ? item.c : conn_new(item.connfd, NULL);
+        c->wake_fd = w->wake_fd;
+        conn_drive(c);
+    }
+    return NULL;
+}
+
+void print_pool_stats(void){
+    unsigned long executed = 0, steals = 0;
+    unsigned long long wait_ns = 0, max_wait_ns = 0;
+    if (!pool.workers)
+        return;
+    for (int i = 0; i < pool.nworkers; i++) {
+        executed += pool.workers[i].executed;
+        steals += pool.workers[i].steals;
+        wait_ns += pool.workers[i].wait_ns;
+        if (pool.workers[i].max_wait_ns > max_wait_ns)
+            max_wait_ns = pool.workers[i].max_wait_ns;
+    }
+    printf("pool: %d workers, %lu executed, %lu steals, %lu rejected, %lu parked, %lu requeued, "
+           "queue wait avg %.3f ms max %.3f ms\n",
+           pool.nworkers, executed, steals, pool.rejected, pool.parks, atomic_load(&pool.requeued),
+           executed ? wait_ns / 1e6 / executed : 0.0, max_wait_ns / 1e6);
+}
+
+void conn_close(struct conn * c){
+    if (c->state == CONN_CLOSE)
+        return;
+    metric_add(&metrics_shard()->conns_closed, 1);
+    if (c->state == CONN_RESOLVE_WAIT)
+        resolve_cancel(c);
+    if (c->state == CONN_FLIGHT_WAIT)
+        flight_cancel(c);
+    else
+        flight_finish(c, 0);
+    if (c->state == CONN_TAIL_WAIT)
+        tail_cancel(c);
+    if (c->loop)
+        conn_unready(c);
+    if (c->state == CONN_RELAY)
+        abandon_cache_file(c);
+    if (c->tunnel)
+        tunnel_end(c);
+    c->state = CONN_CLOSE;
+    close(c->connfd);
+    if (c->serv_sockfd >= 0)
+        close(c->serv_sockfd);
+    if (c->tail)
+        fill_release(c->tail);
+    if (c->own_fd)
+        close(c->file_fd);
+    if (c->pipes)
+        relay_pipes_put(c->pipes);
+    c->pipes = NULL;
+    scan_end(c);
+    free(c->new_request);
+    free(c->response);
+    free(c->head);
+    free(c->request_uri);
+    free(c->if_none_match);
+    free(c->range);
+    free(c->if_range);
+    if (c->entry)
+        release_webcache(c->entry);
+    if (!c->loop)
+        return;
+
+    //move from the open list to the closed list
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        c->loop->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    c->next = c->loop->closed;
+    c->loop->closed = c;
+}
+
+/*seconds c may go without activity, shorter between keep-alive requests*/
+int conn_timeout(struct conn * c){
+    if (c->state == CONN_READ_REQUEST && c->requests && c->buf_len == 0)
+        return client_idle_timeout;
+    if (c->state == CONN_TUNNEL)
+        return tunnel_idle_timeout;
+    return IDLE_TIMEOUT;
+}
+
+/*
+ * conn_next_request - the response is out, clear the per-request state and
+ * go back to reading if the client keeps the connection open
+ * Returns 1 if the connection stays open
+ */
+int conn_next_request(struct conn * c){
+    log_access(c);
+    metrics_request_done(c);
+    c->requests++;
+    if (!c->client_keepalive || c->requests >= max_requests) {
+        conn_close(c);
+        return 0;
+    }
+    flight_finish(c, 0);
+    c->flight_cached = 0;
+    free(c->new_request);
+    c->new_request = NULL;
+    free(c->response);
+    c->response = NULL;
+    c->resp_len = c->resp_off = 0;
+    if (c->pipes)
+        relay_pipes_put(c->pipes);
+    c->pipes = NULL;
+    free(c->head);
+    c->head = NULL;
+    c->head_len = 0;
+    c->head_done = 0;
+    if (c->entry)
+        release_webcache(c->entry);
+    c->entry = NULL;
+    if (c->tail)
+        fill_release(c->tail);
+    c->tail = NULL;
+    if (c->own_fd)
+        close(c->file_fd);
+    c->own_fd = 0;
+    c->map = NULL;
+    if (c->serv_sockfd >= 0)
+        close(c->serv_sockfd);
+    c->serv_sockfd = -1;
+    c->serv_reused = c->serv_fresh_only = c->serv_keepalive = 0;
+    c->chunk_out = 0;
+    c->bytes_out = 0;
+    c->status = 0;
+    c->cache_status = CACHE_NONE;
+    c->state = CONN_READ_REQUEST;
+    return 1;
+}
+
+/*drop a cache file that will not be completed*/
+void abandon_cache_file(struct conn * c){
+    if (c->fill) {
+        if (c->fill->fd >= 0)
+            unlink(c->tmpname);
+        fill_end(c, FILL_FAILED);
+    }
+}
+
+/*record what a pool worker should poll for before running c again*/
+void conn_want(struct conn * c, int fd, short events){
+    c->wait_fd = fd;
+    c->wait_events = events;
+}
+
+/*
+ * conn_wake - set done and hand a parked connection back to whatever drives
+ * it, from another thread. Callers hold the lock c is parked under. Once done
+ * is set c may run, finish and be freed, so it is not touched after that
+ */
+void conn_wake(struct conn * c, atomic_int * done){
+    uint64_t one = 1;
+    int fd = c->loop ? c->loop->wake_fd : c->wake_fd;
+    if (c->loop) {
+        //the loop cannot free c while its ready list is locked
+        pthread_mutex_lock(&c->loop->ready_lock);
+        atomic_store(done, 1);
+        if (!c->in_ready) {
+            c->ready_next = c->loop->ready;
+            c->loop->ready = c;
+            c->in_ready = 1;
+        }
+        pthread_mutex_unlock(&c->loop->ready_lock);
+    }
+    else
+        atomic_store(done, 1);
+    write(fd, &one, sizeof(one));
+}
+
+/*c is closing, make sure its event loop is not about to run it*/
+void conn_unready(struct conn * c){
+    pthread_mutex_lock(&c->loop->ready_lock);
+    if (c->in_ready) {
+        struct conn ** pp = &c->loop->ready;
+        while (*pp != c)
+            pp = &(*pp)->ready_next;
+        *pp = c->ready_next;
+        c->in_ready = 0;
+    }
+    pthread_mutex_unlock(&c->loop->ready_lock);
+}
+
+/*
+ * conn_await - whether what c is parked on has set done, else wait for the
+ * wake. Pool workers drain their eventfd first, a wake that comes after the
+ * check writes it again
+ */
+int conn_await(struct conn * c, atomic_int * done){
+    if (!c->loop) {
+        uint64_t count;
+        read(c->wake_fd, &count, sizeof(count));
+    }
+    if (!atomic_load(done)) {
+        conn_want(c, c->wake_fd, POLLIN);
+        return 0;
+    }
+    return 1;
+}
+
+/*queue an error status line for the client and close once it is sent*/
+void conn_error(struct conn * c, char * status){
+    char httperr[50];
+    sprintf(httperr, "HTTP/1.0 %s\r\n\r\n", status);
+    c->status = atoi(status);
+    free(c->response);
+    c->response = strdup(httperr);
+    c->resp_len = strlen(httperr);
+    c->resp_off = 0;
+    c->state = CONN_SEND_ERROR;
+}
+
+/*
+ * flush_response - send buffered response bytes to the client
+ * Returns 1 when the buffer is empty, 0 if the client is not ready
+ */
+int flush_response(struct conn * c){
+    //a cached head goes out in the same segment as the start of its body
+    int more = c->state == CONN_SEND_CACHED && c->file_left ? MSG_MORE : 0;
+    while (c->resp_off < c->resp_len) {
+        ssize_t n = send(c->connfd, c->response + c->resp_off, c->resp_len - c->resp_off, more);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(c);
+            else
+                conn_want(c, c->connfd, POLLOUT);
+            return 0;
+        }
+        metric_add(&metrics_shard()->client_out, n);
+        c->bytes_out += n;
+        if (!c->responded && c->req_start) {
+            c->ttfb = metrics_phase(PHASE_TTFB, c->req_start);
+            c->responded = 1;
+        }
+        c->resp_off += n;
+    }
+    c->resp_off = c->resp_len = 0;
+    return 1;
+}
+
+/*
+ * conn_read_request - read from the client, parsing as bytes arrive, until
+ * the request head is complete
+ * Returns 1 if progress was made
+ */
+int conn_read_request(struct conn * c){
+    int parsed;
+    for (;;) {
+        //skip the body of the previous request
+        if (c->req_body_left) {
+            size_t skip = c->req_body_left < c->buf_len ? c->req_body_left : c->buf_len;
+            memmove(c->buf, c->buf + skip, c->buf_len - skip);
+            c->buf_len -= skip;
+            c->req_body_left -= skip;
+        }
+
+        if (!c->req_start && !c->req_body_left && c->buf_len)
+            c->req_start = monotonic_us();
+        //a pipelined request may already be waiting
+        if (!c->req_body_left && (parsed = http_parse_request(&c->req, c->buf, c->buf_len)))
+            break;
+        ssize_t n = recv(c->connfd, c->buf + c->buf_len, parse_limits.max_head - c->buf_len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn_close(c);
+            return 0;
+        }
+        if (n < 0) {
+            conn_want(c, c->connfd, POLLIN);
+            return 0;
+        }
+        metric_add(&metrics_shard()->client_in, n);
+        c->buf_len += n;
+    }
+    if (parsed < 0) {
+        c->client_keepalive = 0;
+        free(c->request_uri);
+        c->request_uri = NULL;
+        conn_error(c, c->req.status);
+        return 1;
+    }
+    metrics_phase(PHASE_PARSE, c->req_start);
+
+    service_http_request(c);
+
+    //done with this head, anything after it is pipelined
+    memmove(c->buf, c->buf + c->req.head_len, c->buf_len - c->req.head_len);
+    c->buf_len -= c->req.head_len;
+    http_request_reset(&c->req);
+    return 1;
+}
+
+/*
+ * conn_resolve - find the end server, reusing an idle pooled connection to
+ * it when there is one, else start a non-blocking connect
+ */
+int conn_resolve(struct conn * c){
+    if (!c->serv_fresh_only) {
+        c->serv_sockfd = upstream_acquire(c->serv_info.host, c->serv_info.port);
+        if (c->serv_sockfd >= 0) {
+            c->serv_reused = 1;
+            ev_register(c->loop, c->serv_sockfd, &c->serv_ev);
+            c->state = CONN_SEND_REQUEST;
+            return 1;
+        }
+    }
+    c->phase_start = monotonic_us();
+    int found = resolve_host(c, c->serv_info.host, &c->dns_addr);
+    if (found == 0) {
+        c->state = CONN_RESOLVE_WAIT;
+        return 1;
+    }
+    metrics_phase(PHASE_DNS_HIT, c->phase_start);
+    c->dns_ok = found > 0;
+    return conn_open(c);
+}
+
+/*
+ * conn_resolve_wait - pick up the answer once a resolver thread has it
+ */
+int conn_resolve_wait(struct conn * c){
+    if (!conn_await(c, &c->dns_done))
+        return 0;
+    metrics_phase(PHASE_DNS_MISS, c->phase_start);
+    return conn_open(c);
+}
+
+/*start a non-blocking connect to the resolved end server*/
+int conn_open(struct conn * c){
+    c->phase_start = monotonic_us();
+    if (!c->dns_ok || connect_via_ip(c, &c->dns_addr, c->serv_info.port) < 0) {
+        //handle for unsuccessful connection to server
+        conn_error(c, "404 Not Found");
+        return 1;
+    }
+    atomic_fetch_add(&upstream.opened, 1);
+    ev_register(c->loop, c->serv_sockfd, &c->serv_ev);
+    c->state = CONN_CONNECT;
+    return 1;
+}
+
+/*
+ * conn_retry - a pooled connection was closed by the end server before it
+ * answered, send the request again on a fresh connection
+ */
+int conn_retry(struct conn * c){
+    abandon_cache_file(c);
+    close(c->serv_sockfd);
+    c->serv_sockfd = -1;
+    c->serv_reused = 0;
+    c->serv_fresh_only = 1;
+    c->req_off = 0;
+    free(c->head);
+    c->head = NULL;
+    free(c->response);
+    c->response = NULL;
+    c->state = CONN_RESOLVE;
+    return 1;
+}
+
+int conn_connect(struct conn * c){
+    if (connect(c->serv_sockfd, (struct sockaddr *)&c->serveraddr, sizeof(c->serveraddr)) < 0 &&
+        errno != EISCONN) {
+        if (errno == EINPROGRESS || errno == EALREADY) {
+            conn_want(c, c->serv_sockfd, POLLOUT);
+            return 0;
+        }
+        conn_error(c, "404 Not Found");
+        return 1;
+    }
+    metrics_phase(PHASE_CONNECT, c->phase_start);
+    if (c->connect_method)
+        return tunnel_start(c);
+    c->state = CONN_SEND_REQUEST;
+    return 1;
+}
+
+int conn_send_request(struct conn * c){
+    while (c->req_off < c->req_len) {
+        ssize_t n = send(c->serv_sockfd, c->new_request + c->req_off, c->req_len - c->req_off, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_want(c, c->serv_sockfd, POLLOUT);
+                return 0;
+            }
+            if (c->serv_reused)
+                return conn_retry(c);
+            conn_error(c, "404 Not Found");
+            return 1;
+        }
+        metric_add(&metrics_shard()->upstream_out, n);
+        c->req_off += n;
+    }
+
+    c->head = malloc(MAXBUF);
+    c->head_len = 0;
+    c->response = malloc(RELAYBUF + CHUNK_ROOM + 8);
+    if (logger.debug_bodies)
+        printf("sending the following response to client:\n");
+    c->state = CONN_RELAY;
+    return 1;
+}
+
+/*
+ * vary_coding - Vary: Accept-Encoding at dst when c is sent a response for a
+ * key with copies picked by coding and hdr does not say so already
+ * Returns its length
+ */
+static size_t vary_coding(struct conn * c, char * dst, char * hdr, size_t hdr_len){
+    size_t len;
+    char * vary = head_value(hdr, hdr_len, "Vary", &len);
+    if (!c->vary_coding || (vary && (memmem(vary, len, "ncoding", 7) || memchr(vary, '*', len))))
+        return 0;
+    return sprintf(dst, "Vary: Accept-Encoding\r\n");
+}
+
+/*
+ * client_head - build the head sent to the client from a stored head,
+ * adding the framing headers this hop decides on, and Age unless it is -1.
+ * Bodies of unknown length are chunked for HTTP/1.1 clients, otherwise the
+ * connection closes after
+ * Returns its length
+ */
+size_t client_head(struct conn * c, char * dst, char * hdr, size_t hdr_len, long content_length,
+                   long age){
+    size_t len = hdr_len - 2;   /* without the blank line */
+    memcpy(dst, hdr, len);
+    c->status = atoi(hdr + 9);
+    len += vary_coding(c, dst + len, hdr, hdr_len);
+    if (age >= 0)
+        len += sprintf(dst + len, "Age: %ld\r\n", age);
+    if (c->requests + 1 >= max_requests)
+        c->client_keepalive = 0;
+    c->chunk_out = 0;
+    if (content_length >= 0)
+        len += sprintf(dst + len, "Content-Length: %ld\r\n", content_length);
+    else if (c->client_keepalive && c->client_http11) {
+        len += sprintf(dst + len, "Transfer-Encoding: chunked\r\n");
+        c->chunk_out = 1;
+    }
+    else
+        c->client_keepalive = 0;
+    len += sprintf(dst + len, "Connection: %s\r\n\r\n", c->client_keepalive ? "keep-alive" : "close");
+    return len;
+}
+
+/*first line of lines starting with field name, NULL if there is none*/
+static char * head_field(char * lines, size_t len, char * name, size_t name_len){
+    char * end = lines + len;
+    for (char * line = lines; line < end; ) {
+        char * eol = memmem(line, end - line, "\r\n", 2);
+        if (!eol)
+            break;
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0)
+            return line;
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+/*
+ * not_modified_head - build a 304 for the client from entry's stored head,
+ * keeping the fields RFC 9110 asks a 304 to repeat
+ * Returns its length
+ */
+size_t not_modified_head(struct conn * c, char * dst, struct web_cache * entry, long age){
+    static const char * kept[] = {"Cache-Control", "Content-Location", "Date", "ETag",
+                                  "Expires", "Last-Modified", "Vary", NULL};
+    char * line = strstr(entry->hdr, "\r\n") + 2, * end = entry->hdr + entry->hdr_len - 2;
+    size_t len = sprintf(dst, "HTTP/1.1 304 Not Modified\r\n");
+    c->status = 304;
+
+    while (line < end) {
+        char * eol = strstr(line, "\r\n");
+        for (int i = 0; kept[i]; i++)
+            if (head_field(line, eol + 2 - line, (char *)kept[i], strlen(kept[i]))) {
+                memcpy(dst + len, line, eol + 2 - line);
+                len += eol + 2 - line;
+                break;
+            }
+        line = eol + 2;
+    }
+    len += vary_coding(c, dst + len, entry->hdr, entry->hdr_len);
+    if (c->requests + 1 >= max_requests)
+        c->client_keepalive = 0;
+    c->chunk_out = 0;
+    len += sprintf(dst + len, "Age: %ld\r\nConnection: %s\r\n\r\n", age,
+                   c->client_keepalive ? "keep-alive" : "close");
+    return len;
+}
+
+/*
+ * merge_head - a stored head updated with the fields of a 304 for it, which
+ * replace the stored fields of the same name
+ * Returns its length
+ */
+static size_t merge_head(char * dst, char * hdr, size_t hdr_len, char * update, size_t update_len){
+    char * line = strstr(hdr, "\r\n") + 2, * end = hdr + hdr_len - 2;
+    char * fields = strstr(update, "\r\n") + 2;
+    size_t fields_len = update + update_len - fields;   /* with the blank line */
+    size_t len = line - hdr;
+
+    memcpy(dst, hdr, len);
+    while (line < end) {
+        char * eol = strstr(line, "\r\n");
+        char * colon = memchr(line, ':', eol - line);
+        if (!colon || !head_field(fields, fields_len, line, colon - line)) {
+            memcpy(dst + len, line, eol + 2 - line);
+            len += eol + 2 - line;
+        }
+        line = eol + 2;
+    }
+    memcpy(dst + len, fields, fields_len);
+    len += fields_len;
+    dst[len] = 0;
+    return len;
+}
+
+/*
+ * parse_range - read a Range value for a body of total bytes into at most
+ * max ranges, clamped to the body, in the order asked
+ * Returns how many of them can be satisfied, -1 if the Range is to be
+ * ignored: malformed, not in bytes, or asking for more than max ranges
+ */
+static int parse_range(char * value, size_t total, struct byte_range * r, int max){
+    char * p = value + strspn(value, " \t"), * end;
+    int n = 0, asked = 0;
+    if (strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    for (p += 6;; p++) {
+        unsigned long long first = 0, last = ULLONG_MAX;
+        int suffix;
+        p += strspn(p, " \t");
+        suffix = *p == '-';
+        if (!suffix) {
+            if (!isdigit((unsigned char)*p))
+                return -1;
+            first = strtoull(p, &end, 10);
+            p = end;
+            if (*p != '-')
+                return -1;
+        }
+        p++;
+        if (isdigit((unsigned char)*p)) {
+            last = strtoull(p, &end, 10);
+            p = end;
+            if (!suffix && last < first)
+                return -1;
+        }
+        else if (suffix)
+            return -1;
+        if (++asked > max)
+            return -1;
+        //a suffix is the last bytes, ranges starting past the end are dropped
+        if (suffix && last > 0 && total > 0) {
+            r[n].first = last < total ? total - last : 0;
+            r[n++].last = total - 1;
+        }
+        else if (!suffix && first < total) {
+            r[n].first = first;
+            r[n++].last = last < total ? last : total - 1;
+        }
+        p += strspn(p, " \t");
+        if (*p == 0)
+            return n;
+        if (*p != ',')
+            return -1;
+    }
+}
+
+/*
+ * if_range_ok - whether the client's If-Range, if it sent one, names the
+ * copy with these validators. Entity tags must match strongly
+ */
+static int if_range_ok(struct conn * c, char * etag, size_t etag_len, time_t last_modified){
+    char * v = c->if_range;
+    if (!v)
+        return 1;
+    if (*v == '"')
+        return etag && strlen(v) == etag_len && memcmp(v, etag, etag_len) == 0;
+    if (*v == 'W')
+        return 0;
+    return last_modified >= 0 && parse_http_date(v, strlen(v)) == last_modified;
+}
+
+/*
+ * range_head - a stored head with its status line replaced and the fields
+ * in extra added, dropping Content-Type if drop_type is set
+ * Returns its length
+ */
+static size_t range_head(char * dst, char * hdr, size_t hdr_len, char * status, int drop_type,
+                         char * extra){
+    char * line = memmem(hdr, hdr_len, "\r\n", 2) + 2, * end = hdr + hdr_len - 2;
+    size_t len = sprintf(dst, "HTTP/1.1 %s\r\n", status);
+    while (line < end) {
+        char * eol = (char *)memmem(line, end + 2 - line, "\r\n", 2) + 2;
+        if (!drop_type || !head_field(line, eol - line, "Content-Type", 12)) {
+            memcpy(dst + len, line, eol - line);
+            len += eol - line;
+        }
+        line = eol;
+    }
+    len += sprintf(dst + len, "%s\r\n", extra);
+    return len;
+}
+
+/*
+ * queue_body - queue len payload bytes that sit CHUNK_ROOM past the end of
+ * the queued response, framing them as a chunk when the client gets chunks
+ */
+void queue_body(struct conn * c, size_t len){
+    size_t start = c->resp_len;
+    char * data = c->response + start + CHUNK_ROOM;
+    char size_line[2 * sizeof(size_t) + 3];
+    int n = 0;
+
+    if (c->chunk_out && len)
+        n = sprintf(size_line, "%zx\r\n", len);
+    assert(n <= CHUNK_ROOM);    /* it goes in the room ahead of data */
+    if (c->resp_off == c->resp_len)
+        //nothing queued ahead, frame in place
+        c->resp_off = c->resp_len = start + CHUNK_ROOM - n;
+    else
+        memmove(c->response + start + n, data, len);
+    memcpy(c->response + c->resp_len, size_line, n);
+    c->resp_len += n + len;
+    if (n) {
+        memcpy(c->response + c->resp_len, "\r\n", 2);
+        c->resp_len += 2;
+    }
+    if (c->chunk_out && c->body.done) {
+        memcpy(c->response + c->resp_len, "0\r\n\r\n", 5);
+        c->resp_len += 5;
+    }
+}
+
+/*
+ * cache_tmpfile - open a file to be renamed to filename once written, under
+ * a private name so readers holding the current file open never see it
+ * truncated. The fan-out directories are made on first use
+ * Returns -1 if it could not be created
+ */
+static int cache_tmpfile(char * filename, char * tmpname){
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    int tmpfd = mkstemp(tmpname);
+    if (tmpfd < 0 && errno == ENOENT) {
+        char dir[48];
+        memcpy(dir, filename, 8);
+        dir[8] = 0;
+        mkdir(dir, 0755);
+        memcpy(dir + 8, filename + 8, 3);
+        dir[11] = 0;
+        mkdir(dir, 0755);
+        sprintf(tmpname, "%s.XXXXXX", filename);
+        tmpfd = mkstemp(tmpname);
+    }
+    return tmpfd;
+}
+
+/*
+ * cache_file_create - a file of its own for a response too big for a segment
+ * Returns 0 if it could not be created
+ */
+static int cache_file_create(struct conn * c){
+    c->fill->fd = cache_tmpfile(c->filename, c->tmpname);
+    return c->fill->fd >= 0;
+}
+
+/*
+ * fill_start - start storing c's response. When its length is known it
+ * goes straight to a buffer of that size or to a file, and clients waiting
+ * on the fetch read along from then on
+ * Returns 0 if it is not stored
+ */
+static int fill_start(struct conn * c, char * hdr, size_t hdr_len, long content_length){
+    size_t total = hdr_len + (content_length > 0 ? content_length : 0);
+    if (content_length >= 0 && total > cache_policy.max_obj) {
+        atomic_fetch_add(&cache_stats.rejected, 1);
+        return 0;
+    }
+    struct fill * fill = calloc(1, sizeof(struct fill));
+    pthread_mutex_init(&fill->lock, NULL);
+    atomic_init(&fill->refcnt, 1);
+    fill->fd = -1;
+    c->fill = fill;
+    if (content_length >= 0 && total > SEGMENT_OBJ_MAX) {
+        if (!cache_file_create(c)) {
+            fill_end(c, FILL_FAILED);
+            return 0;
+        }
+    }
+    else {
+        fill->cap = content_length >= 0 ? total : MAXBUF;
+        fill->buf = malloc(fill->cap ? fill->cap : 1);
+    }
+    if (content_length >= 0) {
+        fill->hdr = malloc(hdr_len);
+        memcpy(fill->hdr, hdr, hdr_len);
+        fill->hdr_len = hdr_len;
+        fill->content_length = content_length;
+        fill->age = c->meta.age;
+        fill->published = 1;
+        flight_publish(c);
+    }
+    return 1;
+}
+
+/*wake the readers parked on fill, caller holds fill->lock*/
+static void fill_wake(struct fill * fill){
+    struct conn * r = fill->readers;
+    fill->readers = NULL;
+    while (r) {
+        struct conn * next = r->tail_next;
+        conn_wake(r, &r->tail_ready);
+        r = next;
+    }
+}
+
+/*the fetcher is done with its fill, readers see state once they catch up*/
+void fill_end(struct conn * c, enum fill_state state){
+    struct fill * fill = c->fill;
+    pthread_mutex_lock(&fill->lock);
+    fill->state = state;
+    fill_wake(fill);
+    pthread_mutex_unlock(&fill->lock);
+    c->fill = NULL;
+    fill_release(fill);
+}
+
+void fill_release(struct fill * fill){
+    if (atomic_fetch_sub(&fill->refcnt, 1) != 1)
+        return;
+    if (fill->fd >= 0)
+        close(fill->fd);
+    free(fill->buf);
+    free(fill->hdr);
+    pthread_mutex_destroy(&fill->lock);
+    free(fill);
+}
+
+/*n more bytes of fill are stored, readers may go on to them*/
+static void fill_grow(struct fill * fill, size_t n){
+    if (!fill->published) {
+        fill->len += n;
+        return;
+    }
+    pthread_mutex_lock(&fill->lock);
+    fill->len += n;
+    fill_wake(fill);
+    pthread_mutex_unlock(&fill->lock);
+}
+
+/*store part of the response, until it gets too big*/
+void cache_write(struct conn * c, char * data, size_t n){
+    struct fill * fill = c->fill;
+    if (!fill)
+        return;
+    if (fill->len + n > cache_policy.max_obj) {
+        //too big to ever be cached, stop writing it and let waiters fetch it themselves
+        abandon_cache_file(c);
+        flight_finish(c, 0);
+        atomic_fetch_add(&cache_stats.rejected, 1);
+        return;
+    }
+    if (fill->fd < 0 && fill->len + n > SEGMENT_OBJ_MAX) {
+        //too big for a segment, move what there is to a file of its own. Only
+        //responses of unknown length get here, so nobody is reading along
+        if (!cache_file_create(c) || write(fill->fd, fill->buf, fill->len) != (ssize_t)fill->len) {
+            abandon_cache_file(c);
+            flight_finish(c, 0);
+            return;
+        }
+        free(fill->buf);
+        fill->buf = NULL;
+    }
+    if (fill->fd >= 0) {
+        if (write(fill->fd, data, n) != (ssize_t)n) {
+            abandon_cache_file(c);
+            flight_finish(c, 0);
+            return;
+        }
+    }
+    else {
+        if (fill->len + n > fill->cap) {
+            while (fill->cap < fill->len + n)
+                fill->cap *= 2;
+            fill->buf = realloc(fill->buf, fill->cap);
+        }
+        memcpy(fill->buf + fill->len, data, n);
+    }
+    fill_grow(fill, n);
+}
+
+/*
+ * relay_pipes_get - a pipe pair for splicing a response, one the thread
+ * kept or a new one
+ * Returns NULL if no pipes can be made
+ */
+static struct relay_pipes * relay_pipes_get(void){
+    struct relay_pipes * p = idle_pipes;
+    if (p) {
+        idle_pipes = p->next;
+        idle_pipes_count--;
+        return p;
+    }
+    p = calloc(1, sizeof(struct relay_pipes));
+    if (pipe2(p->to_client, O_NONBLOCK) < 0) {
+        free(p);
+        return NULL;
+    }
+    if (pipe2(p->to_cache, O_NONBLOCK) < 0) {
+        close(p->to_client[0]);
+        close(p->to_client[1]);
+        free(p);
+        return NULL;
+    }
+    //the same size, so whatever is spliced in can be teed in one go
+    fcntl(p->to_client[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    fcntl(p->to_cache[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    long a = fcntl(p->to_client[1], F_GETPIPE_SZ), b = fcntl(p->to_cache[1], F_GETPIPE_SZ);
+    p->size = a < b ? a : b;
+    return p;
+}
+
+/*give p back to the thread, or close it if it still holds bytes*/
+void relay_pipes_put(struct relay_pipes * p){
+    if (!p->queued && !p->spoiled && idle_pipes_count < RELAY_PIPES_KEPT) {
+        p->next = idle_pipes;
+        idle_pipes = p;
+        idle_pipes_count++;
+        return;
+    }
+    close(p->to_client[0]);
+    close(p->to_client[1]);
+    close(p->to_cache[0]);
+    close(p->to_cache[1]);
+    free(p);
+}
+
+/*
+ * relay_can_splice - the rest of c's body goes to the client as it comes
+ * and is stored in a file if at all, so it can move through pipes
+ */
+static int relay_can_splice(struct conn * c){
+    if (!atomic_load_explicit(&splice_enabled, memory_order_relaxed) || c->chunk_out ||
+        logger.debug_bodies || c->scan || c->windowed || (c->fill && c->fill->fd < 0) ||
+        (c->body.framing != BODY_LENGTH && c->body.framing != BODY_UNTIL_CLOSE))
+        return 0;
+    if (!c->pipes)
+        c->pipes = relay_pipes_get();
+    return c->pipes != NULL;
+}
+
+/*
+ * cache_tee - store the n body bytes just spliced into c's pipe, teeing
+ * them into the second pipe and splicing that into the fill's file
+ */
+static void cache_tee(struct conn * c, size_t n){
+    struct fill * fill = c->fill;
+    struct relay_pipes * p = c->pipes;
+    if (fill->len + n > cache_policy.max_obj) {
+        abandon_cache_file(c);
+        flight_finish(c, 0);
+        atomic_fetch_add(&cache_stats.rejected, 1);
+        return;
+    }
+    ssize_t teed = tee(p->to_client[0], p->to_cache[1], n, SPLICE_F_NONBLOCK);
+    size_t left = teed > 0 ? teed : 0;
+    while (left) {
+        ssize_t m = splice(p->to_cache[0], NULL, fill->fd, NULL, left, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINVAL) {
+            //the file system takes no splices, copy through the relay buffer
+            m = read(p->to_cache[0], c->response + CHUNK_ROOM, left < RELAYBUF ? left : RELAYBUF);
+            if (m > 0 && write(fill->fd, c->response + CHUNK_ROOM, m) != m)
+                m = -1;
+        }
+        if (m <= 0)
+            break;
+        left -= m;
+    }
+    if (teed != (ssize_t)n || left) {
+        p->spoiled = left != 0;
+        abandon_cache_file(c);
+        flight_finish(c, 0);
+        return;
+    }
+    fill_grow(fill, n);
+}
+
+/*
+ * relay_splice_in - splice body bytes from the end server into c's empty
+ * pipe, no more than are left of the body
+ * Returns what recv would
+ */
+static ssize_t relay_splice_in(struct conn * c){
+    struct relay_pipes * p = c->pipes;
+    size_t want = p->size;
+    if (c->body.framing == BODY_LENGTH && c->body.left < want)
+        want = c->body.left;
+    ssize_t n = splice(c->serv_sockfd, NULL, p->to_client[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+        return n;
+    p->queued = n;
+    if (c->body.framing == BODY_LENGTH && !(c->body.left -= n))
+        c->body.done = 1;
+    if (c->fill)
+        cache_tee(c, n);
+    return n;
+}
+
+/*
+ * relay_pipes_flush - splice the body bytes queued in c's pipe to the client
+ * Returns 1 when the pipe is empty, 0 if the client is not ready
+ */
+static int relay_pipes_flush(struct conn * c){
+    struct relay_pipes * p = c->pipes;
+    while (p->queued) {
+        ssize_t n = splice(p->to_client[0], NULL, c->connfd, NULL, p->queued,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                conn_want(c, c->connfd, POLLOUT);
+            else
+                conn_close(c);
+            return 0;
+        }
+        metric_add(&metrics_shard()->client_out, n);
+        c->bytes_out += n;
+        p->queued -= n;
+    }
+    return 1;
+}
+
+/*
+ * relay_window_head - c's client asked for a range of the whole response
+ * being relayed. Build the 206 for it, or a 416, in c->response and set the
+ * window of body bytes the client gets, the rest is only stored
+ * Returns the head's length, 0 to send the whole response
+ */
+static size_t relay_window_head(struct conn * c, char * hdr, size_t hdr_len, long total){
+    struct byte_range r;
+    char extra[80];
+    if (!if_range_ok(c, c->meta.etag.p, c->meta.etag.len, c->meta.last_modified))
+        return 0;
+    int n = parse_range(c->range, total, &r, 1);
+    if (n < 0)
+        return 0;
+    c->windowed = 1;
+    if (n == 0) {
+        char head[128];
+        size_t len = sprintf(head, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                   "Content-Range: bytes */%ld\r\n\r\n", total);
+        c->win_skip = total;
+        c->win_left = 0;
+        return client_head(c, c->response, head, len, 0, -1);
+    }
+    sprintf(extra, "Content-Range: bytes %zu-%zu/%ld\r\n", r.first, r.last, total);
+    char * head = malloc(hdr_len + sizeof(extra) + 32);
+    size_t len = range_head(head, hdr, hdr_len, "206 Partial Content", 0, extra);
+    c->win_skip = r.first;
+    c->win_left = r.last - r.first + 1;
+    len = client_head(c, c->response, head, len, c->win_left, c->meta.age);
+    free(head);
+    return len;
+}
+
+/*keep the n body bytes at data that fall in c's window, moved to its start*/
+static size_t relay_window(struct conn * c, char * data, size_t n){
+    size_t skip = c->win_skip < n ? c->win_skip : n;
+    memmove(data, data + skip, n - skip);
+    n -= skip;
+    c->win_skip -= skip;
+    if (n > c->win_left)
+        n = c->win_left;
+    c->win_left -= n;
+    return n;
+}
+
+/*
+ * relay_finish - the end server response is complete, keep the cache file
+ * and hand the end server connection back to the pool if it can be reused
+ */
+void relay_finish(struct conn * c){
+    struct fill * fill = c->fill;
+    int cached = 0;
+    scan_end(c);
+    if (fill && fill->fd < 0) {
+        size_t off;
+        struct segment * seg = segment_append(fill->buf, fill->len, &off);
+        if (seg) {
+            addto_webcache(c->key, fill->len, c->head, c->cached_hdr_len, &c->meta, seg, off, -1);
+            cached = 1;
+        }
+    }
+    else if (fill) {
+        if (rename(c->tmpname, c->filename) == 0) {
+            addto_webcache(c->key, fill->len, c->head, c->cached_hdr_len, &c->meta, NULL, 0, fill->fd);
+            cached = 1;
+        }
+        else
+            unlink(c->tmpname);
+    }
+    if (fill)
+        fill_end(c, FILL_DONE);
+    flight_finish(c, cached);
+    if (c->serv_keepalive && !c->body.extra)
+        upstream_release(c);
+    else
+        close(c->serv_sockfd);
+    c->serv_sockfd = -1;
+}
+
+/*
+ * relay_not_modified - the end server confirmed c's stale copy with a 304,
+ * store the copy's head updated from the 304 and answer from the cache file
+ */
+void relay_not_modified(struct conn * c, char * hdr, size_t hdr_len){
+    struct web_cache * stale = c->entry;
+    char * merged = malloc(stale->hdr_len + hdr_len + 1);
+    size_t merged_len = merge_head(merged, stale->hdr, stale->hdr_len, hdr, hdr_len);
+    char * head = malloc(2 * merged_len + 3);
+    size_t head_len;
+    struct http_body body;
+    struct cache_meta meta;
+    int keepalive, indexed;
+
+    parse_response_head(merged, merged_len, head, &head_len, &body, &keepalive, &meta);
+    meta.age = c->meta.age;
+    c->entry = refresh_webcache(stale, head, head_len, &meta, &indexed);
+    //the file stays open for us once the stale copy is gone
+    if (!c->own_fd) {
+        c->file_fd = dup(c->file_fd);
+        c->own_fd = 1;
+    }
+    release_webcache(stale);
+    atomic_fetch_add(&cache_stats.revalidated, 1);
+    c->cache_status = CACHE_REVALIDATED;
+    free(merged);
+    free(head);
+    free(hdr);
+
+    abandon_cache_file(c);
+    flight_finish(c, indexed);
+    relay_finish(c);
+    free(c->head);
+    c->head = NULL;
+    c->head_len = 0;
+    c->head_done = 1;
+    conn_queue_cached(c);
+}
+
+/*
+ * relay_head - parse the end server response head once it is complete and
+ * queue the client's head plus any body bytes that came with it
+ * Returns 0 if more of the head is needed
+ */
+int relay_head(struct conn * c){
+    char * end = memmem(c->head, c->head_len, "\r\n\r\n", 4);
+    if (!end) {
+        if (c->head_len == MAXBUF) {
+            abandon_cache_file(c);
+            conn_error(c, "502 Bad Gateway");
+        }
+        return 0;
+    }
+    size_t len = end + 4 - c->head;
+    char * hdr = malloc(2 * len + 3);     /* bare LF line ends grow to CRLF */
+    size_t hdr_len;
+    int status = parse_response_head(c->head, len, hdr, &hdr_len, &c->body, &c->serv_keepalive,
+                                     &c->meta);
+    if (status < 0) {
+        free(hdr);
+        abandon_cache_file(c);
+        conn_error(c, "502 Bad Gateway");
+        return 0;
+    }
+    c->meta.prefetched = c->prefetch;
+    if (status < 200) {
+        //interim response, wait for the real one
+        free(hdr);
+        memmove(c->head, c->head + len, c->head_len - len);
+        c->head_len -= len;
+        return relay_head(c);
+    }
+    if (status == 304 && c->entry) {
+        c->body.extra |= c->head_len > len;
+        relay_not_modified(c, hdr, hdr_len);
+        return 0;
+    }
+    long content_length = c->body.framing == BODY_LENGTH ? (long)c->body.left : -1;
+    if (!c->no_store && !webcache_storable(&c->meta, c->authorized)) {
+        //not for storing, let waiters fetch it themselves
+        flight_finish(c, 0);
+        atomic_fetch_add(&cache_stats.uncacheable, 1);
+    }
+    else if (!c->no_store && !fill_start(c, hdr, hdr_len, content_length))
+        flight_finish(c, 0);
+    if (c->fill) {
+        enum content_coding have = head_coding(hdr, hdr_len);
+        c->vary_coding = have == CODING_GZIP ||
+                         (have == CODING_IDENTITY && head_compressible(hdr, hdr_len, status, content_length));
+    }
+    c->resp_len = c->range && status == 200 && content_length >= 0 ?
+                  relay_window_head(c, hdr, hdr_len, content_length) : 0;
+    if (!c->resp_len)
+        c->resp_len = client_head(c, c->response, hdr, hdr_len, content_length, c->meta.age);
+    c->resp_off = 0;
+    cache_write(c, hdr, hdr_len);
+    if (prefetcher.enabled && !c->prefetch && status == 200)
+        scan_start(c, hdr, hdr_len);
+    if (logger.debug_bodies)
+        fwrite(c->response, sizeof(char), c->resp_len, stdout);
+
+    //body bytes that arrived with the head
+    size_t n = c->head_len - len;
+    char * data = c->response + c->resp_len + CHUNK_ROOM;
+    memcpy(data, c->head + len, n);
+    n = body_decode(&c->body, data, n);
+    if (logger.debug_bodies)
+        fwrite(data, sizeof(char), n, stdout);
+    cache_write(c, data, n);
+    if (c->scan)
+        scan_body(c, data, n);
+    if (c->windowed)
+        n = relay_window(c, data, n);
+    queue_body(c, n);
+
+    //keep the stored head for the cache entry
+    free(c->head);
+    c->head = hdr;
+    c->cached_hdr_len = hdr_len;
+    c->head_done = 1;
+    if (c->body.done)
+        relay_finish(c);
+    return 1;
+}
+
+/*
+ * conn_relay - move the end server response to the client and the cache file,
+ * splicing the body through pipes where it needs no framing or buffering and
+ * copying it through the relay buffer otherwise
+ */
+int conn_relay(struct conn * c){
+    for (;;) {
+        if (!flush_response(c))
+            return 0;
+        if (c->pipes && !relay_pipes_flush(c))
+            return 0;
+        if (c->body.done && c->head_done)
+            return conn_next_request(c);
+        char * dst = c->head_done ? c->response + CHUNK_ROOM : c->head + c->head_len;
+        size_t room = c->head_done ? RELAYBUF : MAXBUF - c->head_len;
+        int spliced = c->head_done && relay_can_splice(c);
+        ssize_t n = spliced ? relay_splice_in(c) : recv(c->serv_sockfd, dst, room, 0);
+        if (n < 0 && spliced && (errno == EINVAL || errno == ENOSYS)) {
+            //nothing was taken off the socket, copy from now on
+            atomic_store(&splice_enabled, 0);
+            log_msg(LOG_WARN, "splice unavailable (%s), relaying by copying", strerror(errno));
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_want(c, c->serv_sockfd, POLLIN);
+            return 0;
+        }
+        if (n <= 0) {
+            if (!c->head_done && c->head_len == 0 && c->serv_reused)
+                return conn_retry(c);
+            if (n == 0 && c->head_done && c->body.framing == BODY_UNTIL_CLOSE) {
+                c->body.done = 1;
+                relay_finish(c);
+                queue_body(c, 0);
+                continue;
+            }
+            if (!c->head_done) {
+                abandon_cache_file(c);
+                conn_error(c, "502 Bad Gateway");
+                return 1;
+            }
+            //partial response, do not keep it
+            conn_close(c);
+            return 0;
+        }
+        metric_add(&metrics_shard()->upstream_in, n);
+        if (!c->head_done) {
+            c->head_len += n;
+            if (!relay_head(c) && c->state != CONN_RELAY)
+                return 1;
+            continue;
+        }
+        if (spliced) {
+            metric_add(&metrics_shard()->upstream_spliced, n);
+            if (c->body.done)
+                relay_finish(c);
+            continue;
+        }
+        n = body_decode(&c->body, dst, n);
+        if (logger.debug_bodies)
+            fwrite(dst, sizeof(char), n, stdout);
+        cache_write(c, dst, n);
+        if (c->scan)
+            scan_body(c, dst, n);
+        if (c->windowed)
+            n = relay_window(c, dst, n);
+        queue_body(c, n);
+        if (c->body.done)
+            relay_finish(c);
+    }
+}
+
+/*set up one direction of a tunnel, splicing through a pipe if it can*/
+static void tunnel_dir_init(struct tunnel_dir * d, int from, int to){
+    d->from = from;
+    d->to = to;
+    d->pipe[0] = d->pipe[1] = -1;
+    if (!atomic_load_explicit(&splice_enabled, memory_order_relaxed) || pipe2(d->pipe, O_NONBLOCK) < 0) {
+        d->pipe[0] = d->pipe[1] = -1;
+        d->buf = malloc(RELAYBUF);
+    }
+}
+
+/*
+ * tunnel_start - the end server for a CONNECT is connected, answer 200 and
+ * relay whatever either side sends from here on. Bytes the client sent
+ * after the CONNECT head go to the end server first
+ */
+int tunnel_start(struct conn * c){
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    struct tunnel * t = calloc(1, sizeof(struct tunnel));
+    tunnel_dir_init(&t->up, c->connfd, c->serv_sockfd);
+    tunnel_dir_init(&t->down, c->serv_sockfd, c->connfd);
+    if (c->buf_len) {
+        if (!t->up.buf)
+            t->up.buf = malloc(RELAYBUF);
+        if (c->buf_len > RELAYBUF)
+            t->up.buf = realloc(t->up.buf, c->buf_len);
+        memcpy(t->up.buf, c->buf, c->buf_len);
+        t->up.len = c->buf_len;
+        c->buf_len = 0;
+    }
+    c->tunnel = t;
+    metric_add(&metrics_shard()->tunnels_opened, 1);
+    free(c->response);
+    c->response = strdup(established);
+    c->resp_len = strlen(established);
+    c->resp_off = 0;
+    c->status = 200;
+    c->state = CONN_TUNNEL;
+    return 1;
+}
+
+/*count n bytes written one way through c's tunnel*/
+static void tunnel_count(struct conn * c, struct tunnel_dir * d, size_t n){
+    struct metrics_shard * m = metrics_shard();
+    if (d == &c->tunnel->up) {
+        metric_add(&m->client_in, n);
+        metric_add(&m->upstream_out, n);
+        metric_add(&m->tunnel_up, n);
+    }
+    else {
+        metric_add(&m->upstream_in, n);
+        metric_add(&m->client_out, n);
+        metric_add(&m->tunnel_down, n);
+        c->bytes_out += n;
+    }
+}
+
+/*
+ * tunnel_pump - move bytes one way through c's tunnel until the sending
+ * side has nothing more or the receiving side takes no more, and pass an
+ * end of stream on as a half close once everything before it is out
+ * Returns -1 if either side failed
+ */
+static int tunnel_pump(struct conn * c, struct tunnel_dir * d){
+    for (;;) {
+        ssize_t n;
+        if (d->off < d->len) {
+            n = send(d->to, d->buf + d->off, d->len - d->off, 0);
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            d->off += n;
+            tunnel_count(c, d, n);
+            continue;
+        }
+        if (d->queued) {
+            n = splice(d->pipe[0], NULL, d->to, NULL, d->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            d->queued -= n;
+            tunnel_count(c, d, n);
+            continue;
+        }
+        if (d->eof) {
+            if (!d->shut)
+                shutdown(d->to, SHUT_WR);
+            d->shut = 1;
+            return 0;
+        }
+        if (d->pipe[0] >= 0) {
+            n = splice(d->from, NULL, d->pipe[1], NULL, RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                //nothing was taken off the socket, copy from now on
+                atomic_store(&splice_enabled, 0);
+                log_msg(LOG_WARN, "splice unavailable (%s), relaying by copying", strerror(errno));
+                close(d->pipe[0]);
+                close(d->pipe[1]);
+                d->pipe[0] = d->pipe[1] = -1;
+                if (!d->buf)
+                    d->buf = malloc(RELAYBUF);
+                continue;
+            }
+            if (n > 0)
+                d->queued = n;
+        }
+        else {
+            n = recv(d->from, d->buf, RELAYBUF, 0);
+            if (n > 0) {
+                d->off = 0;
+                d->len = n;
+            }
+        }
+        if (n == 0)
+            d->eof = 1;
+        else if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+}
+
+/*
+ * conn_tunnel - relay both ways until each side has closed its half, or
+ * either fails. Both sockets are driven from whichever one has an event
+ */
+int conn_tunnel(struct conn * c){
+    struct tunnel * t = c->tunnel;
+    if (!flush_response(c))
+        return 0;
+    if (tunnel_pump(c, &t->up) < 0 || tunnel_pump(c, &t->down) < 0 || (t->up.shut && t->down.shut))
+        conn_close(c);
+    return 0;
+}
+
+/*
+ * tunnel_poll - what a parked pool connection waits for on the client
+ * (pfd[0]) and the end server (pfd[1]): readable where a direction has
+ * nothing in flight, writable where it has
+ */
+void tunnel_poll(struct conn * c, struct pollfd * pfd){
+    struct tunnel * t = c->tunnel;
+    struct tunnel_dir * dirs[2] = {&t->up, &t->down};
+    pfd[0].fd = c->connfd;
+    pfd[1].fd = c->serv_sockfd;
+    pfd[0].events = pfd[1].events = 0;
+    if (c->resp_off < c->resp_len) {
+        pfd[0].events = POLLOUT;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct tunnel_dir * d = dirs[i];
+        if (d->queued || d->off < d->len)
+            pfd[!i].events |= POLLOUT;
+        else if (!d->eof)
+            pfd[i].events |= POLLIN;
+    }
+}
+
+/*the tunnel is closing, record and log it*/
+void tunnel_end(struct conn * c){
+    struct tunnel * t = c->tunnel;
+    struct tunnel_dir * dirs[2] = {&t->up, &t->down};
+    metric_add(&metrics_shard()->tunnels_closed, 1);
+    log_access(c);
+    metrics_request_done(c);
+    for (int i = 0; i < 2; i++) {
+        if (dirs[i]->pipe[0] >= 0) {
+            close(dirs[i]->pipe[0]);
+            close(dirs[i]->pipe[1]);
+        }
+        free(dirs[i]->buf);
+    }
+    free(t);
+    c->tunnel = NULL;
+}
+
+/*
+ * conn_send_cached - send a cached webpage straight from the page cache,
+ * with sendfile or from the entry's mapping, after its head
+ */
+int conn_send_cached(struct conn * c){
+    if (!flush_response(c))
+        return 0;
+    while (c->file_left) {
+        ssize_t n;
+        if (c->map)
+            n = send(c->connfd, c->map + c->file_off, c->file_left, 0);
+        else
+            n = sendfile(c->connfd, c->file_fd, &c->file_off, c->file_left);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_want(c, c->connfd, POLLOUT);
+                return 0;
+            }
+            break;
+        }
+        if (n == 0)
+            break;
+        metric_add(&metrics_shard()->client_out, n);
+        c->bytes_out += n;
+        if (c->map)
+            c->file_off += n;
+        c->file_left -= n;
+    }
+    if (c->file_left) {
+        conn_close(c);
+        return 0;
+    }
+    return conn_next_request(c);
+}
+
+/*whether the client's validators match entry, so a 304 answers it*/
+static int client_not_modified(struct conn * c, struct web_cache * entry){
+    if (entry->status != 200)
+        return 0;
+    if (c->if_none_match)
+        return etag_match(c->if_none_match, entry->etag);
+    return c->if_modified_since >= 0 && entry->last_modified >= 0 &&
+           entry->last_modified <= c->if_modified_since;
+}
+
+/*
+ * accepts_gzip - whether an Accept-Encoding value lists gzip, or *, without
+ * a zero q value
+ */
+static int accepts_gzip(struct slice value){
+    char * p = value.p, * end = value.p + value.len;
+    while (p < end) {
+        char * item = p;
+        char * next = memchr(p, ',', end - p);
+        next = next ? next : end;
+        while (item < next && (*item == ' ' || *item == '\t'))
+            item++;
+        size_t name_len = strcspn(item, " \t;,");
+        if (item + name_len > next)
+            name_len = next - item;
+        if ((name_len == 4 && strncasecmp(item, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(item, "x-gzip", 6) == 0) ||
+            (name_len == 1 && *item == '*')) {
+            char * q = memmem(item, next - item, "q=", 2);
+            if (!q || strtod(q + 2, NULL) > 0)
+                return 1;
+        }
+        p = next + 1;
+    }
+    return 0;
+}
+
+/*value of the first name: field in a stored head, NULL if it has none*/
+static char * head_value(char * hdr, size_t hdr_len, const char * name, size_t * len){
+    char * line = head_field(hdr, hdr_len, (char *)name, strlen(name));
+    if (!line)
+        return NULL;
+    char * value = line + strlen(name) + 1, * eol = strstr(value, "\r\n");
+    while (value < eol && (*value == ' ' || *value == '\t'))
+        value++;
+    while (eol > value && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+    *len = eol - value;
+    return value;
+}
+
+static enum content_coding head_coding(char * hdr, size_t hdr_len){
+    size_t len;
+    char * value = head_value(hdr, hdr_len, "Content-Encoding", &len);
+    if (!value || (len == 8 && strncasecmp(value, "identity", 8) == 0))
+        return CODING_IDENTITY;
+    if ((len == 4 && strncasecmp(value, "gzip", 4) == 0) || (len == 6 && strncasecmp(value, "x-gzip", 6) == 0))
+        return CODING_GZIP;
+    return CODING_OTHER;
+}
+
+/*whether a 200 with body_len bytes (-1 unknown) is text that gzip shrinks and may be transformed*/
+static int head_compressible(char * hdr, size_t hdr_len, int status, long body_len){
+    static const char * types[] = {"text/", "application/javascript", "application/x-javascript",
+                                   "application/json", "application/xml", "image/svg+xml", NULL};
+    size_t len;
+    if (status != 200 || (body_len >= 0 && (body_len < GZIP_MIN_SIZE || body_len > GZIP_MAX_SIZE)))
+        return 0;
+    char * cc = head_value(hdr, hdr_len, "Cache-Control", &len);
+    if (cc && memmem(cc, len, "no-transform", 12))
+        return 0;
+    char * type = head_value(hdr, hdr_len, "Content-Type", &len);
+    if (!type)
+        return 0;
+    for (int i = 0; types[i]; i++)
+        if (len >= strlen(types[i]) && strncasecmp(type, types[i], strlen(types[i])) == 0)
+            return 1;
+    size_t type_len = strcspn(type, ";");
+    return (type_len > 5 && strncasecmp(type + type_len - 5, "+json", 5) == 0) ||
+           (type_len > 4 && strncasecmp(type + type_len - 4, "+xml", 4) == 0);
+}
+
+static int webcache_compressible(struct web_cache * entry){
+    return head_compressible(entry->hdr, entry->hdr_len, entry->status,
+                             (long)(entry->size - entry->body_off));
+}
+
+/*
+ * gzip_body - compress len bytes in one go
+ * Returns a malloced gzip stream of *out_len bytes, NULL if it failed
+ */
+static char * gzip_body(char * body, size_t len, size_t * out_len){
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    size_t cap = deflateBound(&zs, len);
+    char * out = malloc(cap);
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * gunzip_body - decompress a gzip stream of len bytes, to no more than max
+ * Returns a malloced body of *out_len bytes, NULL if it is corrupt or too big
+ */
+static char * gunzip_body(char * body, size_t len, size_t max, size_t * out_len){
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return NULL;
+    size_t cap = len * 4 + 1024;
+    char * out = malloc(cap);
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        if (zs.total_out == cap) {
+            if (cap >= max)
+                break;
+            cap = cap * 2 < max ? cap * 2 : max;
+            out = realloc(out, cap);
+        }
+        zs.next_out = (Bytef *)out + zs.total_out;
+        zs.avail_out = cap - zs.total_out;
+        rc = inflate(&zs, Z_NO_FLUSH);
+    }
+    *out_len = zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * variant_head - the stored head for a copy of hdr's body in coding want:
+ * Content-Encoding set to match, the entity tag marked with the coding so
+ * the two copies never validate each other, and Vary: Accept-Encoding
+ * Returns its length
+ */
+static size_t variant_head(char * dst, char * hdr, size_t hdr_len, enum content_coding want){
+    char * line = hdr, * end = hdr + hdr_len;
+    size_t len = 0;
+    int vary = 0;
+    while (line < end) {
+        char * eol = memchr(line, '\n', end - line) + 1;
+        size_t line_len = eol - line;
+        if (line_len <= 2)
+            break;  /* the blank line */
+        if (line_len > 17 && strncasecmp(line, "Content-Encoding:", 17) == 0) {
+            line = eol;
+            continue;
+        }
+        if (line_len > 5 && strncasecmp(line, "ETag:", 5) == 0) {
+            //"tag" becomes "tag-gzip", weak or strong
+            char * quote = memrchr(line, '"', line_len);
+            if (quote && quote > line + 5) {
+                memcpy(dst + len, line, quote - line);
+                len += quote - line;
+                len += sprintf(dst + len, "-%s", want == CODING_GZIP ? "gzip" : "identity");
+                memcpy(dst + len, quote, eol - quote);
+                len += eol - quote;
+                line = eol;
+                continue;
+            }
+        }
+        if (line_len > 5 && strncasecmp(line, "Vary:", 5) == 0) {
+            vary = 1;
+            if (!memmem(line, line_len, "ncoding", 7)) {
+                size_t text_len = line_len - (eol[-2] == '\r' ? 2 : 1);
+                memcpy(dst + len, line, text_len);
+                len += text_len;
+                len += sprintf(dst + len, ", Accept-Encoding\r\n");
+                line = eol;
+                continue;
+            }
+        }
+        memcpy(dst + len, line, line_len);
+        len += line_len;
+        line = eol;
+    }
+    if (want == CODING_GZIP)
+        len += sprintf(dst + len, "Content-Encoding: gzip\r\n");
+    if (!vary)
+        len += sprintf(dst + len, "Vary: Accept-Encoding\r\n");
+    len += sprintf(dst + len, "\r\n");
+    return len;
+}
+
+/*the cache key of uri's copy in coding want*/
+static void variant_key(char * uri, enum content_coding want, unsigned char * key){
+    uri_digest(uri, strlen(uri), want == CODING_GZIP ? "\ngzip" : "\nidentity", key);
+}
+
+/*
+ * make_variant - transcode entry's body to coding want and store the result
+ * under key, in a segment or a file of its own like a fetched response
+ * Returns 0 if it could not be made or stored
+ */
+static int make_variant(struct web_cache * entry, enum content_coding want, unsigned char * key){
+    size_t body_len = entry->size - entry->body_off, out_len;
+    char * body, * out;
+    if (entry->seg)
+        body = entry->seg->map + entry->seg_off + entry->body_off;
+    else {
+        int owned, fd = webcache_open(entry, &owned);
+        if (fd < 0)
+            return 0;
+        body = malloc(body_len + 1);
+        ssize_t n = pread(fd, body, body_len, entry->body_off);
+        if (owned)
+            close(fd);
+        if (n != (ssize_t)body_len) {
+            free(body);
+            return 0;
+        }
+    }
+    if (want == CODING_GZIP)
+        out = gzip_body(body, body_len, &out_len);
+    else
+        out = gunzip_body(body, body_len, cache_policy.max_obj, &out_len);
+    if (!entry->seg)
+        free(body);
+    if (!out)
+        return 0;
+
+    char * head = malloc(entry->hdr_len + 128);
+    size_t head_len = variant_head(head, entry->hdr, entry->hdr_len, want);
+    char * obj = malloc(2 * head_len + 3 + out_len);
+    size_t hdr_len, size;
+    struct http_body framing;
+    struct cache_meta meta;
+    int keepalive, stored = 0;
+    parse_response_head(head, head_len, obj, &hdr_len, &framing, &keepalive, &meta);
+    meta.age = webcache_age(entry);
+    memcpy(obj + hdr_len, out, out_len);
+    size = hdr_len + out_len;
+    free(out);
+
+    //meta points into head until the entry is made
+    if (size <= SEGMENT_OBJ_MAX) {
+        size_t off;
+        struct segment * seg = segment_append(obj, size, &off);
+        if (seg) {
+            addto_webcache(key, size, obj, hdr_len, &meta, seg, off, -1);
+            stored = 1;
+        }
+    }
+    else if (size <= cache_policy.max_obj) {
+        char filename[48], tmpname[56];
+        webcache_filename(key, worker_index, filename);
+        int fd = cache_tmpfile(filename, tmpname);
+        if (fd >= 0) {
+            stored = write(fd, obj, size) == (ssize_t)size && rename(tmpname, filename) == 0;
+            if (stored)
+                addto_webcache(key, size, obj, hdr_len, &meta, NULL, 0, fd);
+            else
+                unlink(tmpname);
+            close(fd);
+        }
+    }
+    free(obj);
+    free(head);
+    if (stored)
+        atomic_fetch_add(want == CODING_GZIP ? &cache_stats.gzipped : &cache_stats.gunzipped, 1);
+    return stored;
+}
+
+/*
+ * variant_request - have a variant thread make key's copy of entry in coding
+ * want, unless one is on the way already, and park c on it if c is given.
+ * The flight of key is the job, so requests for it are coalesced
+ * Returns 0 if the queue is full and nothing was asked for
+ */
+static int variant_request(struct web_cache * entry, enum content_coding want, unsigned char * key,
+                           struct conn * c){
+    struct flight_bucket * bucket = flight_bucket(key);
+    struct flight * f;
+    pthread_mutex_lock(&bucket->lock);
+    for (f = bucket->chain; f; f = f->next)
+        if (memcmp(f->key, key, MD5_DIGEST_LENGTH) == 0)
+            break;
+    if (!f) {
+        pthread_mutex_lock(&variants.lock);
+        if (variants.queued < VARIANT_QUEUE) {
+            f = calloc(1, sizeof(struct flight));
+            memcpy(f->key, key, MD5_DIGEST_LENGTH);
+            atomic_fetch_add(&entry->refcnt, 1);
+            f->source = entry;
+            f->want = want;
+            if (variants.jobs_tail)
+                variants.jobs_tail->job_next = f;
+            else
+                variants.jobs = f;
+            variants.jobs_tail = f;
+            variants.queued++;
+            pthread_cond_signal(&variants.cond);
+        }
+        pthread_mutex_unlock(&variants.lock);
+        if (!f) {
+            pthread_mutex_unlock(&bucket->lock);
+            return 0;
+        }
+        f->next = bucket->chain;
+        bucket->chain = f;
+    }
+    if (c) {
+        atomic_store(&c->flight_done, 0);
+        c->flight = f;
+        memcpy(c->flight_key, key, MD5_DIGEST_LENGTH);
+        c->flight_next = f->waiters;
+        f->waiters = c;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return 1;
+}
+
+/* variant routine, makes queued variants and wakes the clients waiting on them */
+void * variant_thread(void * vargp)
+{
+    while (keep_running) {
+        pthread_mutex_lock(&variants.lock);
+        while (!variants.jobs)
+            pthread_cond_wait(&variants.cond, &variants.lock);
+        struct flight * f = variants.jobs;
+        variants.jobs = f->job_next;
+        if (!variants.jobs)
+            variants.jobs_tail = NULL;
+        variants.queued--;
+        pthread_mutex_unlock(&variants.lock);
+
+        int stored = make_variant(f->source, f->want, f->key);
+        release_webcache(f->source);
+        flight_end(f, stored);
+    }
+    return NULL;
+}
+
+/*let go of c's cached copy and its descriptor*/
+static void conn_drop_entry(struct conn * c){
+    release_webcache(c->entry);
+    c->entry = NULL;
+    if (c->own_fd)
+        close(c->file_fd);
+    c->own_fd = 0;
+}
+
+/*
+ * conn_pick_variant - c->entry is the copy the end server sent. If the
+ * client cannot take its gzip coding, or would take a gzipped copy of a
+ * compressible identity one, switch to the variant in the coding it wants.
+ * A missing variant, or one older than the copy, is made by a variant
+ * thread. Meanwhile a client that takes gzip is sent the identity copy,
+ * and one that does not waits on the variant's flight
+ * Returns 0 if no stored copy can answer the client, 2 if c now waits
+ */
+static int conn_pick_variant(struct conn * c){
+    struct web_cache * entry = c->entry, * v;
+    enum content_coding have = head_coding(entry->hdr, entry->hdr_len), want;
+    size_t len;
+    if (have == CODING_GZIP && !c->accept_gzip)
+        want = CODING_IDENTITY;
+    else if (have == CODING_IDENTITY && c->accept_gzip && webcache_compressible(entry))
+        want = CODING_GZIP;
+    else
+        return 1;
+    //sending the identity copy is always fine, a gzip one is not
+    int fallback = want == CODING_GZIP;
+    char * cc = head_value(entry->hdr, entry->hdr_len, "Cache-Control", &len);
+    if (cc && memmem(cc, len, "no-transform", 12))
+        return fallback;
+
+    unsigned char key[MD5_DIGEST_LENGTH];
+    int fresh, owned;
+    variant_key(c->request_uri, want, key);
+    v = webcache_lookup(key, LONG_MAX, &fresh, 0);
+    if (!v || !fresh || v->stored < entry->stored) {
+        if (v)
+            release_webcache(v);
+        if (!variant_request(entry, want, key, fallback ? NULL : c) || fallback)
+            return fallback;
+        conn_drop_entry(c);
+        c->state = CONN_FLIGHT_WAIT;
+        return 2;
+    }
+    int fd = webcache_open(v, &owned);
+    if (fd < 0) {
+        release_webcache(v);
+        return fallback;
+    }
+    conn_drop_entry(c);
+    c->entry = v;
+    c->file_fd = fd;
+    c->own_fd = owned;
+    return 1;
+}
+
+/*
+ * whether entry's key is answered in the coding each client takes, a
+ * gzipped copy always is and an identity one if it can be compressed
+ */
+static int webcache_varies(struct web_cache * entry){
+    enum content_coding have = head_coding(entry->hdr, entry->hdr_len);
+    return have == CODING_GZIP || (have == CODING_IDENTITY && webcache_compressible(entry));
+}
+
+/*
+ * conn_queue_range - answer c's Range from c->entry, whose body starts at
+ * c->file_off: one range is sent from that offset like a whole body,
+ * several are read into a multipart/byteranges body, none that fit is a 416
+ * Returns 0 if the Range is to be ignored and the whole body sent
+ */
+static int conn_queue_range(struct conn * c, long age){
+    struct web_cache * entry = c->entry;
+    size_t total = entry->size - entry->body_off;
+    struct byte_range r[RANGE_MAX];
+    char extra[128];
+    if (!if_range_ok(c, entry->etag, entry->etag ? strlen(entry->etag) : 0, entry->last_modified))
+        return 0;
+    int n = parse_range(c->range, total, r, RANGE_MAX);
+    if (n < 0)
+        return 0;
+    if (n == 0) {
+        char head[128];
+        size_t len = sprintf(head, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                   "Content-Range: bytes */%zu\r\n\r\n", total);
+        c->file_left = 0;
+        c->resp_len = client_head(c, c->response, head, len, 0, -1);
+        atomic_fetch_add(&cache_stats.ranges, 1);
+        return 1;
+    }
+    char * head = malloc(entry->hdr_len + sizeof(extra) + 32);
+    if (n == 1) {
+        sprintf(extra, "Content-Range: bytes %zu-%zu/%zu\r\n", r[0].first, r[0].last, total);
+        size_t len = range_head(head, entry->hdr, entry->hdr_len, "206 Partial Content", 0, extra);
+        c->file_off += r[0].first;
+        c->file_left = r[0].last - r[0].first + 1;
+        c->resp_len = client_head(c, c->response, head, len, c->file_left, age);
+        free(head);
+        atomic_fetch_add(&cache_stats.ranges, 1);
+        return 1;
+    }
+
+    //several ranges, each a part with its own Content-Range
+    size_t type_len = 0, body_len = 64, part_max;
+    char * type = head_value(entry->hdr, entry->hdr_len, "Content-Type", &type_len);
+    char boundary[24];
+    unsigned long long nonce;
+    random_bytes(&nonce, sizeof(nonce));
+    sprintf(boundary, "%016llx", nonce);
+    part_max = 128 + type_len;
+    for (int i = 0; i < n; i++)
+        body_len += part_max + r[i].last - r[i].first + 1;
+    if (body_len > RANGE_MULTI_MAX) {
+        free(head);
+        return 0;
+    }
+    char * body = malloc(body_len), * p = body;
+    for (int i = 0; i < n; i++) {
+        size_t len = r[i].last - r[i].first + 1;
+        p += sprintf(p, "\r\n--%s\r\n", boundary);
+        if (type)
+            p += sprintf(p, "Content-Type: %.*s\r\n", (int)type_len, type);
+        p += sprintf(p, "Content-Range: bytes %zu-%zu/%zu\r\n\r\n", r[i].first, r[i].last, total);
+        if (c->map)
+            memcpy(p, c->map + c->file_off + r[i].first, len);
+        else if (pread(c->file_fd, p, len, c->file_off + r[i].first) != (ssize_t)len) {
+            free(body);
+            free(head);
+            return 0;
+        }
+        p += len;
+    }
+    p += sprintf(p, "\r\n--%s--\r\n", boundary);
+    sprintf(extra, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+    size_t len = range_head(head, entry->hdr, entry->hdr_len, "206 Partial Content", 1, extra);
+    c->response = realloc(c->response, len + 128 + (p - body));
+    c->resp_len = client_head(c, c->response, head, len, p - body, age);
+    memcpy(c->response + c->resp_len, body, p - body);
+    c->resp_len += p - body;
+    c->file_left = 0;
+    free(body);
+    free(head);
+    atomic_fetch_add(&cache_stats.ranges, 1);
+    return 1;
+}
+
+/*
+ * conn_queue_cached - queue c->entry's head for the client ahead of its
+ * body, or just a 304 if the client already has this copy
+ */
+void conn_queue_cached(struct conn * c){
+    struct web_cache * entry = c->entry;
+    long age = webcache_age(entry);
+
+    free(c->response);
+    c->response = malloc(entry->hdr_len + 256);
+    c->resp_off = 0;
+    c->file_off = entry->seg_off + entry->body_off;
+    c->vary_coding = webcache_varies(entry);
+    if (client_not_modified(c, entry)) {
+        c->file_left = 0;
+        c->resp_len = not_modified_head(c, c->response, entry, age);
+        atomic_fetch_add(&cache_stats.not_modified, 1);
+    }
+    else if (!c->range || entry->status != 200 || !conn_queue_range(c, age)) {
+        c->file_left = entry->size - entry->body_off;
+        c->resp_len = client_head(c, c->response, entry->hdr, entry->hdr_len, c->file_left, age);
+        //whole stored bodies can be asked for in ranges
+        if (entry->status == 200 && !head_field(entry->hdr, entry->hdr_len, "Accept-Ranges", 13))
+            c->resp_len += sprintf(c->response + c->resp_len - 2, "Accept-Ranges: bytes\r\n\r\n") - 2;
+    }
+    log_msg(LOG_DEBUG, "sending the following CACHED response to client: %s", c->request_uri);
+    c->state = CONN_SEND_CACHED;
+}
+
+/*
+ * conn_serve_cached - queue the cached copy of c's page if it is fresh, or
+ * whatever copy there is when any is set. A stale copy with validators is
+ * left in c->entry with its file open for the end server to revalidate
+ * Returns 1 if it will be sent from the cache, 2 if c waits on the variant
+ * in the coding it takes, and is fetched like a miss if that is not made
+ */
+int conn_serve_cached(struct conn * c, int any){
+    int fresh;
+    c->entry = webcache_lookup(c->key, c->max_age, &fresh, !c->prefetch);  /* prefetches are no client's */
+    if (!c->entry)
+        return 0;
+    if (!fresh && !any && !c->entry->etag && c->entry->last_modified < 0) {
+        release_webcache(c->entry);
+        c->entry = NULL;
+        return 0;
+    }
+    c->file_fd = webcache_open(c->entry, &c->own_fd);
+    if (c->file_fd < 0) {
+        release_webcache(c->entry);
+        c->entry = NULL;
+        return 0;
+    }
+    if (!fresh && !any)
+        return 0;
+    if (!c->prefetch && atomic_exchange(&c->entry->prefetched, 0))
+        atomic_fetch_add(&prefetcher.used, 1);
+    int picked = conn_pick_variant(c);
+    if (!picked) {
+        conn_drop_entry(c);
+        return 0;
+    }
+    if (picked == 2)
+        return 2;
+    c->map = webcache_map(c->entry, c->file_fd);
+    conn_queue_cached(c);
+    return 1;
+}
+
+/*queue the head of the download c reads along with*/
+static void conn_tail_start(struct conn * c){
+    struct fill * fill = c->tail;
+    free(c->response);
+    c->response = malloc(fill->hdr_len + 128);
+    c->resp_off = 0;
+    c->resp_len = client_head(c, c->response, fill->hdr, fill->hdr_len, fill->content_length,
+                              fill->age);
+    c->file_off = fill->hdr_len;
+    c->file_left = fill->content_length;
+    atomic_fetch_add(&cache_stats.coalesced, 1);
+    atomic_fetch_add(&cache_stats.tailed, 1);
+    c->cache_status = CACHE_TAILED;
+    log_msg(LOG_DEBUG, "sending the following response to client as it downloads: %s", c->request_uri);
+    c->state = CONN_TAIL;
+}
+
+/*
+ * conn_tail - send what is stored so far of another client's download, from
+ * its buffer or file, and park until more of it lands
+ */
+int conn_tail(struct conn * c){
+    struct fill * fill = c->tail;
+    if (!flush_response(c))
+        return 0;
+    while (c->file_left) {
+        pthread_mutex_lock(&fill->lock);
+        size_t avail = fill->len - c->file_off;
+        if (!avail && fill->state == FILL_RUNNING) {
+            atomic_store(&c->tail_ready, 0);
+            c->tail_next = fill->readers;
+            fill->readers = c;
+            pthread_mutex_unlock(&fill->lock);
+            c->state = CONN_TAIL_WAIT;
+            return 1;
+        }
+        pthread_mutex_unlock(&fill->lock);
+        if (!avail)
+            break;  /* the download failed */
+        if (avail > c->file_left)
+            avail = c->file_left;
+        ssize_t n;
+        if (fill->fd < 0)
+            n = send(c->connfd, fill->buf + c->file_off, avail, 0);
+        else
+            n = sendfile(c->connfd, fill->fd, &c->file_off, avail);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn_want(c, c->connfd, POLLOUT);
+                return 0;
+            }
+            break;
+        }
+        if (n == 0)
+            break;
+        metric_add(&metrics_shard()->client_out, n);
+        c->bytes_out += n;
+        if (fill->fd < 0)
+            c->file_off += n;
+        c->file_left -= n;
+    }
+    if (c->file_left) {
+        conn_close(c);
+        return 0;
+    }
+    return conn_next_request(c);
+}
+
+int conn_tail_wait(struct conn * c){
+    if (!conn_await(c, &c->tail_ready))
+        return 0;
+    c->state = CONN_TAIL;
+    return 1;
+}
+
+/*
+ * conn_flight_wait - the client fetching this page is done, answer from the
+ * cache, or fetch it here if it was not cached. If it published its download
+ * on the way, read along with it instead
+ */
+int conn_flight_wait(struct conn * c){
+    if (!conn_await(c, &c->flight_done))
+        return 0;
+    if (c->tail && head_coding(c->tail->hdr, c->tail->hdr_len) == CODING_GZIP && !c->accept_gzip) {
+        //a download the client cannot read, fetch a copy of its own
+        fill_release(c->tail);
+        c->tail = NULL;
+        c->state = CONN_RESOLVE;
+        return 1;
+    }
+    if (c->tail) {
+        //reading along replaces any stale copy c meant to revalidate
+        if (c->entry)
+            release_webcache(c->entry);
+        c->entry = NULL;
+        if (c->own_fd)
+            close(c->file_fd);
+        c->own_fd = 0;
+        conn_tail_start(c);
+        return 1;
+    }
+    if (c->flight_cached) {
+        //the copy just stored replaces any stale one c meant to revalidate
+        struct web_cache * stale = c->entry;
+        int stale_fd = c->file_fd, stale_owned = c->own_fd;
+        c->entry = NULL;
+        c->own_fd = 0;
+        int cached = conn_serve_cached(c, 1);
+        if (cached == 2) {
+            //waiting on a variant of it now, keep the stale copy in case it is not made
+            c->entry = stale;
+            c->file_fd = stale_fd;
+            c->own_fd = stale_owned;
+            return 1;
+        }
+        if (cached) {
+            if (stale)
+                release_webcache(stale);
+            if (stale_owned)
+                close(stale_fd);
+            atomic_fetch_add(&cache_stats.coalesced, 1);
+            c->cache_status = CACHE_COALESCED;
+            return 1;
+        }
+        c->entry = stale;
+        c->file_fd = stale_fd;
+        c->own_fd = stale_owned;
+    }
+    c->state = CONN_RESOLVE;
+    return 1;
+}
+
+/*
+ * conn_run - advance a connection's state machine until it has to wait on I/O
+ */
+void conn_run(struct conn * c){
+    int progress = 1, requests = c->requests;
+    c->last_active = time(NULL);
+    //a pool worker stops after each response, see conn_drive
+    while (progress && (c->loop || c->requests == requests)) {
+        switch (c->state) {
+            case CONN_READ_REQUEST:
+                progress = conn_read_request(c);
+                break;
+            case CONN_FLIGHT_WAIT:
+                progress = conn_flight_wait(c);
+                break;
+            case CONN_RESOLVE:
+                progress = conn_resolve(c);
+                break;
+            case CONN_RESOLVE_WAIT:
+                progress = conn_resolve_wait(c);
+                break;
+            case CONN_CONNECT:
+                progress = conn_connect(c);
+                break;
+            case CONN_SEND_REQUEST:
+                progress = conn_send_request(c);
+                break;
+            case CONN_RELAY:
+                progress = conn_relay(c);
+                break;
+            case CONN_SEND_CACHED:
+                progress = conn_send_cached(c);
+                break;
+            case CONN_TAIL:
+                progress = conn_tail(c);
+                break;
+            case CONN_TAIL_WAIT:
+                progress = conn_tail_wait(c);
+                break;
+            case CONN_TUNNEL:
+                progress = conn_tunnel(c);
+                break;
+            case CONN_SEND_ERROR:
+                if (flush_response(c)) {
+                    log_access(c);
+                    metrics_request_done(c);
+                    conn_close(c);
+                }
+                progress = 0;
+                break;
+            case CONN_CLOSE:
+                progress = 0;
+                break;
+        }
+    }
+}
+
+uint64_t monotonic_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * random_bytes - len unpredictable bytes at buf, for ids that go on the
+ * wire. Without getrandom they come from a splitmix64 sequence seeded once
+ * from /dev/urandom, with the pid mixed in so forked workers differ
+ */
+static void random_bytes(void * buf, size_t len){
+    static _Atomic uint64_t state;
+    if (getrandom(buf, len, GRND_NONBLOCK) == (ssize_t)len)
+        return;
+    if (!atomic_load(&state)) {
+        uint64_t seed = 0, zero = 0;
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd < 0 || read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = monotonic_us() ^ (uint64_t)time(NULL) << 20;
+        if (fd >= 0)
+            close(fd);
+        atomic_compare_exchange_strong(&state, &zero, seed | 1);
+    }
+    for (size_t off = 0; off < len; off += 8) {
+        uint64_t z = atomic_fetch_add(&state, 0x9e3779b97f4a7c15ULL) ^ (uint64_t)getpid() << 32;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        memcpy((char *)buf + off, &z, len - off < 8 ? len - off : 8);
+    }
+}
+
+/*the calling thread's shard, made and listed the first time it records*/
+struct metrics_shard * metrics_shard(void){
+    if (!thread_metrics) {
+        thread_metrics = calloc(1, sizeof(struct metrics_shard));
+        pthread_mutex_lock(&metrics.lock);
+        thread_metrics->next = metrics.shards;
+        metrics.shards = thread_metrics;
+        pthread_mutex_unlock(&metrics.lock);
+    }
+    return thread_metrics;
+}
+
+/*counter is only written by this thread, readers may see it a little behind*/
+void metric_add(atomic_ulong * counter, unsigned long n){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned histogram_index(uint64_t v){
+    if (v < (1 << HIST_SUB_BITS))
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+           ((v >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*smallest value that lands in bucket idx*/
+static uint64_t histogram_floor(unsigned idx){
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    return (uint64_t)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+}
+
+static void histogram_record(struct histogram * h, uint64_t v){
+    metric_add(&h->counts[histogram_index(v)], 1);
+    metric_add(&h->sum, v);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+/*time since start goes in this thread's histogram of phase, returns it*/
+uint64_t metrics_phase(enum phase phase, uint64_t start){
+    uint64_t elapsed = monotonic_us() - start;
+    histogram_record(&metrics_shard()->phases[phase], elapsed);
+    return elapsed;
+}
+
+/*the response to c's request is out, count it unless it was not timed or was a prefetch*/
+void metrics_request_done(struct conn * c){
+    if (c->req_start && !c->prefetch) {
+        struct metrics_shard * m = metrics_shard();
+        histogram_record(&m->phases[c->tunnel ? PHASE_TUNNEL : PHASE_TOTAL], monotonic_us() - c->req_start);
+        metric_add(&m->requests, 1);
+    }
+    c->req_start = 0;
+    c->responded = 0;
+}
+
+/*metrics_snapshot - sum every shard into sum*/
+static void metrics_snapshot(struct metrics_shard * sum){
+    pthread_mutex_lock(&metrics.lock);
+    for (struct metrics_shard * m = metrics.shards; m; m = m->next) {
+        for (int p = 0; p < PHASES; p++) {
+            struct histogram * h = &m->phases[p], * to = &sum->phases[p];
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                metric_add(&to->counts[i], atomic_load_explicit(&h->counts[i], memory_order_relaxed));
+            metric_add(&to->sum, atomic_load_explicit(&h->sum, memory_order_relaxed));
+            if (atomic_load(&h->max) > atomic_load(&to->max))
+                atomic_store(&to->max, atomic_load(&h->max));
+        }
+        metric_add(&sum->requests, atomic_load(&m->requests));
+        metric_add(&sum->conns_opened, atomic_load(&m->conns_opened));
+        metric_add(&sum->conns_closed, atomic_load(&m->conns_closed));
+        metric_add(&sum->client_in, atomic_load(&m->client_in));
+        metric_add(&sum->client_out, atomic_load(&m->client_out));
+        metric_add(&sum->upstream_in, atomic_load(&m->upstream_in));
+        metric_add(&sum->upstream_out, atomic_load(&m->upstream_out));
+        metric_add(&sum->upstream_spliced, atomic_load(&m->upstream_spliced));
+        metric_add(&sum->tunnels_opened, atomic_load(&m->tunnels_opened));
+        metric_add(&sum->tunnels_closed, atomic_load(&m->tunnels_closed));
+        metric_add(&sum->tunnel_up, atomic_load(&m->tunnel_up));
+        metric_add(&sum->tunnel_down, atomic_load(&m->tunnel_down));
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+static unsigned long histogram_count(struct histogram * h){
+    unsigned long count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        count += atomic_load(&h->counts[i]);
+    return count;
+}
+
+/*value at quantile q, the top of the bucket it falls in*/
+static uint64_t histogram_quantile(struct histogram * h, unsigned long count, double q){
+    unsigned long rank = q * count + 0.999999, seen = 0;
+    uint64_t max = atomic_load(&h->max);
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += atomic_load(&h->counts[i]);
+        if (seen >= rank) {
+            uint64_t top = histogram_floor(i + 1) - 1;
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+static const char * phase_names[PHASES] = {
+    "parse", "blacklist", "dns_hit", "dns_miss", "connect", "ttfb", "total", "tunnel"
+};
+
+/*prometheus text exposition, latencies in seconds with power of two microsecond buckets*/
+static void metrics_prometheus(FILE * out, struct metrics_shard * m, unsigned long hits,
+                               unsigned long misses, unsigned long expired, size_t live){
+    unsigned long lookups = hits + misses;
+    fprintf(out, "# HELP proxy_requests_total Responses completed.\n"
+                 "# TYPE proxy_requests_total counter\n"
+                 "proxy_requests_total %lu\n"
+                 "# HELP proxy_connections_active Client connections open.\n"
+                 "# TYPE proxy_connections_active gauge\n"
+                 "proxy_connections_active %ld\n"
+                 "# HELP proxy_connections_total Client connections accepted.\n"
+                 "# TYPE proxy_connections_total counter\n"
+                 "proxy_connections_total %lu\n",
+            atomic_load(&m->requests),
+            (long)(atomic_load(&m->conns_opened) - atomic_load(&m->conns_closed)),
+            atomic_load(&m->conns_opened));
+    fprintf(out, "# HELP proxy_bytes_total Bytes moved, by peer and direction.\n"
+                 "# TYPE proxy_bytes_total counter\n"
+                 "proxy_bytes_total{peer=\"client\",direction=\"in\"} %lu\n"
+                 "proxy_bytes_total{peer=\"client\",direction=\"out\"} %lu\n"
+                 "proxy_bytes_total{peer=\"upstream\",direction=\"in\"} %lu\n"
+                 "proxy_bytes_total{peer=\"upstream\",direction=\"out\"} %lu\n"
+                 "# HELP proxy_spliced_bytes_total End server bytes relayed with splice instead of copied.\n"
+                 "# TYPE proxy_spliced_bytes_total counter\n"
+                 "proxy_spliced_bytes_total %lu\n",
+            atomic_load(&m->client_in), atomic_load(&m->client_out),
+            atomic_load(&m->upstream_in), atomic_load(&m->upstream_out),
+            atomic_load(&m->upstream_spliced));
+    fprintf(out, "# HELP proxy_tunnels_active CONNECT tunnels open.\n"
+                 "# TYPE proxy_tunnels_active gauge\n"
+                 "proxy_tunnels_active %ld\n"
+                 "# HELP proxy_tunnels_total CONNECT tunnels established.\n"
+                 "# TYPE proxy_tunnels_total counter\n"
+                 "proxy_tunnels_total %lu\n"
+                 "# HELP proxy_tunnel_bytes_total Bytes relayed through CONNECT tunnels, by direction.\n"
+                 "# TYPE proxy_tunnel_bytes_total counter\n"
+                 "proxy_tunnel_bytes_total{direction=\"up\"} %lu\n"
+                 "proxy_tunnel_bytes_total{direction=\"down\"} %lu\n",
+            (long)(atomic_load(&m->tunnels_opened) - atomic_load(&m->tunnels_closed)),
+            atomic_load(&m->tunnels_opened), atomic_load(&m->tunnel_up), atomic_load(&m->tunnel_down));
+    fprintf(out, "# HELP proxy_prefetch_links_total Links found in HTML pages, by what became of them.\n"
+                 "# TYPE proxy_prefetch_links_total counter\n"
+                 "proxy_prefetch_links_total{result=\"queued\"} %lu\n"
+                 "proxy_prefetch_links_total{result=\"skipped\"} %lu\n"
+                 "proxy_prefetch_links_total{result=\"dropped\"} %lu\n"
+                 "# HELP proxy_prefetches_total Prefetches run, by outcome.\n"
+                 "# TYPE proxy_prefetches_total counter\n"
+                 "proxy_prefetches_total{result=\"fetched\"} %lu\n"
+                 "proxy_prefetches_total{result=\"failed\"} %lu\n"
+                 "# HELP proxy_prefetch_used_total Prefetched objects a client went on to hit.\n"
+                 "# TYPE proxy_prefetch_used_total counter\n"
+                 "proxy_prefetch_used_total %lu\n",
+            atomic_load(&prefetcher.found), atomic_load(&prefetcher.skipped),
+            atomic_load(&prefetcher.dropped), atomic_load(&prefetcher.fetched),
+            atomic_load(&prefetcher.failed), atomic_load(&prefetcher.used));
+    fprintf(out, "# HELP proxy_worker_process Worker process that answered, counters are its own.\n"
+                 "# TYPE proxy_worker_process gauge\n"
+                 "proxy_worker_process %d\n"
+                 "# HELP proxy_shared_entries_total Web cache entries offered to or taken from other worker processes.\n"
+                 "# TYPE proxy_shared_entries_total counter\n"
+                 "proxy_shared_entries_total{op=\"published\"} %lu\n"
+                 "proxy_shared_entries_total{op=\"borrowed\"} %lu\n"
+                 "# HELP proxy_shared_dns_hits_total Lookups answered by another worker process's resolver.\n"
+                 "# TYPE proxy_shared_dns_hits_total counter\n"
+                 "proxy_shared_dns_hits_total %lu\n",
+            worker_index, atomic_load(&cache_stats.published), atomic_load(&cache_stats.borrowed),
+            atomic_load(&resolver.shared_hits));
+    fprintf(out, "# HELP proxy_cache_lookups_total Web cache lookups, expired ones are also misses.\n"
+                 "# TYPE proxy_cache_lookups_total counter\n"
+                 "proxy_cache_lookups_total{result=\"hit\"} %lu\n"
+                 "proxy_cache_lookups_total{result=\"miss\"} %lu\n"
+                 "proxy_cache_lookups_total{result=\"expired\"} %lu\n"
+                 "# TYPE proxy_cache_hit_ratio gauge\n"
+                 "proxy_cache_hit_ratio %.6f\n"
+                 "# TYPE proxy_cache_miss_ratio gauge\n"
+                 "proxy_cache_miss_ratio %.6f\n"
+                 "# TYPE proxy_cache_expired_ratio gauge\n"
+                 "proxy_cache_expired_ratio %.6f\n"
+                 "# HELP proxy_cache_bytes Bytes of cached objects.\n"
+                 "# TYPE proxy_cache_bytes gauge\n"
+                 "proxy_cache_bytes %zu\n"
+                 "# TYPE proxy_cache_capacity_bytes gauge\n"
+                 "proxy_cache_capacity_bytes %zu\n"
+                 "# HELP proxy_cache_segment_live_bytes Bytes of log segments still indexed.\n"
+                 "# TYPE proxy_cache_segment_live_bytes gauge\n"
+                 "proxy_cache_segment_live_bytes %zu\n",
+            hits, misses, expired,
+            lookups ? (double)hits / lookups : 0.0, lookups ? (double)misses / lookups : 0.0,
+            lookups ? (double)expired / lookups : 0.0,
+            cache_policy.bytes, cache_policy.capacity, live);
+    fprintf(out, "# HELP proxy_phase_seconds Latency of each request phase.\n"
+                 "# TYPE proxy_phase_seconds histogram\n");
+    for (int p = 0; p < PHASES; p++) {
+        struct histogram * h = &m->phases[p];
+        unsigned long below = 0;
+        int i = 0;
+        for (int bits = 0; bits <= 26; bits++) {
+            for (unsigned top = histogram_index(1ULL << bits); i < (int)top; i++)
+                below += atomic_load(&h->counts[i]);
+            fprintf(out, "proxy_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                    phase_names[p], (double)(1ULL << bits) / 1e6, below);
+        }
+        unsigned long count = histogram_count(h);
+        fprintf(out, "proxy_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                     "proxy_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+                     "proxy_phase_seconds_count{phase=\"%s\"} %lu\n",
+                phase_names[p], count, phase_names[p], atomic_load(&h->sum) / 1e6,
+                phase_names[p], count);
+    }
+}
+
+static void metrics_json(FILE * out, struct metrics_shard * m, unsigned long hits,
+                         unsigned long misses, unsigned long expired, size_t live){
+    unsigned long lookups = hits + misses;
+    fprintf(out, "{\"uptime\":%.3f,\"requests\":%lu,"
+                 "\"connections\":{\"active\":%ld,\"total\":%lu},"
+                 "\"bytes\":{\"client_in\":%lu,\"client_out\":%lu,\"upstream_in\":%lu,\"upstream_out\":%lu,"
+                 "\"upstream_spliced\":%lu},\"tunnels\":{\"active\":%ld,\"total\":%lu,\"up\":%lu,\"down\":%lu},"
+                 "\"prefetch\":{\"queued\":%lu,\"skipped\":%lu,\"dropped\":%lu,\"fetched\":%lu,"
+                 "\"failed\":%lu,\"used\":%lu},"
+                 "\"worker\":%d,\"shared\":{\"published\":%lu,\"borrowed\":%lu,\"dns\":%lu},",
+            (monotonic_us() - metrics.started) / 1e6, atomic_load(&m->requests),
+            (long)(atomic_load(&m->conns_opened) - atomic_load(&m->conns_closed)),
+            atomic_load(&m->conns_opened), atomic_load(&m->client_in), atomic_load(&m->client_out),
+            atomic_load(&m->upstream_in), atomic_load(&m->upstream_out), atomic_load(&m->upstream_spliced),
+            (long)(atomic_load(&m->tunnels_opened) - atomic_load(&m->tunnels_closed)),
+            atomic_load(&m->tunnels_opened), atomic_load(&m->tunnel_up), atomic_load(&m->tunnel_down),
+            atomic_load(&prefetcher.found), atomic_load(&prefetcher.skipped),
+            atomic_load(&prefetcher.dropped), atomic_load(&prefetcher.fetched),
+            atomic_load(&prefetcher.failed), atomic_load(&prefetcher.used),
+            worker_index, atomic_load(&cache_stats.published), atomic_load(&cache_stats.borrowed),
+            atomic_load(&resolver.shared_hits));
+    fprintf(out, "\"cache\":{\"hits\":%lu,\"misses\":%lu,\"expired\":%lu,\"hit_ratio\":%.6f,"
+                 "\"miss_ratio\":%.6f,\"expired_ratio\":%.6f,\"bytes\":%zu,\"capacity\":%zu,"
+                 "\"segment_live_bytes\":%zu},\"phases\":{",
+            hits, misses, expired,
+            lookups ? (double)hits / lookups : 0.0, lookups ? (double)misses / lookups : 0.0,
+            lookups ? (double)expired / lookups : 0.0,
+            cache_policy.bytes, cache_policy.capacity, live);
+    for (int p = 0; p < PHASES; p++) {
+        struct histogram * h = &m->phases[p];
+        unsigned long count = histogram_count(h);
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"mean_us\":%.1f,\"p50_us\":%lu,\"p90_us\":%lu,"
+                     "\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu}",
+                p ? "," : "", phase_names[p], count,
+                count ? (double)atomic_load(&h->sum) / count : 0.0,
+                histogram_quantile(h, count, 0.5), histogram_quantile(h, count, 0.9),
+                histogram_quantile(h, count, 0.99), histogram_quantile(h, count, 0.999),
+                atomic_load(&h->max));
+    }
+    fprintf(out, "}}\n");
+}
+
+/*
+ * serve_metrics - answer c with the summed shards, as JSON or in the
+ * prometheus text format. The request itself is not timed
+ */
+void serve_metrics(struct conn * c, int json){
+    struct metrics_shard * sum = calloc(1, sizeof(struct metrics_shard));
+    metrics_snapshot(sum);
+    size_t live = 0;
+    pthread_mutex_lock(&store.lock);
+    for (struct segment * seg = store.segments; seg; seg = seg->next)
+        live += atomic_load(&seg->live);
+    pthread_mutex_unlock(&store.lock);
+
+    char * body;
+    size_t body_len;
+    FILE * out = open_memstream(&body, &body_len);
+    (json ? metrics_json : metrics_prometheus)(out, sum, atomic_load(&cache_stats.hits),
+                                               atomic_load(&cache_stats.misses),
+                                               atomic_load(&cache_stats.expired), live);
+    fclose(out);
+    free(sum);
+
+    char hdr[128];
+    size_t hdr_len = sprintf(hdr, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nCache-Control: no-store\r\n\r\n",
+                             json ? "application/json" : "text/plain; version=0.0.4");
+    free(c->response);
+    c->response = malloc(hdr_len + 128 + body_len);
+    c->resp_len = client_head(c, c->response, hdr, hdr_len, body_len, -1);
+    memcpy(c->response + c->resp_len, body, body_len);
+    c->resp_len += body_len;
+    c->resp_off = 0;
+    free(body);
+    c->file_left = 0;
+    c->req_start = 0;
+    c->state = CONN_SEND_CACHED;
+}
+
+void print_metrics_stats(void){
+    static struct metrics_shard sum;
+    memset(&sum, 0, sizeof(sum));
+    metrics_snapshot(&sum);
+    printf("traffic: %lu requests, %ld connections open, client %lu in %lu out, "
+           "upstream %lu in (%lu spliced) %lu out bytes\n",
+           atomic_load(&sum.requests),
+           (long)(atomic_load(&sum.conns_opened) - atomic_load(&sum.conns_closed)),
+           atomic_load(&sum.client_in), atomic_load(&sum.client_out),
+           atomic_load(&sum.upstream_in), atomic_load(&sum.upstream_spliced), atomic_load(&sum.upstream_out));
+    printf("tunnels: %ld open, %lu total, %lu bytes up, %lu bytes down\n",
+           (long)(atomic_load(&sum.tunnels_opened) - atomic_load(&sum.tunnels_closed)),
+           atomic_load(&sum.tunnels_opened), atomic_load(&sum.tunnel_up), atomic_load(&sum.tunnel_down));
+    printf("latency p50/p99/max us:");
+    for (int p = 0; p < PHASES; p++) {
+        struct histogram * h = &sum.phases[p];
+        unsigned long count = histogram_count(h);
+        printf("%s %s %lu/%lu/%lu", p ? "," : "", phase_names[p],
+               histogram_quantile(h, count, 0.5), histogram_quantile(h, count, 0.99),
+               atomic_load(&h->max));
+    }
+    printf("\n");
+}
+
+/*
+ * init_logger - send the access log to access_log ("-" for stdout, "off" for
+ * nowhere) and messages up to level to stderr, through a writer thread
+ * Returns -1 if the access log cannot be opened
+ */
+int init_logger(enum log_level level, char * access_log, int debug_bodies){
+    pthread_t tid;
+    pthread_mutex_init(&logger.lock, NULL);
+    pthread_mutex_init(&logger.drain_lock, NULL);
+    logger.level = level;
+    logger.debug_bodies = debug_bodies;
+    logger.fds[LOG_DIAG] = STDERR_FILENO;
+    if (strcmp(access_log, "off") == 0)
+        logger.fds[LOG_ACCESS] = -1;
+    else if (strcmp(access_log, "-") == 0)
+        logger.fds[LOG_ACCESS] = STDOUT_FILENO;
+    else if ((logger.fds[LOG_ACCESS] = open(access_log, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+        return -1;
+    logger.wake_fd = eventfd(0, EFD_NONBLOCK);
+    pthread_create(&tid, NULL, log_writer, NULL);
+    pthread_detach(tid);
+    return 0;
+}
+
+/*the calling thread's rings, made and listed the first time it logs*/
+static struct log_thread * log_thread(void){
+    if (!thread_log) {
+        thread_log = calloc(1, sizeof(struct log_thread));
+        for (int s = 0; s < LOG_STREAMS; s++)
+            thread_log->rings[s].buf = malloc(LOG_RING_SIZE);
+        pthread_mutex_lock(&logger.lock);
+        thread_log->next = logger.threads;
+        logger.threads = thread_log;
+        pthread_mutex_unlock(&logger.lock);
+    }
+    return thread_log;
+}
+
+/*ISO 8601 UTC time to the millisecond, the date part is formatted once a second*/
+static size_t log_stamp(struct log_thread * t, char * dst){
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != t->stamp_sec) {
+        gmtime_r(&ts.tv_sec, &tm);
+        strftime(t->stamp, sizeof(t->stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        t->stamp_sec = ts.tv_sec;
+    }
+    return sprintf(dst, "%s.%03ldZ", t->stamp, ts.tv_nsec / 1000000);
+}
+
+/*append a line of len bytes to this thread's ring for stream, or drop it if full*/
+static void log_push(struct log_thread * t, enum log_stream stream, char * line, size_t len){
+    struct log_ring * r = &t->rings[stream];
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - used < len) {
+        metric_add(&r->dropped, 1);
+        return;
+    }
+    size_t off = head & (LOG_RING_SIZE - 1), first = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+    memcpy(r->buf + off, line, first);
+    memcpy(r->buf, line + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    //wake the writer early rather than let a busy thread fill its ring
+    if (used < LOG_RING_SIZE / 2 && used + len >= LOG_RING_SIZE / 2) {
+        uint64_t one = 1;
+        write(logger.wake_fd, &one, sizeof(one));
+    }
+}
+
+/*cut a line that ran past LOG_LINE_MAX and end it with a newline*/
+static size_t log_end(char * line, int len){
+    if (len < 0 || len > LOG_LINE_MAX - 1)
+        len = LOG_LINE_MAX - 1;
+    line[len++] = '\n';
+    return len;
+}
+
+void log_msg(enum log_level level, const char * fmt, ...){
+    static const char * level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+    if (level > logger.level)
+        return;
+    struct log_thread * t = log_thread();
+    char line[LOG_LINE_MAX];
+    size_t len = log_stamp(t, line);
+    len += sprintf(line + len, " %s ", level_names[level]);
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line + len, LOG_LINE_MAX - len, fmt, ap);
+    va_end(ap);
+    log_push(t, LOG_DIAG, line, log_end(line, len + (n > 0 ? n : 0)));
+}
+
+/*
+ * log_access - a line for the request c just answered, key=value pairs
+ * with its cache status and timings in microseconds
+ */
+void log_access(struct conn * c){
+    static const char * cache_names[] = {"-", "HIT", "MISS", "EXPIRED", "REVALIDATED",
+                                         "COALESCED", "TAILED", "TUNNEL"};
+    if (logger.fds[LOG_ACCESS] < 0)
+        return;
+    struct log_thread * t = log_thread();
+    char line[LOG_LINE_MAX], ttfb[24] = "-", total[24] = "-";
+    int fetched = c->cache_status == CACHE_MISS || c->cache_status == CACHE_EXPIRED ||
+                  c->cache_status == CACHE_REVALIDATED || c->cache_status == CACHE_TUNNEL;
+    if (c->responded)
+        sprintf(ttfb, "%lu", (unsigned long)c->ttfb);
+    if (c->req_start)
+        sprintf(total, "%lu", (unsigned long)(monotonic_us() - c->req_start));
+    size_t len = sprintf(line, "ts=");
+    len += log_stamp(t, line + len);
+    int n = snprintf(line + len, LOG_LINE_MAX - len,
+                     " client=%s method=%s uri=\"%s\" status=%d cache=%s upstream=%s bytes=%zu "
+                     "ttfb_us=%s total_us=%s\n",
+                     c->peer[0] ? c->peer : "-", c->method[0] ? c->method : "-",
+                     c->request_uri ? c->request_uri : "-", c->status,
+                     cache_names[c->cache_status], fetched ? (c->serv_reused ? "reused" : "new") : "-",
+                     c->bytes_out, ttfb, total);
+    //the newline is already there unless the line was cut
+    len = n < (int)(LOG_LINE_MAX - len) ? len + n : log_end(line, LOG_LINE_MAX);
+    log_push(t, LOG_ACCESS, line, len);
+}
+
+/*write out the lines every thread has logged so far, and note any dropped*/
+void log_drain(void){
+    pthread_mutex_lock(&logger.lock);
+    struct log_thread * threads = logger.threads;
+    pthread_mutex_unlock(&logger.lock);
+
+    for (struct log_thread * t = threads; t; t = t->next) {
+        for (int s = 0; s < LOG_STREAMS; s++) {
+            struct log_ring * r = &t->rings[s];
+            size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            while (tail != head) {
+                size_t off = tail & (LOG_RING_SIZE - 1);
+                size_t len = LOG_RING_SIZE - off < head - tail ? LOG_RING_SIZE - off : head - tail;
+                ssize_t n = logger.fds[s] >= 0 ? write(logger.fds[s], r->buf + off, len) : (ssize_t)len;
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    tail = head;    /* the stream is broken, do not let the ring fill */
+                    break;
+                }
+                tail += n;
+            }
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+
+            unsigned long dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+            if (dropped != r->reported) {
+                char line[96];
+                int len = sprintf(line, "log: %lu %s lines dropped, the writer fell behind\n",
+                                  dropped - r->reported, s == LOG_ACCESS ? "access" : "message");
+                write(STDERR_FILENO, line, len);
+                r->reported = dropped;
+            }
+        }
+    }
+}
+
+/* log writer routine, drains the rings every LOG_FLUSH_MS or when one fills up */
+void * log_writer(void * vargp)
+{
+    struct pollfd pfd = {logger.wake_fd, POLLIN, 0};
+    uint64_t count;
+    for (;;) {
+        if (poll(&pfd, 1, LOG_FLUSH_MS) > 0)
+            read(logger.wake_fd, &count, sizeof(count));
+        pthread_mutex_lock(&logger.drain_lock);
+        log_drain();
+        pthread_mutex_unlock(&logger.drain_lock);
+    }
+    return NULL;
+}
+
+/*
+ * service_connect - a CONNECT host:port request, checked against the
+ * blacklist and connected like any other end server but never through the
+ * upstream pool. Once connected the connection is a tunnel until it closes
+ */
+static void service_connect(struct conn * c){
+    struct http_request * req = &c->req;
+    c->client_keepalive = 0;
+    c->req_body_left = 0;
+    c->request_uri = strndup(req->target.p, req->target.len);
+    //authority-form only, and the port is not optional
+    if (memchr(c->request_uri, '/', req->target.len) || parse_uri(c->request_uri, &c->serv_info) < 0 ||
+        !c->serv_info.port) {
+        conn_error(c, "400 Bad Request");
+        return;
+    }
+    uint64_t start = monotonic_us();
+    int blacklist = check_blacklisted(c->serv_info.host);
+    metrics_phase(PHASE_BLACKLIST, start);
+    if (blacklist) {
+        conn_error(c, "403 Forbidden");
+        return;
+    }
+    c->cache_status = CACHE_TUNNEL;
+    c->serv_fresh_only = 1;
+    c->state = CONN_RESOLVE;
+}
+
+/*
+ * service_http_request - parse a http request and decide how to answer it
+ */
+
+void service_http_request(struct conn * c){
+    struct http_request * req = &c->req;
+    struct uri_info * serv_info = &c->serv_info;
+    struct http_header * host = http_find_header(req, "Host");
+
+    snprintf(c->method, sizeof(c->method), "%.*s", (int)req->method.len, req->method.p);
+    free(c->request_uri);
+    c->request_uri = NULL;
+    c->connect_method = slice_eq(req->method, "CONNECT");
+    if (c->connect_method) {
+        service_connect(c);
+        return;
+    }
+    if (!slice_eq(req->method, "GET")){
+        //handle for methods other than GET
+        c->client_keepalive = 0;
+        conn_error(c, "400 Bad Request");
+        return;
+    }
+    c->client_http11 = req->minor >= 1;
+    c->client_keepalive = c->client_http11;
+
+    //the cache key is the absolute URI, origin-form targets get it from Host
+    if (req->target.p[0] == '/' && host)
+        asprintf(&c->request_uri, "http://%.*s%.*s", (int)host->value.len, host->value.p,
+                 (int)req->target.len, req->target.p);
+    else
+        c->request_uri = strndup(req->target.p, req->target.len);
+    if (parse_uri(c->request_uri, serv_info) < 0) {
+        c->client_keepalive = 0;
+        conn_error(c, "400 Bad Request");
+        return;
+    }
+
+    free(c->if_none_match);
+    c->if_none_match = NULL;
+    c->if_modified_since = -1;
+    c->max_age = LONG_MAX;
+    c->no_store = c->authorized = 0;
+    c->accept_gzip = c->prefetch = c->vary_coding = 0;
+    free(c->range);
+    free(c->if_range);
+    c->range = c->if_range = NULL;
+    c->windowed = 0;
+    int transfer_coded = 0, bad_length = 0;
+    long body_length = -1;
+
+    /*Parse additional hdr info*/
+    for (int i = 0; i < req->nheaders; i++) {
+        struct http_header * hdr = &req->headers[i];
+        if (slice_eq(hdr->name, "If-None-Match")) {
+            free(c->if_none_match);
+            c->if_none_match = strndup(hdr->value.p, hdr->value.len);
+        }
+        else if (slice_eq(hdr->name, "If-Modified-Since"))
+            c->if_modified_since = parse_http_date(hdr->value.p, hdr->value.len);
+        else if (slice_eq(hdr->name, "Cache-Control")) {
+            struct cache_meta cc = {.max_age = -1};
+            parse_cache_control(hdr->value.p, hdr->value.len, &cc);
+            if (cc.no_cache)
+                c->max_age = -1;
+            else if (cc.max_age >= 0 && cc.max_age < c->max_age)
+                c->max_age = cc.max_age;
+            c->no_store |= cc.no_store;
+        }
+        else if (slice_eq(hdr->name, "Pragma") && slice_has_token(hdr->value, "no-cache"))
+            c->max_age = -1;
+        else if (slice_eq(hdr->name, "Authorization"))
+            c->authorized = 1;
+        else if (slice_eq(hdr->name, "Accept-Encoding"))
+            c->accept_gzip = accepts_gzip(hdr->value);
+        else if (slice_eq(hdr->name, "Range")) {
+            free(c->range);
+            c->range = strndup(hdr->value.p, hdr->value.len);
+        }
+        else if (slice_eq(hdr->name, "If-Range")) {
+            free(c->if_range);
+            c->if_range = strndup(hdr->value.p, hdr->value.len);
+        }
+        else if (slice_eq(hdr->name, PREFETCH_HEADER))
+            c->prefetch = strncmp(c->peer, "127.", 4) == 0;  /* only the proxy's own */
+        else if (slice_eq(hdr->name, "Connection") || slice_eq(hdr->name, "Proxy-Connection")) {
+            if (slice_has_token(hdr->value, "close"))
+                c->client_keepalive = 0;
+            else if (slice_has_token(hdr->value, "keep-alive"))
+                c->client_keepalive = 1;
+        }
+        else if (slice_eq(hdr->name, "Transfer-Encoding"))
+            transfer_coded = 1;
+        else if (slice_eq(hdr->name, "Content-Length")) {
+            //digits only, and every Content-Length has to agree
+            long n = 0;
+            size_t j;
+            for (j = 0; j < hdr->value.len && j < 18 && isdigit((unsigned char)hdr->value.p[j]); j++)
+                n = n * 10 + hdr->value.p[j] - '0';
+            if (j == 0 || j != hdr->value.len || (body_length >= 0 && n != body_length))
+                bad_length = 1;
+            body_length = n;
+        }
+    }
+
+    /*
+     * a body the proxy cannot frame would be read as the next request, so a
+     * transfer coded one or a doubtful length ends the connection
+     */
+    if (transfer_coded || bad_length) {
+        c->client_keepalive = 0;
+        conn_error(c, transfer_coded ? "501 Not Implemented" : "400 Bad Request");
+        return;
+    }
+    c->req_body_left = body_length > 0 ? body_length : 0;
+
+    //the proxy's own metrics, asked of it rather than of an end server
+    size_t mlen = strlen(METRICS_PATH);
+    if (req->target.len >= mlen && memcmp(req->target.p, METRICS_PATH, mlen) == 0 &&
+        (req->target.len == mlen || req->target.p[mlen] == '?')) {
+        struct http_header * accept = http_find_header(req, "Accept");
+        serve_metrics(c, memmem(req->target.p + mlen, req->target.len - mlen, "format=json", 11) ||
+                         (accept && memmem(accept->value.p, accept->value.len, "application/json", 16)));
+        return;
+    }
+
+    //check if blacklisted
+    uint64_t start = monotonic_us();
+    int blacklist = check_blacklisted(serv_info->host);
+    metrics_phase(PHASE_BLACKLIST, start);
+    if (blacklist){
+        //send forbidden error to client
+        conn_error(c, "403 Forbidden");
+        return;
+    }
+
+    uri_digest(c->request_uri, strlen(c->request_uri), NULL, c->key);
+    webcache_filename(c->key, worker_index, c->filename);
+
+    int cached = conn_serve_cached(c, 0);
+    if (cached == 1) { //webpage in cache
+        c->cache_status = CACHE_HIT;
+        return;
+    }
+    //a stale copy in a coding the client does not take is not worth revalidating
+    if (c->entry && head_coding(c->entry->hdr, c->entry->hdr_len) == CODING_GZIP && !c->accept_gzip)
+        conn_drop_entry(c);
+    c->cache_status = c->entry ? CACHE_EXPIRED : CACHE_MISS;
+    /*
+     * a 206 is never stored, so a range is only asked of the end server when
+     * there is no copy to revalidate and whole objects are not fetched for
+     * ranges. Otherwise the whole response is fetched and stored, and the
+     * client gets its range of it
+     */
+    int pass_range = c->range && !c->entry && !range_fetch_whole;
+
+    //Generate a new modified HTTP request to forward to the server
+    size_t validators = c->entry ? (c->entry->etag ? strlen(c->entry->etag) : 0) + 64 : 0;
+    char * p = c->new_request = malloc(req->head_len + serv_info->path.len + MAX_HOST + 96 + validators);
+    p += sprintf(p, "GET %s%.*s HTTP/1.1\r\n", serv_info->path.p[0] == '/' ? "" : "/",
+                 (int)serv_info->path.len, serv_info->path.p);
+
+    //if no host info provided add host info to request
+    if (!host){
+        p += sprintf(p, "Host: %s\r\n", serv_info->host);
+    }
+
+    for (int i = 0; i < req->nheaders; i++) {
+        //a stale copy is revalidated with its own validators, not the client's
+        if (c->entry && (slice_eq(req->headers[i].name, "If-None-Match") ||
+                         slice_eq(req->headers[i].name, "If-Modified-Since")))
+            continue;
+        if (!pass_range && (slice_eq(req->headers[i].name, "Range") ||
+                            slice_eq(req->headers[i].name, "If-Range")))
+            continue;
+        p += parse_hdr_info(&req->headers[i], p);
+    }
+    //gzip is all the cache stores compressed, whatever else the client takes
+    if (c->accept_gzip)
+        p += sprintf(p, "Accept-Encoding: gzip\r\n");
+    if (c->entry && c->entry->etag)
+        p += sprintf(p, "If-None-Match: %s\r\n", c->entry->etag);
+    if (c->entry && c->entry->last_modified >= 0) {
+        p += sprintf(p, "If-Modified-Since: ");
+        p += format_http_date(p, c->entry->last_modified);
+        p += sprintf(p, "\r\n");
+    }
+    p += sprintf(p, "Connection: keep-alive\r\n\r\n");
+    c->req_len = p - c->new_request;
+    c->req_off = 0;
+    c->state = CONN_RESOLVE;
+
+    //only one client fetches a missing page, the rest wait for it to be cached.
+    //A partial fetch would leave them nothing to wait for. One waiting on a
+    //variant fetches the page if the variant cannot be made
+    if (cached == 2 || (!pass_range && !flight_join(c)))
+        c->state = CONN_FLIGHT_WAIT;
+}
+
+/* 
+ * open_listenfd - open and return a listening socket on port, one of
+ * several bound to it if reuseport is set
+ * Returns -1 in case of failure 
+ */
+int open_listenfd(int port, int reuseport) 
+{
+    int listenfd, optval=1;
+    struct sockaddr_in serveraddr;
+  
+    /* Create a socket descriptor */
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /* Eliminates "Address already in use" error from bind. */
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
+                   (const void *)&optval , sizeof(int)) < 0)
+        return -1;
+
+    /* Worker processes each bind the port, the kernel spreads connections over them */
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                (const void *)&optval , sizeof(int)) < 0)
+        return -1;
+
+    /* listenfd will be an endpoint for all requests to port
+       on any IP address for this host */
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET; 
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    serveraddr.sin_port = htons((unsigned short)port); 
+    if (bind(listenfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0)
+        return -1;
+
+    /* Make it a listening socket ready to accept connection requests */
+    if (listen(listenfd, LISTENQ) < 0)
+        return -1;
+    return listenfd;
+} /* end open_listenfd */
+
+
+/*
+ * signal handlers only raise a flag, stdio, locks and the journal are left
+ * to the sweeper, which looks at them once a second
+ */
+
+/*signal handler (ctrl+c)*/
+void intHandler(int dummy) {
+    atomic_store(&stop_requested, 1);
+}
+
+/*signal handler (SIGUSR1), dump counters without stopping*/
+void statsHandler(int dummy) {
+    atomic_store(&stats_requested, 1);
+}
+
+/*print every set of counters, for SIGUSR1 and shutdown*/
+void print_all_stats(void){
+    print_pool_stats();
+    print_cache_stats();
+    print_upstream_stats();
+    print_dns_stats();
+    print_blacklist_stats();
+    print_prefetch_stats();
+    print_shared_stats();
+    print_metrics_stats();
+}
+
+/*print the counters, write out the journal and the log, and exit*/
+void shutdown_proxy(void){
+    keep_running = 0;
+    printf("\nWEB SERVER SHUTDOWN\n");
+    print_all_stats();
+    journal_flush();
+    pthread_mutex_lock(&logger.drain_lock);
+    log_drain();
+    exit(0);
+}
+
+/*signal handler (SIGHUP), reload the blacklist*/
+void hupHandler(int dummy) {
+    atomic_store(&blacklist_reload, 1);
+}
+
+static time_t monotonic_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*fork worker process index, which returns 0 in the worker*/
+static pid_t spawn_worker(int index, sigset_t * signals){
+    pid_t supervisor = getpid();
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+    worker_index = index;
+    sigprocmask(SIG_UNBLOCK, signals, NULL);
+    //go down with the supervisor rather than hold the port
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    if (getppid() != supervisor)
+        exit(0);
+    return 0;
+}
+
+/*
+ * supervise - fork nprocs worker processes, each binding the port with
+ * SO_REUSEPORT so the kernel spreads connections over them, and fork a new
+ * one in place of any that dies. SIGINT and SIGTERM are passed on to the
+ * workers as SIGINT and end the supervisor once they have exited, SIGUSR1
+ * and SIGHUP are passed on. Returns in each worker with worker_index set,
+ * never in the supervisor
+ */
+void supervise(int nprocs){
+    pid_t pids[MAX_PROCESSES];
+    time_t started[MAX_PROCESSES];
+    sigset_t signals;
+    siginfo_t info;
+    int stopping = 0, alive = 0;
+
+    shared = init_shared();
+    if (!shared) {
+        perror("shared index");
+        exit(1);
+    }
+    //signals are taken with sigwaitinfo, none can slip in between two waits
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    for (int i = 0; i < nprocs; i++) {
+        if ((pids[i] = spawn_worker(i, &signals)) == 0)
+            return;
+        started[i] = monotonic_now();
+        alive += pids[i] > 0;
+    }
+    printf("supervisor: %d worker processes\n", alive);
+
+    while (alive) {
+        if (sigwaitinfo(&signals, &info) < 0)
+            continue;
+        if (info.si_signo != SIGCHLD) {
+            if (info.si_signo == SIGINT || info.si_signo == SIGTERM)
+                stopping = 1;
+            for (int i = 0; i < nprocs; i++)
+                if (pids[i] > 0)
+                    kill(pids[i], info.si_signo == SIGTERM ? SIGINT : info.si_signo);
+            continue;
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            int i;
+            for (i = 0; i < nprocs && pids[i] != pid; i++)
+                ;
+            if (i == nprocs)
+                continue;
+            pids[i] = 0;
+            alive--;
+            if (stopping)
+                continue;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "supervisor: worker %d (pid %d) killed by signal %d, restarting\n",
+                        i, pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "supervisor: worker %d (pid %d) exited with %d, restarting\n",
+                        i, pid, WEXITSTATUS(status));
+            //what it offered may name objects it never journaled
+            shared_forget(i);
+            //one that cannot get going is not restarted in a tight loop
+            if (monotonic_now() - started[i] < 1)
+                sleep(1);
+            if ((pids[i] = spawn_worker(i, &signals)) == 0)
+                return;
+            started[i] = monotonic_now();
+            alive += pids[i] > 0;
+        }
+    }
+    exit(0);
+}
+
+static unsigned long hostname_hash(char * hostname){
+    unsigned long h = 5381;
+    for (char * p = hostname; *p; p++)
+        h = h * 33 + (*p | 0x20);
+    return h;
+}
+
+static struct ipcache_bucket * ipcache_bucket(char * hostname){
+    return &resolver.buckets[hostname_hash(hostname) % IPCACHE_BUCKETS];
+}
+
+/*IP caching functions, called with the bucket locked*/
+struct ip_cache * get_ipcache(struct ipcache_bucket * bucket, char * hostname){
+    for (struct ip_cache * ptr = bucket->chain; ptr; ptr = ptr->next)
+        if (strcasecmp(hostname, ptr->hostname) == 0)
+            return ptr;
+    return NULL;
+}
+
+/*add a pending entry for hostname, dropping expired ones from the chain*/
+struct ip_cache * addto_ipcache(struct ipcache_bucket * bucket, char * hostname){
+    time_t now = monotonic_now();
+    struct ip_cache * ptr, ** pp = &bucket->chain;
+    while ((ptr = *pp)) {
+        if (ptr->state != IPCACHE_PENDING && ptr->expires <= now) {
+            *pp = ptr->next;
+            free(ptr);
+        }
+        else
+            pp = &ptr->next;
+    }
+    ptr = calloc(1, sizeof(struct ip_cache));
+    snprintf(ptr->hostname, sizeof(ptr->hostname), "%s", hostname);
+    ptr->state = IPCACHE_PENDING;
+    ptr->next = bucket->chain;
+    bucket->chain = ptr;
+    return ptr;
+}
+
+/*
+ * shared_host_lookup - another worker process's answer for hostname, if it
+ * has not expired
+ * Returns 1 with *addr set, 0 if the name did not resolve, -1 if there is none
+ */
+static int shared_host_lookup(char * hostname, struct in_addr * addr, time_t * expires){
+    int ok = -1;
+    if (!shared)
+        return -1;
+    struct shared_host_set * set = &shared->hosts[hostname_hash(hostname) % SHARED_HOST_SETS];
+    time_t now = monotonic_now();
+    shared_lock(&set->lock);
+    for (int i = 0; i < SHARED_HOST_WAYS; i++) {
+        struct shared_host * h = &set->hosts[i];
+        if (h->expires > now && strcasecmp(h->hostname, hostname) == 0) {
+            *addr = h->addr;
+            *expires = h->expires;
+            ok = h->ok;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return ok;
+}
+
+/*offer a resolver answer to the other worker processes*/
+static void shared_host_publish(char * hostname, struct in_addr addr, int ok, time_t expires){
+    if (!shared)
+        return;
+    struct shared_host_set * set = &shared->hosts[hostname_hash(hostname) % SHARED_HOST_SETS];
+    shared_lock(&set->lock);
+    //its old answer, else the one expiring first
+    struct shared_host * slot = &set->hosts[0];
+    for (int i = 0; i < SHARED_HOST_WAYS; i++) {
+        struct shared_host * h = &set->hosts[i];
+        if (strcasecmp(h->hostname, hostname) == 0) {
+            slot = h;
+            break;
+        }
+        if (h->expires < slot->expires)
+            slot = h;
+    }
+    slot->expires = 0;
+    snprintf(slot->hostname, sizeof(slot->hostname), "%s", hostname);
+    slot->addr = addr;
+    slot->ok = ok;
+    slot->expires = expires;
+    pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * parse_nameserver - read a --dns-server IP[:PORT] argument. Without one the
+ * first IPv4 nameserver in /etc/resolv.conf is used, "none" means getaddrinfo
+ * Returns -1 if the argument is malformed
+ */
+int parse_nameserver(char * arg, struct sockaddr_in * nameserver){
+    char ip[INET_ADDRSTRLEN + 1] = "", line[MAXLINE];
+    int port = 53;
+
+    bzero(nameserver, sizeof(*nameserver));
+    nameserver->sin_family = AF_INET;
+    if (arg && strcmp(arg, "none") == 0)
+        return 0;
+    if (arg) {
+        if (sscanf(arg, "%16[^:]:%d", ip, &port) < 1 || port < 1 || port > 65535 ||
+            inet_pton(AF_INET, ip, &nameserver->sin_addr) != 1)
+            return -1;
+        nameserver->sin_port = htons(port);
+        return 0;
+    }
+    FILE * fp = fopen("/etc/resolv.conf", "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, " nameserver %16s", ip) == 1 &&
+            inet_pton(AF_INET, ip, &nameserver->sin_addr) == 1) {
+            nameserver->sin_port = htons(port);
+            break;
+        }
+    fclose(fp);
+    return 0;
+}
+
+/*seed the ip cache from a hosts file, those entries never expire*/
+static void load_hosts(char * path){
+    char line[MAXLINE];
+    FILE * fp = fopen(path, "r");
+    if (!fp)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        char * saveptr, * name;
+        struct in_addr addr;
+        char * comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        char * ip = strtok_r(line, " \t\r\n", &saveptr);
+        if (!ip || inet_pton(AF_INET, ip, &addr) != 1)
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &saveptr))) {
+            struct ipcache_bucket * bucket = ipcache_bucket(name);
+            //the first line naming a host wins, as in libc
+            if (strlen(name) >= sizeof(bucket->chain->hostname) || get_ipcache(bucket, name))
+                continue;
+            struct ip_cache * ptr = addto_ipcache(bucket, name);
+            ptr->addr = addr;
+            ptr->state = IPCACHE_OK;
+            ptr->expires = (time_t)LONG_MAX;
+        }
+    }
+    fclose(fp);
+}
+
+void init_resolver(struct sockaddr_in * nameserver, char * hosts_file, int negative_ttl){
+    pthread_t tid;
+    for (int i = 0; i < IPCACHE_BUCKETS; i++)
+        pthread_mutex_init(&resolver.buckets[i].lock, NULL);
+    pthread_mutex_init(&resolver.lock, NULL);
+    pthread_cond_init(&resolver.cond, NULL);
+    resolver.nameserver = *nameserver;
+    resolver.negative_ttl = negative_ttl;
+    load_hosts(hosts_file);
+    for (int i = 0; i < DNS_THREADS; i++) {
+        pthread_create(&tid, NULL, resolver_thread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * resolve_host - look hostname up in the ip cache. On a miss, or when the
+ * entry has expired, c is parked on the lookup and woken by a resolver thread
+ * Returns 1 with addr set, 0 if c has to wait, -1 if the host does not resolve
+ */
+int resolve_host(struct conn * c, char * hostname, struct in_addr * addr){
+    if (inet_pton(AF_INET, hostname, addr) == 1)
+        return 1;
+    if (!hostname[0] || strlen(hostname) >= sizeof(resolver.jobs->hostname))
+        return -1;
+
+    struct ipcache_bucket * bucket = ipcache_bucket(hostname);
+    int queue = 0;
+    pthread_mutex_lock(&bucket->lock);
+    struct ip_cache * ptr = get_ipcache(bucket, hostname);
+    if (ptr && ptr->state != IPCACHE_PENDING && ptr->expires > monotonic_now()) {
+        int ok = ptr->state == IPCACHE_OK;
+        *addr = ptr->addr;
+        pthread_mutex_unlock(&bucket->lock);
+        atomic_fetch_add(ok ? &resolver.hits : &resolver.negative_hits, 1);
+        return ok ? 1 : -1;
+    }
+    if (ptr && ptr->state == IPCACHE_PENDING)
+        atomic_fetch_add(&resolver.coalesced, 1);
+    else {
+        //expired or never seen, another worker process may have looked it up
+        if (!ptr)
+            ptr = addto_ipcache(bucket, hostname);
+        int ok = shared_host_lookup(hostname, &ptr->addr, &ptr->expires);
+        if (ok >= 0) {
+            ptr->state = ok ? IPCACHE_OK : IPCACHE_FAILED;
+            *addr = ptr->addr;
+            pthread_mutex_unlock(&bucket->lock);
+            atomic_fetch_add(&resolver.shared_hits, 1);
+            return ok ? 1 : -1;
+        }
+        ptr->state = IPCACHE_PENDING;
+        atomic_fetch_add(&resolver.misses, 1);
+        queue = 1;
+    }
+    atomic_store(&c->dns_done, 0);
+    c->dns_entry = ptr;
+    c->dns_next = ptr->waiters;
+    ptr->waiters = c;
+    pthread_mutex_unlock(&bucket->lock);
+
+    if (queue) {
+        pthread_mutex_lock(&resolver.lock);
+        ptr->job_next = NULL;
+        if (resolver.jobs_tail)
+            resolver.jobs_tail->job_next = ptr;
+        else
+            resolver.jobs = ptr;
+        resolver.jobs_tail = ptr;
+        pthread_cond_signal(&resolver.cond);
+        pthread_mutex_unlock(&resolver.lock);
+    }
+    return 0;
+}
+
+/*c is closing, take it off the lookup it is parked on*/
+void resolve_cancel(struct conn * c){
+    struct ipcache_bucket * bucket = ipcache_bucket(c->serv_info.host);
+    pthread_mutex_lock(&bucket->lock);
+    if (c->dns_entry) {
+        struct conn ** pp = &c->dns_entry->waiters;
+        while (*pp != c)
+            pp = &(*pp)->dns_next;
+        *pp = c->dns_next;
+        c->dns_entry = NULL;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/*skip a possibly compressed name, returns the offset after it*/
+static size_t dns_skip_name(unsigned char * msg, size_t len, size_t off){
+    while (off < len) {
+        if ((msg[off] & 0xc0) == 0xc0)
+            return off + 2;
+        if (msg[off] == 0)
+            return off + 1;
+        off += msg[off] + 1;
+    }
+    return len + 1;
+}
+
+enum dns_result{
+    DNS_ANSWER,
+    DNS_NXDOMAIN,       /* or no A record, a negative answer */
+    DNS_ERROR           /* no usable answer, try getaddrinfo */
+};
+
+/*
+ * dns_parse - take the first A record and the lowest TTL along the answer
+ * chain from a reply. Negative answers get the SOA minimum (RFC 2308)
+ */
+static enum dns_result dns_parse(unsigned char * msg, size_t len, struct in_addr * addr, long * ttl){
+    int rcode = msg[3] & 0x0f;
+    int qdcount = msg[4] << 8 | msg[5];
+    int ancount = msg[6] << 8 | msg[7];
+    int nscount = msg[8] << 8 | msg[9];
+    size_t off = 12;
+    int found = 0;
+    long min_ttl = DNS_MAX_TTL, negative_ttl = resolver.negative_ttl;
+
+    //truncated replies and server failures are no answer at all
+    if ((msg[2] & 0x02) || (rcode != 0 && rcode != 3))
+        return DNS_ERROR;
+    for (int i = 0; i < qdcount; i++)
+        off = dns_skip_name(msg, len, off) + 4;
+    for (int i = 0; i < ancount + nscount; i++) {
+        off = dns_skip_name(msg, len, off);
+        if (off + 10 > len)
+            return DNS_ERROR;
+        int type = msg[off] << 8 | msg[off + 1];
+        long rttl = (long)msg[off + 4] << 24 | msg[off + 5] << 16 | msg[off + 6] << 8 | msg[off + 7];
+        size_t rdlen = msg[off + 8] << 8 | msg[off + 9];
+        off += 10;
+        if (off + rdlen > len)
+            return DNS_ERROR;
+        if (i < ancount && rcode == 0 && (type == 1 || type == 5)) {
+            //A or CNAME, the chain is only good while all of it is
+            if (rttl < min_ttl)
+                min_ttl = rttl;
+            if (type == 1 && rdlen == 4 && !found) {
+                memcpy(addr, msg + off, 4);
+                found = 1;
+            }
+        }
+        else if (i >= ancount && type == 6 && rdlen >= 4) {
+            long minimum = (long)msg[off + rdlen - 4] << 24 | msg[off + rdlen - 3] << 16 |
+                           msg[off + rdlen - 2] << 8 | msg[off + rdlen - 1];
+            if (rttl < negative_ttl)
+                negative_ttl = rttl;
+            if (minimum < negative_ttl)
+                negative_ttl = minimum;
+        }
+        off += rdlen;
+    }
+    *ttl = found ? min_ttl : negative_ttl;
+    return found ? DNS_ANSWER : DNS_NXDOMAIN;
+}
+
+/*
+ * dns_query - ask the nameserver for hostname's A record over UDP
+ */
+static enum dns_result dns_query(char * hostname, struct in_addr * addr, long * ttl){
+    unsigned char query[512], reply[512];
+    unsigned char * p = query + 12;
+    uint16_t id;
+    enum dns_result result = DNS_ERROR;
+
+    //header with a random id, recursion desired and one question
+    random_bytes(&id, sizeof(id));
+    bzero(query, 12);
+    query[0] = id >> 8;
+    query[1] = id;
+    query[2] = 0x01;
+    query[5] = 1;
+    for (char * label = hostname; *label; ) {
+        char * dot = strchr(label, '.');
+        size_t n = dot ? (size_t)(dot - label) : strlen(label);
+        if (n == 0 || n > 63)
+            return DNS_ERROR;
+        *p++ = n;
+        memcpy(p, label, n);
+        p += n;
+        label += n + (dot != NULL);
+    }
+    memcpy(p, "\0\0\1\0\1", 5);     /* root, type A, class IN */
+    p += 5;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return DNS_ERROR;
+    if (connect(fd, (struct sockaddr *)&resolver.nameserver, sizeof(resolver.nameserver)) < 0) {
+        close(fd);
+        return DNS_ERROR;
+    }
+    for (int tries = 0; tries < DNS_TRIES && result == DNS_ERROR; tries++) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        atomic_fetch_add(&resolver.queries, 1);
+        if (send(fd, query, p - query, 0) < 0)
+            break;
+        while (poll(&pfd, 1, DNS_TIMEOUT_MS) > 0) {
+            ssize_t n = recv(fd, reply, sizeof(reply), 0);
+            //ignore anything that is not a reply to this query
+            if (n < 12 || reply[0] != query[0] || reply[1] != query[1] || !(reply[2] & 0x80))
+                continue;
+            result = dns_parse(reply, n, addr, ttl);
+            break;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+/*
+ * dns_lookup - resolve hostname, setting how long the answer may be cached
+ * Returns 1 if it resolved
+ */
+static int dns_lookup(char * hostname, struct in_addr * addr, long * ttl){
+    //names without a dot go through the libc search list
+    if (resolver.nameserver.sin_port && strchr(hostname, '.')) {
+        enum dns_result result = dns_query(hostname, addr, ttl);
+        if (result != DNS_ERROR)
+            return result == DNS_ANSWER;
+    }
+
+    /*getaddrinfo, gethostbyname is not safe across threads*/
+    struct addrinfo hints, * res;
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(hostname, NULL, &hints, &res) != 0) {
+        *ttl = resolver.negative_ttl;
+        return 0;
+    }
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    *ttl = DNS_DEFAULT_TTL;
+    return 1;
+}
+
+/* resolver routine, answers queued lookups and wakes everyone waiting on them */
+void * resolver_thread(void * vargp)
+{
+    while (keep_running) {
+        pthread_mutex_lock(&resolver.lock);
+        while (!resolver.jobs)
+            pthread_cond_wait(&resolver.cond, &resolver.lock);
+        struct ip_cache * ptr = resolver.jobs;
+        resolver.jobs = ptr->job_next;
+        if (!resolver.jobs)
+            resolver.jobs_tail = NULL;
+        pthread_mutex_unlock(&resolver.lock);
+
+        //pending entries are never freed, so ptr stays ours until it is answered
+        struct in_addr addr = {0};
+        long ttl;
+        int ok = dns_lookup(ptr->hostname, &addr, &ttl);
+        if (!ok) {
+            log_msg(LOG_WARN, "dns: no such host as %s", ptr->hostname);
+            atomic_fetch_add(&resolver.failures, 1);
+        }
+
+        struct ipcache_bucket * bucket = ipcache_bucket(ptr->hostname);
+        pthread_mutex_lock(&bucket->lock);
+        ptr->addr = addr;
+        ptr->state = ok ? IPCACHE_OK : IPCACHE_FAILED;
+        ptr->expires = monotonic_now() + (ttl < DNS_MAX_TTL ? ttl : DNS_MAX_TTL);
+        shared_host_publish(ptr->hostname, addr, ok, ptr->expires);
+        struct conn * c = ptr->waiters;
+        while (c) {
+            struct conn * next = c->dns_next;
+            c->dns_entry = NULL;
+            c->dns_ok = ok;
+            c->dns_addr = addr;
+            conn_wake(c, &c->dns_done);
+            c = next;
+        }
+        ptr->waiters = NULL;
+        pthread_mutex_unlock(&bucket->lock);
+    }
+    return NULL;
+}
+
+void print_dns_stats(void){
+    printf("dns: %lu hits, %lu negative hits, %lu misses, %lu coalesced, "
+           "%lu queries, %lu failures, %lu shared hits\n",
+           atomic_load(&resolver.hits), atomic_load(&resolver.negative_hits),
+           atomic_load(&resolver.misses), atomic_load(&resolver.coalesced),
+           atomic_load(&resolver.queries), atomic_load(&resolver.failures),
+           atomic_load(&resolver.shared_hits));
+}
+
+/*
+ * scan_start - scan the 200 response c is relaying for links if it is HTML
+ * in a coding the tokenizer can read
+ */
+void scan_start(struct conn * c, char * hdr, size_t hdr_len){
+    size_t len;
+    char * type = head_value(hdr, hdr_len, "Content-Type", &len);
+    enum content_coding coding = head_coding(hdr, hdr_len);
+    if (!type || len < 9 || strncasecmp(type, "text/html", 9) != 0 || coding == CODING_OTHER)
+        return;
+    struct link_scan * s = calloc(1, sizeof(struct link_scan));
+    s->gzip = coding == CODING_GZIP;
+    if (s->gzip && inflateInit2(&s->zs, 15 + 16) != Z_OK) {
+        free(s);
+        return;
+    }
+    c->scan = s;
+}
+
+void scan_end(struct conn * c){
+    if (!c->scan)
+        return;
+    if (c->scan->gzip)
+        inflateEnd(&c->scan->zs);
+    free(c->scan);
+    c->scan = NULL;
+}
+
+static void prefetch_link(struct conn * c, char * link, size_t len);
+
+/*feed n bytes of HTML to the tokenizer, queueing each link it completes*/
+static void scan_bytes(struct conn * c, struct link_scan * s, char * p, size_t n){
+    for (char * end = p + n; p < end; p++) {
+        char ch = *p;
+        int space = ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n' || ch == '\f';
+        switch (s->state) {
+            case SCAN_TEXT:
+                if (ch == '<') {
+                    s->state = SCAN_TAG;
+                    s->tag_len = 0;
+                }
+                break;
+            case SCAN_TAG:
+                if (ch == '>')
+                    s->state = SCAN_TEXT;
+                else if (space) {
+                    s->state = SCAN_ATTR;
+                    s->attr_len = 0;
+                }
+                else if (s->tag_len < (int)sizeof(s->tag))
+                    s->tag[s->tag_len++] = tolower((unsigned char)ch);
+                break;
+            case SCAN_ATTR:
+                if (ch == '>')
+                    s->state = SCAN_TEXT;
+                else if (ch == '=') {
+                    s->wanted = (s->attr_len == 3 && memcmp(s->attr, "src", 3) == 0) ||
+                                (s->attr_len == 4 && memcmp(s->attr, "href", 4) == 0 &&
+                                 s->tag_len == 4 && memcmp(s->tag, "link", 4) == 0);
+                    s->state = SCAN_VALUE_START;
+                }
+                else if (space || ch == '/')
+                    s->attr_len = 0;
+                else if (s->attr_len < (int)sizeof(s->attr))
+                    s->attr[s->attr_len++] = tolower((unsigned char)ch);
+                break;
+            case SCAN_VALUE_START:
+                if (space)
+                    break;
+                s->link_len = 0;
+                s->state = SCAN_VALUE;
+                if (ch == '"' || ch == '\'') {
+                    s->quote = ch;
+                    break;
+                }
+                s->quote = 0;
+                //an unquoted value starts here
+                if (ch == '>') {
+                    s->state = SCAN_TEXT;
+                    break;
+                }
+                /* fall through */
+            case SCAN_VALUE:
+                if (s->quote ? ch == s->quote : (space || ch == '>')) {
+                    if (s->wanted && s->link_len < sizeof(s->link))
+                        prefetch_link(c, s->link, s->link_len);
+                    s->state = ch == '>' && !s->quote ? SCAN_TEXT : SCAN_ATTR;
+                    s->attr_len = 0;
+                }
+                else if (s->wanted && s->link_len++ < sizeof(s->link))
+                    s->link[s->link_len - 1] = ch;
+                break;
+        }
+    }
+}
+
+/*scan n more decoded body bytes, inflating them first if they are gzipped*/
+void scan_body(struct conn * c, char * data, size_t n){
+    struct link_scan * s = c->scan;
+    if (!s->gzip) {
+        scan_bytes(c, s, data, n);
+        return;
+    }
+    char out[4096];
+    s->zs.next_in = (Bytef *)data;
+    s->zs.avail_in = n;
+    do {
+        s->zs.next_out = (Bytef *)out;
+        s->zs.avail_out = sizeof(out);
+        int rc = inflate(&s->zs, Z_NO_FLUSH);
+        scan_bytes(c, s, out, sizeof(out) - s->zs.avail_out);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            //the end of the stream, or a body that is not gzip after all
+            scan_end(c);
+            return;
+        }
+    } while (s->zs.avail_out == 0);
+}
+
+/*whether a link to host may be prefetched from a page on c's end server*/
+static int prefetch_allowed(struct conn * c, struct uri_info * info){
+    if (strcasecmp(info->host, c->serv_info.host) == 0 && info->port == c->serv_info.port)
+        return 1;
+    size_t len = strlen(info->host);
+    for (char * p = prefetcher.origins; p && *p; ) {
+        size_t n = strcspn(p, ",");
+        if (n == len && strncasecmp(p, info->host, n) == 0)
+            return 1;
+        p += n + (p[n] == ',');
+    }
+    return 0;
+}
+
+/*
+ * resolve_link - make link, as it appeared in the page at request URI page,
+ * an absolute http URI: entities and the fragment go, relative references
+ * are resolved and dot segments removed
+ * Returns it malloced, NULL for other schemes, empty links and links with
+ * no host
+ */
+static char * resolve_link(char * page, char * link, size_t len){
+    char ref[PREFETCH_URI_MAX + 1];
+    size_t n = 0;
+    for (size_t i = 0; i < len && link[i] != '#'; i++) {
+        ref[n++] = link[i];
+        if (link[i] == '&' && len - i >= 5 && strncmp(link + i, "&amp;", 5) == 0)
+            i += 4;
+    }
+    while (n && (ref[n - 1] == ' ' || ref[n - 1] == '\t'))
+        n--;
+    ref[n] = 0;
+    char * r = ref + strspn(ref, " \t\r\n");
+    if (!*r)
+        return NULL;
+    size_t scheme = strspn(r, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+.-");
+    if (r[scheme] == ':' && (scheme != 4 || strncasecmp(r, "http", 4) != 0))
+        return NULL;
+
+    //the page was fetched over http whatever its request URI said, so the
+    //base is http://host[:port] and its path, which starts with /
+    char * authority = uri_authority(page), * base;
+    size_t authority_len = strcspn(authority, "/?#");
+    char * rest = authority + authority_len;
+    asprintf(&base, "http://%.*s%s%.*s", (int)authority_len, authority, *rest == '/' ? "" : "/",
+             (int)strcspn(rest, "#"), rest);
+    char * authority_end = base + 7 + authority_len;
+    char * uri;
+    if (r[scheme] == ':')
+        uri = strdup(r);
+    else if (r[0] == '/' && r[1] == '/')
+        asprintf(&uri, "http:%s", r);
+    else if (r[0] == '/')
+        asprintf(&uri, "%.*s%s", (int)(authority_end - base), base, r);
+    else {
+        char * query = authority_end + strcspn(authority_end, "?");
+        char * dir = memrchr(authority_end, '/', query - authority_end);
+        if (r[0] == '?')
+            asprintf(&uri, "%.*s%s", (int)(query - base), base, r);
+        else if (dir)
+            asprintf(&uri, "%.*s%s", (int)(dir + 1 - base), base, r);
+        else
+            asprintf(&uri, "%.*s/%s", (int)(authority_end - base), base, r);
+    }
+    free(base);
+    if (strncasecmp(uri, "http://", 7) != 0 || !uri[7] || strchr("/?#", uri[7])) {
+        free(uri);
+        return NULL;
+    }
+
+    //remove the dot segments of the path, in place
+    char * path = strchr(uri + 7, '/');
+    if (!path)
+        return uri;
+    char * in = path, * out = path, * query = path + strcspn(path, "?");
+    int dot = 0;
+    while (in < query) {
+        char * next = in + 1 + strcspn(in + 1, "/?");
+        size_t seg = next - in;
+        dot = (seg == 2 && in[1] == '.') || (seg == 3 && in[1] == '.' && in[2] == '.');
+        if (seg == 3 && dot) {
+            while (out > path && *--out != '/')
+                ;
+        }
+        else if (!dot) {
+            memmove(out, in, seg);
+            out += seg;
+        }
+        in = next;
+    }
+    //a path that ended in a dot segment still ends in /
+    if (out == path || dot)
+        *out++ = '/';
+    memmove(out, query, strlen(query) + 1);
+    return uri;
+}
+
+/*
+ * prefetch_link - queue a link found in the page c is relaying, unless it
+ * points somewhere not allowed, is cached already or queued
+ */
+static void prefetch_link(struct conn * c, char * link, size_t len){
+    if (c->scan->links >= PREFETCH_PER_PAGE)
+        return;
+    char * uri = resolve_link(c->request_uri, link, len);
+    struct uri_info info;
+    if (!uri || strcmp(uri, c->request_uri) == 0 || parse_uri(uri, &info) < 0 ||
+        !prefetch_allowed(c, &info)) {
+        free(uri);
+        return;
+    }
+    struct prefetch_job * job = calloc(1, sizeof(struct prefetch_job));
+    if (!job) {
+        free(uri);
+        atomic_fetch_add(&prefetcher.dropped, 1);
+        return;
+    }
+    job->uri = uri;
+    uri_digest(uri, strlen(uri), NULL, job->key);
+    strcpy(job->host, info.host);
+    job->port = info.port;
+    job->gzip = c->accept_gzip;
+    c->scan->links++;
+
+    int fresh;
+    struct web_cache * entry = webcache_lookup(job->key, LONG_MAX, &fresh, 0);
+    if (entry)
+        release_webcache(entry);
+    int queued = entry && fresh;
+    pthread_mutex_lock(&prefetcher.lock);
+    for (struct prefetch_job * j = prefetcher.jobs; j && !queued; j = j->next)
+        queued = memcmp(j->key, job->key, MD5_DIGEST_LENGTH) == 0;
+    for (int i = 0; i < PREFETCH_THREADS && !queued; i++)
+        queued = prefetcher.running[i] && memcmp(prefetcher.running[i]->key, job->key, MD5_DIGEST_LENGTH) == 0;
+    int full = prefetcher.queued >= PREFETCH_QUEUE;
+    if (!queued && !full) {
+        if (prefetcher.jobs_tail)
+            prefetcher.jobs_tail->next = job;
+        else
+            prefetcher.jobs = job;
+        prefetcher.jobs_tail = job;
+        prefetcher.queued++;
+        pthread_cond_signal(&prefetcher.cond);
+    }
+    pthread_mutex_unlock(&prefetcher.lock);
+    if (queued || full) {
+        atomic_fetch_add(queued ? &prefetcher.skipped : &prefetcher.dropped, 1);
+        free(job->uri);
+        free(job);
+        return;
+    }
+    atomic_fetch_add(&prefetcher.found, 1);
+}
+
+void init_prefetcher(int port, char * origins){
+    pthread_t tid;
+    pthread_mutex_init(&prefetcher.lock, NULL);
+    pthread_cond_init(&prefetcher.cond, NULL);
+    prefetcher.port = port;
+    prefetcher.origins = origins;
+    prefetcher.enabled = 1;
+    for (intptr_t i = 0; i < PREFETCH_THREADS; i++) {
+        pthread_create(&tid, NULL, prefetch_thread, (void *)i);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * prefetch_take - unlink the oldest job whose host:port has fewer than
+ * PREFETCH_PER_ORIGIN prefetches running, called with prefetcher.lock held
+ * Returns NULL if every queued job has to wait
+ */
+static struct prefetch_job * prefetch_take(void){
+    for (struct prefetch_job * j = prefetcher.jobs, * prev = NULL; j; prev = j, j = j->next) {
+        int running = 0;
+        for (int i = 0; i < PREFETCH_THREADS; i++) {
+            struct prefetch_job * r = prefetcher.running[i];
+            running += r && r->port == j->port && strcasecmp(r->host, j->host) == 0;
+        }
+        if (running >= PREFETCH_PER_ORIGIN)
+            continue;
+        if (prev)
+            prev->next = j->next;
+        else
+            prefetcher.jobs = j->next;
+        if (prefetcher.jobs_tail == j)
+            prefetcher.jobs_tail = prev;
+        prefetcher.queued--;
+        return j;
+    }
+    return NULL;
+}
+
+/*
+ * prefetch_fetch - ask the proxy itself for job's URI and read the response
+ * to the end, which leaves it in the web cache if it is cacheable. A body
+ * longer than the cache takes is not read
+ * Returns the status code, 0 if the body was too long, -1 if the request failed
+ */
+static int prefetch_fetch(struct prefetch_job * job){
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+                               .sin_port = htons(prefetcher.port)};
+    struct timeval tv = {IDLE_TIMEOUT, 0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    char * authority = uri_authority(job->uri);
+    char * request;
+    int len = asprintf(&request, "GET %s HTTP/1.1\r\nHost: %.*s\r\n%s" PREFETCH_HEADER ": 1\r\n"
+                                 "Connection: close\r\n\r\n",
+                       job->uri, (int)strcspn(authority, "/?"), authority,
+                       job->gzip ? "Accept-Encoding: gzip\r\n" : "");
+    int status = -1;
+    if (send(fd, request, len, MSG_NOSIGNAL) == len) {
+        char buf[RELAYBUF];
+        size_t got = 0;
+        ssize_t n;
+        char * end = NULL;
+        while (!end && got < sizeof(buf) - 1 && (n = recv(fd, buf + got, sizeof(buf) - 1 - got, 0)) > 0) {
+            got += n;
+            buf[got] = 0;
+            end = strstr(buf, "\r\n\r\n");
+        }
+        if (end && sscanf(buf, "HTTP/1.%*d %d", &status) == 1) {
+            //the proxy stores it as it relays, so read to the end unless it is too big to store
+            size_t len;
+            char * cl = head_value(buf, end + 4 - buf, "Content-Length", &len);
+            if (cl && strtoull(cl, NULL, 10) > cache_policy.max_obj)
+                status = 0;
+            else {
+                while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+                    ;
+                if (n < 0)
+                    status = -1;
+            }
+        }
+        else
+            status = -1;
+    }
+    free(request);
+    close(fd);
+    return status;
+}
+
+/* prefetch routine, fetches queued links one at a time */
+void * prefetch_thread(void * vargp)
+{
+    int slot = (intptr_t)vargp;
+    while (keep_running) {
+        pthread_mutex_lock(&prefetcher.lock);
+        struct prefetch_job * job;
+        while (!(job = prefetch_take()))
+            pthread_cond_wait(&prefetcher.cond, &prefetcher.lock);
+        prefetcher.running[slot] = job;
+        pthread_mutex_unlock(&prefetcher.lock);
+
+        //a client may have fetched it while it was queued
+        int fresh;
+        struct web_cache * entry = webcache_lookup(job->key, LONG_MAX, &fresh, 0);
+        if (entry)
+            release_webcache(entry);
+        if (entry && fresh)
+            atomic_fetch_add(&prefetcher.skipped, 1);
+        else {
+            int status = prefetch_fetch(job);
+            atomic_fetch_add(status == 200 ? &prefetcher.fetched :
+                             status == 0 ? &prefetcher.skipped : &prefetcher.failed, 1);
+            log_msg(LOG_DEBUG, "prefetch: %s %d", job->uri, status);
+        }
+
+        pthread_mutex_lock(&prefetcher.lock);
+        prefetcher.running[slot] = NULL;
+        //a job held back for this one's host:port may go now
+        pthread_cond_broadcast(&prefetcher.cond);
+        pthread_mutex_unlock(&prefetcher.lock);
+        free(job->uri);
+        free(job);
+    }
+    return NULL;
+}
+
+void print_prefetch_stats(void){
+    if (!prefetcher.enabled)
+        return;
+    unsigned long fetched = atomic_load(&prefetcher.fetched), used = atomic_load(&prefetcher.used);
+    printf("prefetch: %lu links queued, %lu skipped, %lu dropped, %lu fetched, %lu failed, "
+           "%lu used (%.3f of fetched)\n",
+           atomic_load(&prefetcher.found), atomic_load(&prefetcher.skipped),
+           atomic_load(&prefetcher.dropped), fetched, atomic_load(&prefetcher.failed),
+           used, fetched ? (double)used / fetched : 0.0);
+}
+
+/*start a non-blocking connect to the end server*/
+int connect_via_ip(struct conn * c, struct in_addr * addr, int port){
+    if (!port)
+        port = 80;
+
+    /* socket: create the socket */
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        log_msg(LOG_ERROR, "socket: %s", strerror(errno));
+        return -1;
+    }
+
+    /* build the server's Internet address */
+    bzero((char *) &c->serveraddr, sizeof(c->serveraddr));
+    c->serveraddr.sin_family = AF_INET;
+    c->serveraddr.sin_addr = *addr;
+    c->serveraddr.sin_port = htons(port);
+
+    //connect to host server, completion is picked up in CONN_CONNECT
+    int connected = connect(sockfd, (struct sockaddr *)&c->serveraddr, sizeof(c->serveraddr));
+    if (connected<0 && errno != EINPROGRESS) {
+        close(sockfd);
+        return -1;
+    }
+    c->serv_sockfd = sockfd;
+    return 0;
+}
+
+/*where the authority of a request URI starts, past http:// or https:// if it has one*/
+static char * uri_authority(char * uri){
+    if (strncasecmp(uri, "http://", 7) == 0)
+        return uri + 7;
+    if (strncasecmp(uri, "https://", 8) == 0)
+        return uri + 8;
+    return uri;
+}
+
+/*
+ * parse_uri - split an absolute URI (the scheme is optional) into host, port
+ * and the path to the resource on the end server
+ * Returns -1 if there is no usable host or port
+ */
+int parse_uri(char * uri, struct uri_info * server_info){
+    char * authority = uri_authority(uri);
+    static char root[] = "/";
+
+    //the path to the resource starts after host[:port]
+    size_t len = strcspn(authority, "/?#");
+    server_info->path.p = authority + len;
+    server_info->path.len = strlen(authority + len);
+    // incase the path to resource is empty
+    if (!server_info->path.len)
+        server_info->path.p = root, server_info->path.len = 1;
+
+    //Extract the port number and the hostname
+    char * at = memchr(authority, '@', len);
+    if (at) {
+        len -= at + 1 - authority;
+        authority = at + 1;
+    }
+    char * colon = memchr(authority, ':', len);
+    size_t host_len = colon ? (size_t)(colon - authority) : len;
+    server_info->port = 0;
+    if (colon) {
+        for (char * d = colon + 1; d < authority + len; d++) {
+            if (*d < '0' || *d > '9' || server_info->port > 65535)
+                return -1;
+            server_info->port = server_info->port * 10 + *d - '0';
+        }
+        if (server_info->port > 65535)
+            return -1;
+    }
+    if (host_len == 0 || host_len > MAX_HOST)
+        return -1;
+    memcpy(server_info->host, authority, host_len);
+    server_info->host[host_len] = 0;
+    return 0;
+}
+
+/*
+ * parse_hdr_info - copy a client request header that is passed on to the
+ * end server to data
+ * Returns the bytes written
+ */
+size_t parse_hdr_info(struct http_header * hdr, char * data){
+    static const char * dropped[] = {"User-Agent", "Accept", "Accept-Encoding", PREFETCH_HEADER, NULL};
+
+    if (hop_by_hop(hdr->name.p, hdr->name.len))
+        return 0;
+    for (int i = 0; dropped[i]; i++)
+        if (slice_eq(hdr->name, dropped[i]))
+            return 0;
+    memcpy(data, hdr->name.p, hdr->name.len);
+    memcpy(data + hdr->name.len, ": ", 2);
+    memcpy(data + hdr->name.len + 2, hdr->value.p, hdr->value.len);
+    memcpy(data + hdr->name.len + 2 + hdr->value.len, "\r\n", 2);
+    return hdr->name.len + hdr->value.len + 4;
+}
+
+/*the digest is already uniformly spread, so its first bytes are the hash*/
+static uint64_t webcache_hash(unsigned char * key){
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    return h;
+}
+
+static struct cache_shard * webcache_shard(uint64_t h){
+    return &webCache[(h >> 58) % CACHE_SHARDS];
+}
+
+void init_webcache(enum evict_kind kind, size_t capacity, size_t max_obj){
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&webCache[i].rwlock, NULL);
+        webCache[i].capacity = SHARD_SLOTS;
+        webCache[i].slots = calloc(SHARD_SLOTS, sizeof(struct web_cache *));
+    }
+    for (int i = 0; i < FLIGHT_BUCKETS; i++)
+        pthread_mutex_init(&flights[i].lock, NULL);
+    pthread_mutex_init(&variants.lock, NULL);
+    pthread_cond_init(&variants.cond, NULL);
+    pthread_mutex_init(&cache_policy.lock, NULL);
+    cache_policy.kind = kind;
+    cache_policy.capacity = capacity;
+    cache_policy.max_obj = max_obj < capacity ? max_obj : capacity;
+    pthread_mutex_init(&wheel.lock, NULL);
+    wheel.now = monotonic_now();
+    pthread_mutex_init(&journal.lock, NULL);
+    //worker processes past the first keep an index of their own
+    char base[24] = INDEX_BASE;
+    if (worker_index > 0)
+        sprintf(base, INDEX_BASE ".%d", worker_index);
+    sprintf(journal.checkpoint, "%s.ckpt", base);
+    sprintf(journal.checkpoint_tmp, "%s.ckpt.tmp", base);
+    sprintf(journal.path, "%s.journal", base);
+    sprintf(journal.old_path, "%s.journal.old", base);
+    pthread_mutex_init(&store.lock, NULL);
+    store.seg_size = capacity / 8 < SEGMENT_MIN_SIZE ? SEGMENT_MIN_SIZE :
+                     capacity / 8 > SEGMENT_SIZE ? SEGMENT_SIZE : capacity / 8;
+    store.next_id = (uint32_t)worker_index << SEGMENT_WORKER_SHIFT | 1;
+    mkdir(SEGMENT_DIR, 0755);
+    load_webcache_index();
+    log_msg(LOG_INFO, "cache: restored %lu entries in %.1f ms", journal.loaded, journal.load_ms);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, cache_sweeper, NULL);
+    pthread_detach(tid);
+    for (int i = 0; i < VARIANT_THREADS; i++) {
+        pthread_create(&tid, NULL, variant_thread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * shard_find - probe for key, caller holds the shard lock
+ * Returns the slot holding key, or the empty slot that ends its chain
+ */
+static size_t shard_find(struct cache_shard * shard, unsigned char * key, uint64_t h){
+    size_t mask = shard->capacity - 1;
+    size_t i = h & mask;
+    while (shard->slots[i]) {
+        if (shard->slots[i] != WEBCACHE_TOMBSTONE &&
+            memcmp(shard->slots[i]->key, key, MD5_DIGEST_LENGTH) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*double the table (or just purge tombstones) once it is 70% full*/
+static void shard_grow(struct cache_shard * shard){
+    size_t old_capacity = shard->capacity, live = 0;
+    struct web_cache ** old = shard->slots;
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i] && old[i] != WEBCACHE_TOMBSTONE)
+            live++;
+    if (live * 2 >= old_capacity)
+        shard->capacity *= 2;
+    shard->slots = calloc(shard->capacity, sizeof(struct web_cache *));
+    shard->used = live;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i] || old[i] == WEBCACHE_TOMBSTONE)
+            continue;
+        size_t mask = shard->capacity - 1;
+        size_t j = webcache_hash(old[i]->key) & mask;
+        while (shard->slots[j])
+            j = (j + 1) & mask;
+        shard->slots[j] = old[i];
+    }
+    free(old);
+}
+
+/*bytes of e's INDEX_ADD record*/
+static size_t index_record_len(struct web_cache * e){
+    return (sizeof(struct index_record) + (e->etag ? strlen(e->etag) : 0) + e->hdr_len + 2 + 7) & ~(size_t)7;
+}
+
+/*
+ * index_record_fill - describe e in a record at dst, which has room for
+ * index_record_len(e) bytes
+ * Returns the record length
+ */
+static size_t index_record_fill(char * dst, enum index_op op, struct web_cache * e,
+                                time_t wall, time_t mono){
+    struct index_record * r = (struct index_record *)dst;
+    bzero(r, sizeof(*r));
+    r->op = op;
+    r->len = sizeof(*r);
+    memcpy(r->key, e->key, MD5_DIGEST_LENGTH);
+    if (op == INDEX_DEL)
+        return r->len;
+    r->len = index_record_len(e);
+    r->fresh_until = wall + (e->fresh_until - mono);
+    r->born = wall - (e->initial_age + mono - e->stored);
+    r->last_modified = e->last_modified;
+    r->size = e->size;
+    r->body_off = e->body_off;
+    r->status = e->status;
+    r->etag_len = e->etag ? strlen(e->etag) : 0;
+    r->hdr_len = e->hdr_len;
+    r->segment = e->seg ? e->seg->id : 0;
+    r->seg_off = e->seg_off;
+    r->file_ino = e->file_ino;
+    r->file_mtime = e->file_mtime;
+    char * data = dst + sizeof(*r);
+    memcpy(data, e->etag, r->etag_len);
+    memcpy(data + r->etag_len + 1, e->hdr, e->hdr_len);
+    data[r->etag_len] = 0;
+    bzero(data + r->etag_len + 1 + e->hdr_len, r->len - sizeof(*r) - r->etag_len - 1 - e->hdr_len);
+    return r->len;
+}
+
+/*
+ * journal_append - queue an index change for the journal. Called under the
+ * entry's shard lock so changes to one key are journaled in order
+ */
+static void journal_append(enum index_op op, struct web_cache * e){
+    if (journal.fd < 0)
+        return;
+    //a borrowed entry is not ours to restore, but it did replace our copy
+    if (e->borrowed)
+        op = INDEX_DEL;
+    size_t len = op == INDEX_ADD ? index_record_len(e) : sizeof(struct index_record);
+    pthread_mutex_lock(&journal.lock);
+    if (journal.len + len > journal.cap) {
+        journal.cap = (journal.len + len) * 2;
+        journal.buf = realloc(journal.buf, journal.cap);
+    }
+    journal.len += index_record_fill(journal.buf + journal.len, op, e, time(NULL), monotonic_now());
+    journal.records++;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * journal_flush - write the queued index changes to the journal. If they
+ * do not all get out the journal is cut back to where this flush started,
+ * so no half record is left for the loader to stop at, and they are kept
+ * for the next try
+ */
+void journal_flush(void){
+    pthread_mutex_lock(&journal.lock);
+    if (journal.fd < 0 || !journal.len) {
+        journal.len = 0;
+        pthread_mutex_unlock(&journal.lock);
+        return;
+    }
+    off_t start = lseek(journal.fd, 0, SEEK_END);
+    size_t done = 0;
+    ssize_t n = 0;
+    while (done < journal.len && ((n = write(journal.fd, journal.buf + done, journal.len - done)) > 0 ||
+                                  (n < 0 && errno == EINTR)))
+        done += n > 0 ? n : 0;
+    if (done < journal.len) {
+        log_msg(LOG_ERROR, "%s: %s, %zu bytes of index changes kept", journal.path,
+                n < 0 ? strerror(errno) : "short write", journal.len);
+        if (done && (start < 0 || ftruncate(journal.fd, start) < 0))
+            log_msg(LOG_ERROR, "%s: torn record left, %s", journal.path, strerror(errno));
+        //a checkpoint makes a fresh journal either way
+        journal.failed = 1;
+    }
+    else {
+        journal.len = 0;
+        journal.failed = 0;
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static int index_file_open(char * path, int flags, uint64_t records){
+    struct index_file head = {INDEX_MAGIC, sizeof(struct index_record), records};
+    int fd = open(path, flags, 0644);
+    if (fd >= 0 && write(fd, &head, sizeof(head)) != sizeof(head)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * checkpoint_webcache - write every indexed entry to a new checkpoint and
+ * start an empty journal. Changes made while the shards are walked land in
+ * the new journal too, and replaying them over the checkpoint is harmless.
+ * The old journal is kept until the checkpoint covering it is in place, if
+ * an earlier checkpoint failed and left it behind the journal is not switched
+ */
+void checkpoint_webcache(void){
+    char * buf = NULL;
+    size_t len = 0, cap = 0;
+    uint64_t records = 0;
+    time_t wall = time(NULL), mono = monotonic_now();
+
+    journal_flush();
+    segment_sync();
+    pthread_mutex_lock(&journal.lock);
+    if (access(journal.old_path, F_OK) != 0) {
+        close(journal.fd);
+        rename(journal.path, journal.old_path);
+        journal.fd = index_file_open(journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0);
+        if (journal.fd < 0)
+            log_msg(LOG_ERROR, "%s: %s", journal.path, strerror(errno));
+        journal.records = 0;
+    }
+    journal.checkpointed = mono;
+    pthread_mutex_unlock(&journal.lock);
+
+    int fd = index_file_open(journal.checkpoint_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd < 0)
+        return;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard * shard = &webCache[s];
+        pthread_rwlock_rdlock(&shard->rwlock);
+        for (size_t i = 0; i < shard->capacity; i++) {
+            struct web_cache * e = shard->slots[i];
+            if (!e || e == WEBCACHE_TOMBSTONE || e->borrowed)
+                continue;
+            if (len + index_record_len(e) > cap) {
+                cap = (len + index_record_len(e)) * 2;
+                buf = realloc(buf, cap);
+            }
+            len += index_record_fill(buf + len, INDEX_ADD, e, wall, mono);
+            records++;
+        }
+        pthread_rwlock_unlock(&shard->rwlock);
+        //write outside the lock
+        if (len && write(fd, buf, len) != (ssize_t)len) {
+            close(fd);
+            free(buf);
+            unlink(journal.checkpoint_tmp);
+            return;
+        }
+        len = 0;
+    }
+    free(buf);
+    struct index_file head = {INDEX_MAGIC, sizeof(struct index_record), records};
+    pwrite(fd, &head, sizeof(head), 0);
+    fsync(fd);
+    close(fd);
+    if (rename(journal.checkpoint_tmp, journal.checkpoint) == 0)
+        unlink(journal.old_path);
+}
+
+/*put e on the wheel slot its deadline falls in, caller holds wheel.lock*/
+static void wheel_place(struct web_cache * e){
+    time_t when = e->retire_at > wheel.now ? e->retire_at : wheel.now + 1;
+    time_t delta = when - wheel.now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (time_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+    if (delta >= (time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+        //too far off, park it as late as the wheel reaches and look again then
+        when = wheel.now + ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    struct web_cache ** slot = &wheel.slots[level][(when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    e->timer_next = *slot;
+    if (*slot)
+        (*slot)->timer_pprev = &e->timer_next;
+    e->timer_pprev = slot;
+    *slot = e;
+}
+
+static void wheel_unlink(struct web_cache * e){
+    *e->timer_pprev = e->timer_next;
+    if (e->timer_next)
+        e->timer_next->timer_pprev = e->timer_pprev;
+    e->timer_pprev = NULL;
+}
+
+/*wheel_add with wheel.lock held*/
+static void wheel_arm(struct web_cache * e){
+    int validators = e->etag || e->last_modified >= 0;
+    e->retire_at = e->fresh_until + (validators ? STALE_RETAIN : 0);
+    atomic_fetch_add(&e->refcnt, 1);
+    wheel_place(e);
+    wheel.timers++;
+}
+
+/*
+ * wheel_add - start e's expiry timer. Fresh entries without validators go
+ * when they turn stale, ones with validators are kept a while longer to be
+ * revalidated. The wheel holds a reference until the timer is stopped
+ */
+static void wheel_add(struct web_cache * e){
+    pthread_mutex_lock(&wheel.lock);
+    wheel_arm(e);
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+/*stop e's timer, if it has not fired yet, once e leaves the index*/
+static void wheel_remove(struct web_cache * e){
+    int removed = 0;
+    pthread_mutex_lock(&wheel.lock);
+    if (e->timer_pprev) {
+        wheel_unlink(e);
+        wheel.timers--;
+        removed = 1;
+    }
+    pthread_mutex_unlock(&wheel.lock);
+    if (removed)
+        release_webcache(e);
+}
+
+/*take a due e off the wheel onto *expired*/
+static void wheel_expire(struct web_cache * e, struct web_cache ** expired){
+    e->timer_pprev = NULL;
+    e->timer_next = *expired;
+    *expired = e;
+    wheel.timers--;
+}
+
+/*
+ * wheel_advance - sweep the wheel forward to the monotonic second to,
+ * cascading higher levels down as level 0 wraps. Entries whose deadline has
+ * passed are taken off the wheel and chained on *expired
+ */
+static void wheel_advance(time_t to, struct web_cache ** expired){
+    while (wheel.now < to) {
+        time_t t = ++wheel.now;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (t & (((time_t)1 << (WHEEL_BITS * level)) - 1))
+                break;
+            struct web_cache ** slot = &wheel.slots[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            struct web_cache * e = *slot;
+            *slot = NULL;
+            while (e) {
+                struct web_cache * next = e->timer_next;
+                if (e->retire_at > t)
+                    wheel_place(e);
+                else
+                    wheel_expire(e, expired);
+                e = next;
+            }
+        }
+        struct web_cache ** slot = &wheel.slots[0][t & (WHEEL_SLOTS - 1)];
+        struct web_cache * e = *slot;
+        *slot = NULL;
+        while (e) {
+            struct web_cache * next = e->timer_next;
+            if (e->retire_at > t)
+                wheel_place(e);
+            else
+                wheel_expire(e, expired);
+            e = next;
+        }
+    }
+}
+
+/*
+ * webcache_drop - entry left the index, free its storage. Its bytes in a
+ * segment are dead, its own file is deleted if the name still holds it and
+ * not next, the copy that replaced it. Other worker processes name their
+ * files apart, and a borrowed entry's storage is left to the one that owns it
+ */
+static void webcache_drop(struct web_cache * entry, struct web_cache * next){
+    char filename[48];
+    struct stat st;
+    if (entry->borrowed)
+        return;
+    shared_withdraw(entry);
+    if (entry->seg) {
+        atomic_fetch_sub(&entry->seg->live, entry->size);
+        return;
+    }
+    webcache_filename(entry->key, worker_index, filename);
+    //without its identity, go by whether next took the name
+    if (entry->file_ino ? stat(filename, &st) == 0 && webcache_same_file(entry, &st) : !next || next->seg)
+        unlink(filename);
+}
+
+/*
+ * removefrom_webcache - drop entry from the index if it is still the current
+ * copy of its key, along with its storage. A newer copy keeps the file
+ * Returns 1 if it was removed
+ */
+static int removefrom_webcache(struct web_cache * entry){
+    uint64_t h = webcache_hash(entry->key);
+    struct cache_shard * shard = webcache_shard(h);
+    int removed = 0;
+
+    pthread_rwlock_wrlock(&shard->rwlock);
+    size_t i = shard_find(shard, entry->key, h);
+    if (shard->slots[i] == entry) {
+        shard->slots[i] = WEBCACHE_TOMBSTONE;
+        journal_append(INDEX_DEL, entry);
+        removed = 1;
+    }
+    pthread_rwlock_unlock(&shard->rwlock);
+    if (removed) {
+        webcache_drop(entry, NULL);
+        wheel_remove(entry);
+        release_webcache(entry);
+    }
+    return removed;
+}
+
+static void list_unlink(struct cache_list * list, struct web_cache * e){
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        list->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        list->tail = e->prev;
+    list->bytes -= e->size;
+}
+
+static void list_push(struct cache_list * list, struct web_cache * e){
+    e->prev = NULL;
+    e->next = list->head;
+    if (list->head)
+        list->head->prev = e;
+    else
+        list->tail = e;
+    list->head = e;
+    list->bytes += e->size;
+}
+
+static void heap_swap(size_t a, size_t b){
+    struct web_cache ** heap = cache_policy.heap;
+    struct web_cache * tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_idx = a;
+    heap[b]->heap_idx = b;
+}
+
+/*move i down until neither child has a lower priority*/
+static void heap_down(size_t i){
+    struct web_cache ** heap = cache_policy.heap;
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < cache_policy.heap_len && heap[l]->priority < heap[min]->priority)
+            min = l;
+        if (r < cache_policy.heap_len && heap[r]->priority < heap[min]->priority)
+            min = r;
+        if (min == i)
+            break;
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+/*restore heap order around i after its priority changed*/
+static void heap_fix(size_t i){
+    struct web_cache ** heap = cache_policy.heap;
+    while (i > 0 && heap[i]->priority < heap[(i - 1) / 2]->priority) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    heap_down(i);
+}
+
+/*GDSF priority, L + frequency * cost / size with a cost of one per object*/
+static double gdsf_priority(struct web_cache * e){
+    return cache_policy.inflation + (double)e->freq / (e->size ? e->size : 1);
+}
+
+/*policy bookkeeping, all called with cache_policy.lock held*/
+static void policy_insert(struct web_cache * e){
+    e->in_policy = 1;
+    e->protected = 0;
+    e->freq = 1;
+    if (e->borrowed) {
+        //its storage is another worker's budget, only the handle is ours
+        list_push(&cache_policy.borrowed, e);
+        cache_policy.borrowed_len++;
+        return;
+    }
+    cache_policy.bytes += e->size;
+    if (cache_policy.kind == EVICT_GDSF) {
+        if (cache_policy.heap_len == cache_policy.heap_cap) {
+            cache_policy.heap_cap = cache_policy.heap_cap ? cache_policy.heap_cap * 2 : 64;
+            cache_policy.heap = realloc(cache_policy.heap,
+                                        cache_policy.heap_cap * sizeof(struct web_cache *));
+        }
+        e->priority = gdsf_priority(e);
+        e->heap_idx = cache_policy.heap_len++;
+        cache_policy.heap[e->heap_idx] = e;
+        heap_fix(e->heap_idx);
+    }
+    else
+        list_push(&cache_policy.lru, e);
+}
+
+/*policy_insert for n entries, oldest first. A heap is built in one pass rather than sifted n times*/
+static void policy_insert_all(struct web_cache * entries, size_t n){
+    if (cache_policy.kind != EVICT_GDSF) {
+        for (size_t k = 0; k < n; k++)
+            policy_insert(&entries[k]);
+        return;
+    }
+    if (cache_policy.heap_len + n > cache_policy.heap_cap) {
+        cache_policy.heap_cap = cache_policy.heap_len + n;
+        cache_policy.heap = realloc(cache_policy.heap, cache_policy.heap_cap * sizeof(struct web_cache *));
+    }
+    for (size_t k = 0; k < n; k++) {
+        struct web_cache * e = &entries[k];
+        e->in_policy = 1;
+        e->protected = 0;
+        e->freq = 1;
+        cache_policy.bytes += e->size;
+        e->priority = gdsf_priority(e);
+        e->heap_idx = cache_policy.heap_len++;
+        cache_policy.heap[e->heap_idx] = e;
+    }
+    for (size_t i = cache_policy.heap_len / 2; i-- > 0;)
+        heap_down(i);
+}
+
+static void policy_remove(struct web_cache * e){
+    e->in_policy = 0;
+    if (e->borrowed) {
+        list_unlink(&cache_policy.borrowed, e);
+        cache_policy.borrowed_len--;
+        return;
+    }
+    cache_policy.bytes -= e->size;
+    if (cache_policy.kind == EVICT_GDSF) {
+        size_t i = e->heap_idx;
+        cache_policy.heap_len--;
+        if (i != cache_policy.heap_len) {
+            heap_swap(i, cache_policy.heap_len);
+            heap_fix(i);
+        }
+    }
+    else
+        list_unlink(e->protected ? &cache_policy.protect : &cache_policy.lru, e);
+}
+
+/*put e where old is in the eviction order, for a copy of the same object borrowed or not like it*/
+static void policy_replace(struct web_cache * old, struct web_cache * e){
+    e->in_policy = 1;
+    e->protected = old->protected;
+    e->freq = old->freq;
+    e->priority = old->priority;
+    old->in_policy = 0;
+    if (!e->borrowed)
+        cache_policy.bytes += e->size - old->size;
+    if (cache_policy.kind == EVICT_GDSF && !e->borrowed) {
+        e->heap_idx = old->heap_idx;
+        cache_policy.heap[e->heap_idx] = e;
+        return;
+    }
+    struct cache_list * list = e->borrowed ? &cache_policy.borrowed :
+                               e->protected ? &cache_policy.protect : &cache_policy.lru;
+    e->prev = old->prev;
+    e->next = old->next;
+    if (e->prev)
+        e->prev->next = e;
+    else
+        list->head = e;
+    if (e->next)
+        e->next->prev = e;
+    else
+        list->tail = e;
+    list->bytes += e->size - old->size;
+}
+
+static void policy_touch(struct web_cache * e){
+    e->freq++;
+    if (e->borrowed) {
+        list_unlink(&cache_policy.borrowed, e);
+        list_push(&cache_policy.borrowed, e);
+        return;
+    }
+    if (cache_policy.kind == EVICT_GDSF) {
+        e->priority = gdsf_priority(e);
+        heap_fix(e->heap_idx);
+        return;
+    }
+    list_unlink(e->protected ? &cache_policy.protect : &cache_policy.lru, e);
+    if (cache_policy.kind == EVICT_SLRU) {
+        //a second hit promotes, protected overflow is demoted to probation
+        e->protected = 1;
+        list_push(&cache_policy.protect, e);
+        while (cache_policy.protect.bytes > cache_policy.capacity * SLRU_PROTECTED &&
+               cache_policy.protect.tail != e) {
+            struct web_cache * demoted = cache_policy.protect.tail;
+            list_unlink(&cache_policy.protect, demoted);
+            demoted->protected = 0;
+            list_push(&cache_policy.lru, demoted);
+        }
+    }
+    else
+        list_push(&cache_policy.lru, e);
+}
+
+static struct web_cache * policy_victim(void){
+    if (cache_policy.kind == EVICT_GDSF) {
+        if (!cache_policy.heap_len)
+            return NULL;
+        cache_policy.inflation = cache_policy.heap[0]->priority;
+        return cache_policy.heap[0];
+    }
+    if (cache_policy.lru.tail)
+        return cache_policy.lru.tail;
+    return cache_policy.protect.tail;
+}
+
+/*
+ * evict until the cache fits its byte budget and holds at most BORROWED_MAX
+ * borrowed entries, caller holds cache_policy.lock
+ */
+static void evict_webcache(void){
+    while (cache_policy.borrowed_len > BORROWED_MAX) {
+        struct web_cache * victim = cache_policy.borrowed.tail;
+        policy_remove(victim);
+        removefrom_webcache(victim);
+    }
+    while (cache_policy.bytes > cache_policy.capacity) {
+        struct web_cache * victim = policy_victim();
+        if (!victim)
+            break;
+        policy_remove(victim);
+        atomic_fetch_add(&cache_stats.evictions, 1);
+        atomic_fetch_add(&cache_stats.evicted_bytes, victim->size);
+
+        removefrom_webcache(victim);
+    }
+}
+
+/*seconds a response was already old when it got here*/
+static long response_age(struct cache_meta * meta, time_t now){
+    long age = meta->date >= 0 && now > meta->date ? now - meta->date : 0;
+    return meta->age > age ? meta->age : age;
+}
+
+/*
+ * freshness_lifetime - how long a response stays fresh after it was sent:
+ * s-maxage or max-age, else Expires, else a tenth of the time since it was
+ * last modified. The timeout argument caps that guess and is the lifetime of
+ * responses that say nothing at all
+ */
+static long freshness_lifetime(struct cache_meta * meta, time_t now){
+    time_t date = meta->date >= 0 ? meta->date : now;
+    if (meta->no_cache)
+        return 0;
+    if (meta->max_age >= 0)
+        return meta->max_age;
+    if (meta->expires >= 0)
+        return meta->expires > date ? meta->expires - date : 0;
+    if (meta->last_modified >= 0 && meta->last_modified < date &&
+        (date - meta->last_modified) / 10 < timeout)
+        return (date - meta->last_modified) / 10;
+    return timeout;
+}
+
+/*
+ * webcache_storable - whether a response may be stored and is worth it,
+ * it must be fresh for a while or come with a validator
+ */
+int webcache_storable(struct cache_meta * meta, int authorized){
+    static const int heuristic[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501, 0};
+    int i;
+    if (meta->no_store || (authorized && !meta->shared) ||
+        meta->status == 206 || meta->status == 304)
+        return 0;
+    for (i = 0; heuristic[i] && heuristic[i] != meta->status; i++)
+        ;
+    //other codes need to say how long they stay fresh
+    if (!heuristic[i] && meta->max_age < 0 && meta->expires < 0)
+        return 0;
+    time_t now = time(NULL);
+    return freshness_lifetime(meta, now) > response_age(meta, now) ||
+           meta->etag.p || meta->last_modified >= 0;
+}
+
+static struct web_cache * new_webcache(unsigned char * key, size_t size, char * hdr,
+                                       size_t hdr_len, struct cache_meta * meta){
+    time_t now = time(NULL);
+    struct web_cache * pair = calloc(1, sizeof(struct web_cache));
+    memcpy(pair->key, key, MD5_DIGEST_LENGTH);
+    pair->status = meta->status;
+    pair->stored = monotonic_now();
+    pair->initial_age = response_age(meta, now);
+    pair->fresh_until = pair->stored + freshness_lifetime(meta, now) - pair->initial_age;
+    pair->etag = meta->etag.p ? strndup(meta->etag.p, meta->etag.len) : NULL;
+    pair->last_modified = meta->last_modified;
+    pair->size = size;
+    atomic_init(&pair->prefetched, meta->prefetched);
+    pair->hdr = malloc(hdr_len + 1);
+    memcpy(pair->hdr, hdr, hdr_len);
+    pair->hdr[hdr_len] = 0;
+    pair->hdr_len = pair->body_off = hdr_len;
+    atomic_init(&pair->refcnt, 1);
+    atomic_init(&pair->fd, -1);
+    return pair;
+}
+
+/*
+ * webcache_insert - index pair in place of the current entry for its key,
+ * or with expect set only if expect is still the current entry. The index
+ * takes over the caller's reference
+ * Returns 1 if pair was indexed
+ */
+static int webcache_insert(struct web_cache * pair, struct web_cache * expect){
+    uint64_t h = webcache_hash(pair->key);
+    struct cache_shard * shard = webcache_shard(h);
+
+    wheel_add(pair);
+    pthread_rwlock_wrlock(&shard->rwlock);
+    if ((shard->used + 1) * 10 > shard->capacity * 7)
+        shard_grow(shard);
+    size_t i = shard_find(shard, pair->key, h);
+    struct web_cache * old = shard->slots[i];
+    if (expect && old != expect) {
+        pthread_rwlock_unlock(&shard->rwlock);
+        wheel_remove(pair);
+        return 0;
+    }
+    if (!old)
+        shard->used++;
+    shard->slots[i] = pair;
+    journal_append(INDEX_ADD, pair);
+    shared_publish(pair);
+    pthread_rwlock_unlock(&shard->rwlock);
+    if (pair->seg && !pair->borrowed)
+        atomic_fetch_add(&pair->seg->live, pair->size);
+
+    //a copy made with expect set takes the place of the one it replaces
+    pthread_mutex_lock(&cache_policy.lock);
+    if (old && old->in_policy && expect && old->borrowed == pair->borrowed)
+        policy_replace(old, pair);
+    else {
+        if (old && old->in_policy)
+            policy_remove(old);
+        policy_insert(pair);
+    }
+    evict_webcache();
+    pthread_mutex_unlock(&cache_policy.lock);
+    if (old) {
+        webcache_drop(old, pair);
+        wheel_remove(old);
+        release_webcache(old);
+    }
+    return 1;
+}
+
+/*
+ * webcache_restore - webcache_insert for the n entries read back at startup,
+ * oldest first. Their keys are distinct and nothing else runs yet, so each
+ * goes in an empty slot and the wheel and eviction order are built in one
+ * pass under one lock
+ */
+static void webcache_restore(struct web_cache * entries, size_t n){
+    pthread_mutex_lock(&wheel.lock);
+    for (size_t k = 0; k < n; k++)
+        wheel_arm(&entries[k]);
+    pthread_mutex_unlock(&wheel.lock);
+    for (size_t k = 0; k < n; k++) {
+        struct web_cache * e = &entries[k];
+        uint64_t h = webcache_hash(e->key);
+        struct cache_shard * shard = webcache_shard(h);
+        pthread_rwlock_wrlock(&shard->rwlock);
+        if ((shard->used + 1) * 10 > shard->capacity * 7)
+            shard_grow(shard);
+        shard->slots[shard_find(shard, e->key, h)] = e;
+        shard->used++;
+        shared_publish(e);
+        pthread_rwlock_unlock(&shard->rwlock);
+        if (e->seg)
+            atomic_fetch_add(&e->seg->live, e->size);
+    }
+    pthread_mutex_lock(&cache_policy.lock);
+    policy_insert_all(entries, n);
+    evict_webcache();
+    pthread_mutex_unlock(&cache_policy.lock);
+}
+
+/*release a restored entry's share of the arena*/
+static void arena_release(void){
+    if (atomic_fetch_sub(&arena.live, 1) != 1)
+        return;
+    free(arena.entries);
+    for (int f = 0; f < 3; f++)
+        if (arena.maps[f])
+            munmap(arena.maps[f], arena.lens[f]);
+}
+
+/*
+ * adds uri digest to the index, replacing any older copy. The object is at
+ * seg_off in seg, whose reference the entry takes, or in its own file open
+ * as fd
+ */
+void addto_webcache(unsigned char * key, size_t size, char * hdr, size_t hdr_len,
+                    struct cache_meta * meta, struct segment * seg, size_t seg_off, int fd){
+    if (size > cache_policy.max_obj) {
+        if (seg)
+            segment_release(seg);
+        atomic_fetch_add(&cache_stats.rejected, 1);
+        return;
+    }
+    struct web_cache * pair = new_webcache(key, size, hdr, hdr_len, meta);
+    struct stat st;
+    pair->seg = seg;
+    pair->seg_off = seg_off;
+    if (!seg && fstat(fd, &st) == 0) {
+        pair->file_ino = st.st_ino;
+        pair->file_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    }
+    webcache_insert(pair, NULL);
+    atomic_fetch_add(&cache_stats.insertions, 1);
+}
+
+/*
+ * refresh_webcache - the end server confirmed entry with a 304, make a copy
+ * with the updated head and freshness that shares entry's file. It replaces
+ * entry in the index unless entry was evicted or replaced meanwhile
+ * Returns the copy with a reference for the caller, *indexed says if it was
+ */
+struct web_cache * refresh_webcache(struct web_cache * entry, char * hdr, size_t hdr_len,
+                                    struct cache_meta * meta, int * indexed){
+    struct web_cache * pair = new_webcache(entry->key, entry->size, hdr, hdr_len, meta);
+    pair->body_off = entry->body_off;
+    pair->status = entry->status;
+    pair->seg = entry->seg;
+    pair->seg_off = entry->seg_off;
+    pair->borrowed = entry->borrowed;
+    pair->file_ino = entry->file_ino;
+    pair->file_mtime = entry->file_mtime;
+    if (pair->seg)
+        atomic_fetch_add(&pair->seg->refcnt, 1);
+    atomic_fetch_add(&pair->refcnt, 1);
+    *indexed = webcache_insert(pair, entry);
+    if (!*indexed)
+        atomic_fetch_sub(&pair->refcnt, 1);
+    return pair;
+}
+
+/*map an index file, checking its header. Returns NULL if there is none*/
+static char * index_file_map(char * path, size_t * len){
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    char * map = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct index_file))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (!map || map == MAP_FAILED)
+        return NULL;
+    struct index_file * head = (struct index_file *)map;
+    if (head->magic != INDEX_MAGIC || head->record_size != sizeof(struct index_record)) {
+        log_msg(LOG_WARN, "%s: not an index of this build, ignored", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *len = st.st_size;
+    return map;
+}
+
+/*
+ * fill the zeroed pair for a record read back from disk, its head stays in
+ * the mapping. It takes the caller's reference to seg, the segment the
+ * record names
+ */
+static struct web_cache * index_record_entry(struct web_cache * pair, struct index_record * r,
+                                             struct segment * seg, time_t wall, time_t mono){
+    char * data = (char *)(r + 1);
+    pair->seg = seg;
+    pair->seg_off = r->seg_off;
+    pair->file_ino = r->file_ino;
+    pair->file_mtime = r->file_mtime;
+    pair->mapped = 1;
+    memcpy(pair->key, r->key, MD5_DIGEST_LENGTH);
+    pair->status = r->status;
+    pair->stored = mono;
+    pair->initial_age = wall > r->born ? wall - r->born : 0;
+    pair->fresh_until = mono + (r->fresh_until - wall);
+    pair->etag = r->etag_len ? data : NULL;
+    pair->last_modified = r->last_modified;
+    pair->size = r->size;
+    pair->body_off = r->body_off;
+    pair->hdr_len = r->hdr_len;
+    pair->hdr = data + r->etag_len + 1;
+    atomic_init(&pair->refcnt, 1);
+    atomic_init(&pair->fd, -1);
+    return pair;
+}
+
+#define INDEX_DELETED ((size_t)-1)
+
+/*
+ * load_webcache_index - rebuild the index from the last checkpoint and the
+ * journals written since, replaying them into a table of the latest record
+ * per key. The cache files themselves are not looked at, a missing or
+ * replaced one is noticed when it is first opened. Entries that expired
+ * while the proxy was down are dropped by the first sweep. The entries are
+ * allocated in one block and the files stay mapped for their heads, which
+ * the kernel can page out as needed, until the last of them is released
+ */
+void load_webcache_index(void){
+    char * paths[] = {journal.checkpoint, journal.old_path, journal.path};
+    char ** maps = arena.maps;
+    size_t * lens = arena.lens, total = 0;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    journal.fd = -1;
+    for (int f = 0; f < 3; f++) {
+        maps[f] = index_file_map(paths[f], &lens[f]);
+        total += maps[f] ? lens[f] : 0;
+    }
 
-int main(int argc, char **argv) 
-{
-    setbuf(stdout, 0);
-    int listenfd, *connfdp, port, clientlen=sizeof(struct sockaddr_in);
-    struct sockaddr_in clientaddr;
-    pthread_t tid;
-    pthread_rwlock_init(&(webcache_start_rwlock), NULL);
-    pthread_rwlock_init(&(ipcache_start_rwlock), NULL);
-    pthread_rwlock_init(&(blacklist_rwlock), NULL);
+    /*
+     * latest record per key: records in file order, the table maps a key
+     * to the position of its latest one by open addressing over the digest
+     * and superseded ones are cleared, so the survivors stay in file order
+     */
+    size_t most = total / sizeof(struct index_record), n = 0, live = 0;
+    size_t cap = pow2_at_least(most * 2 + 2), mask = cap - 1;
+    struct index_record ** order = malloc((most ? most : 1) * sizeof(struct index_record *));
+    size_t * table = calloc(cap, sizeof(size_t));     /* position + 1, 0 if empty */
+    for (int f = 0; f < 3; f++) {
+        size_t off = sizeof(struct index_file);
+        while (maps[f] && off + sizeof(struct index_record) <= lens[f]) {
+            struct index_record * r = (struct index_record *)(maps[f] + off);
+            if ((r->op != INDEX_ADD && r->op != INDEX_DEL) || r->len < sizeof(*r) ||
+                r->len > lens[f] - off ||
+                (r->op == INDEX_ADD && sizeof(*r) + r->etag_len + r->hdr_len + 2 > r->len))
+                break;  /* torn write at the end of a journal */
+            size_t i = webcache_hash(r->key) & mask;
+            while (table[i] && (table[i] == INDEX_DELETED ||
+                   memcmp(order[table[i] - 1]->key, r->key, MD5_DIGEST_LENGTH) != 0))
+                i = (i + 1) & mask;
+            if (table[i]) {
+                order[table[i] - 1] = NULL;
+                live--;
+                table[i] = INDEX_DELETED;
+            }
+            if (r->op == INDEX_ADD) {
+                order[n] = r;
+                table[i] = ++n;
+                live++;
+            }
+            off += r->len;
+        }
+    }
+    free(table);
 
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <port> <timeout>\n", argv[0]);
-        exit(0);
+    //size the shards for what is coming rather than growing them step by step
+    size_t slots = pow2_at_least(live / CACHE_SHARDS * 2);
+    for (int s = 0; s < CACHE_SHARDS && slots > webCache[s].capacity; s++) {
+        free(webCache[s].slots);
+        webCache[s].capacity = slots;
+        webCache[s].slots = calloc(slots, sizeof(struct web_cache *));
     }
-    port = atoi(argv[1]);
-    timeout = atoi(argv[2]);
 
-    listenfd = open_listenfd(port);
-    while (1) {
-        /*register signal handler*/
-        signal(SIGINT, intHandler);
-        connfdp = malloc(sizeof(int));
-        *connfdp = accept(listenfd, (struct sockaddr*)&clientaddr, &clientlen);
-        pthread_create(&tid, NULL, thread, connfdp);
-        if (keep_running==0){
-            exit(0);
+    time_t wall = time(NULL), mono = monotonic_now();
+    arena.entries = calloc(live ? live : 1, sizeof(struct web_cache));
+    for (size_t k = 0; k < n; k++) {
+        struct index_record * r = order[k];
+        struct segment * seg = NULL;
+        if (!r)
+            continue;
+        //skip it if its segment is gone or ends before it
+        if (r->segment) {
+            seg = segment_find(r->segment);
+            if (!seg || seg->tail < r->seg_off + r->size)
+                continue;
+            atomic_fetch_add(&seg->refcnt, 1);
         }
+        index_record_entry(&arena.entries[journal.loaded++], r, seg, wall, mono);
+    }
+    free(order);
+    atomic_init(&arena.live, journal.loaded);
+    if (journal.loaded)
+        webcache_restore(arena.entries, journal.loaded);
+    else {
+        atomic_init(&arena.live, 1);
+        arena_release();
     }
+    segment_recover();
+
+    //carry on appending to the journal, the first sweep folds it into a checkpoint
+    journal.fd = open(journal.path, O_WRONLY | O_APPEND);
+    if (journal.fd < 0)
+        journal.fd = index_file_open(journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0);
+    if (journal.fd < 0)
+        log_msg(LOG_ERROR, "%s: %s", journal.path, strerror(errno));
+    journal.records = total > 0;
+    journal.checkpointed = mono - CHECKPOINT_INTERVAL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    journal.load_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
 }
 
-/* thread routine */
-void * thread(void * vargp) 
-{  
-    int connfd = *((int *)vargp);
-    pthread_detach(pthread_self()); 
-    free(vargp);
-    service_http_request(connfd);
-    close(connfd);
-    return NULL;
+/*seconds since entry's response was generated*/
+long webcache_age(struct web_cache * entry){
+    return entry->initial_age + monotonic_now() - entry->stored;
 }
 
 /*
- * service_http_request - service a http request and send a response accordingly
+ * get_webcache - look up the entry for key. It is fresh if it has not
+ * outlived its freshness lifetime and is no older than max_age. Stale
+ * entries are still returned so the caller can revalidate them
+ * Returns the entry with a reference the caller drops via release_webcache
  */
+struct web_cache * get_webcache(unsigned char * key, long max_age, int * fresh){
+    return webcache_lookup(key, max_age, fresh, 1);
+}
 
-void service_http_request(int connfd){
-    char request_method[5];
-    char request_uri[120];
-    char request_ver[10];
-    char buf[MAXBUF];
-    struct uri_info serv_info;
-    char new_request[MAXBUF];
-    char response[1<<15];
-    ssize_t n;
-
+/*get_webcache, leaving the hit and miss counts alone unless counted*/
+static struct web_cache * webcache_lookup(unsigned char * key, long max_age, int * fresh, int counted){
+    uint64_t h = webcache_hash(key);
+    struct cache_shard * shard = webcache_shard(h);
+    struct web_cache * ptr;
 
-    recv(connfd, buf, MAXLINE,0);
+    pthread_rwlock_rdlock(&shard->rwlock);
+    ptr = shard->slots[shard_find(shard, key, h)];
+    if (ptr)
+        atomic_fetch_add(&ptr->refcnt, 1);
+    pthread_rwlock_unlock(&shard->rwlock);
 
-    /*Parse first line info*/
-    char * first_line;
-    first_line = strtok(buf, "\r\n");
-    if (!first_line)
-        return;
-    sscanf(first_line, "%s %s %s", request_method, request_uri, request_ver);
-    if (strcasecmp(request_method, "GET")!=0){
-        //handle for methods other than GET
-        char httperr[50];
-        sprintf(httperr, "HTTP/1.0 400 Bad Request");
-        bzero(buf, MAXBUF);
-        strcpy(buf, httperr);
-        write(connfd, buf, strlen(httperr));
-        return;
+    //another worker process may have it
+    if (!ptr && (ptr = shared_import(key))) {
+        atomic_fetch_add(&ptr->refcnt, 1);
+        webcache_insert(ptr, NULL);
+        atomic_fetch_add(&cache_stats.borrowed, 1);
     }
 
-    parse_uri(request_uri, &serv_info);
-
-    /*Parse additional hdr info*/
-    char * hdr_ln;
-    char hdr_data[MAXLINE];
-    int host_info_provided = 0;
-    hdr_ln = strtok(NULL, "\r\n");
-    if (hdr_ln) {
-        while (strcmp(hdr_ln, "\r\n") != 0) {
-            parse_hdr_info(hdr_ln, hdr_data, &host_info_provided);
-            hdr_ln = strtok(NULL, "\r\n");
-            if (hdr_ln == NULL)
-                break;
+    if (!ptr) {
+        if (counted)
+            atomic_fetch_add(&cache_stats.misses, 1);
+        return NULL;
+    }
+    *fresh = monotonic_now() < ptr->fresh_until && webcache_age(ptr) <= max_age;
+    if (!*fresh) {
+        if (counted) {
+            atomic_fetch_add(&cache_stats.expired, 1);
+            atomic_fetch_add(&cache_stats.misses, 1);
         }
+        return ptr;
     }
+    if (counted)
+        atomic_fetch_add(&cache_stats.hits, 1);
+    atomic_fetch_add(&ptr->hits, 1);
+    pthread_mutex_lock(&cache_policy.lock);
+    if (ptr->in_policy)
+        policy_touch(ptr);
+    pthread_mutex_unlock(&cache_policy.lock);
+    return ptr;
+}
 
-    //Generate a new modified HTTP request to forward to the server
-    sprintf(new_request, "GET %s HTTP/1.0\r\n", serv_info.path);
-
-    //if no host info provided add host info to request
-    if (!host_info_provided){
-        sprintf(new_request, "%sHost: %s\r\n", new_request, serv_info.host);
+void release_webcache(struct web_cache * entry){
+    if (atomic_fetch_sub(&entry->refcnt, 1) != 1)
+        return;
+    char * map = atomic_load(&entry->map);
+    int fd = atomic_load(&entry->fd);
+    if (map)
+        munmap(map, entry->size);
+    if (fd >= 0) {
+        close(fd);
+        atomic_fetch_sub(&cache_fds, 1);
+    }
+    if (entry->seg)
+        segment_release(entry->seg);
+    if (entry->mapped)
+        arena_release();
+    else {
+        free(entry->hdr);
+        free(entry->etag);
+        free(entry);
     }
+}
 
-    strcat(new_request, hdr_data);
-    strcat(new_request, "\r\n");
+/*
+ * cache_sweeper - once a second move the wheel up to the current time and
+ * drop the entries whose deadline passed, so their files and memory go
+ * without lookups having to notice they expired
+ */
+void * cache_sweeper(void * vargp)
+{
+    while (keep_running) {
+        struct web_cache * expired = NULL;
+        sleep(1);
+        if (atomic_load(&stop_requested))
+            shutdown_proxy();
+        if (atomic_exchange(&stats_requested, 0))
+            print_all_stats();
+        pthread_mutex_lock(&wheel.lock);
+        wheel_advance(monotonic_now(), &expired);
+        pthread_mutex_unlock(&wheel.lock);
+        journal_flush();
+        //checkpoint now and then, or once replaying the journal would cost more than loading one
+        if (journal.failed || (journal.records && (monotonic_now() - journal.checkpointed >= CHECKPOINT_INTERVAL ||
+                                                   journal.records > wheel.timers + 65536)))
+            checkpoint_webcache();
 
-    //check if blacklisted
-    int blacklist = check_blacklisted(serv_info.host);
-    if (blacklist){
-        //send forbidden error to client
-        char httperr[50];
-        sprintf(httperr, "HTTP/1.0 403 Forbidden");
-        bzero(buf, MAXBUF);
-        strcpy(buf, httperr);
-        write(connfd, buf, strlen(httperr));
-        return;
+        while (expired) {
+            struct web_cache * e = expired;
+            expired = e->timer_next;
+            pthread_mutex_lock(&cache_policy.lock);
+            if (e->in_policy)
+                policy_remove(e);
+            pthread_mutex_unlock(&cache_policy.lock);
+            if (removefrom_webcache(e))
+                atomic_fetch_add(&cache_stats.retired, 1);
+            release_webcache(e);
+        }
+        segment_compact();
+        segment_unborrow();
     }
+    return NULL;
+}
 
-    /*Connect to host server*/
-    int serv_sockfd;
-    struct ip_cache * ptr = get_ipcache(serv_info.host);
-    if (ptr)
-        serv_sockfd = connect_via_ip(ptr->ip, serv_info.port);
-    else
-        serv_sockfd = connect_via_name(serv_info.host, serv_info.port);
+static void segment_path(uint32_t id, char * path){
+    sprintf(path, SEGMENT_DIR "/%08x", id);
+}
 
-    if (serv_sockfd<0){
-        //handle for unsuccessful connection to server
-        char httperr[50];
-        sprintf(httperr, "HTTP/1.0 404 Not Found");
-        bzero(buf, MAXBUF);
-        strcpy(buf, httperr);
-        write(connfd, buf, strlen(httperr));
-        return;
+/*open segment id, creating it if create is set. Returns NULL on failure*/
+static struct segment * segment_open(uint32_t id, int create){
+    char path[32];
+    struct stat st;
+    segment_path(id, path);
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDONLY, 0644);
+    if (fd < 0)
+        return NULL;
+    struct segment * seg = calloc(1, sizeof(struct segment));
+    fstat(fd, &st);
+    seg->id = id;
+    seg->fd = fd;
+    seg->tail = st.st_size;
+    //map as far as it may grow, appends show up in the mapping as they are written
+    seg->map_len = seg->tail > store.seg_size ? seg->tail : store.seg_size;
+    seg->map = mmap(NULL, seg->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (seg->map == MAP_FAILED) {
+        close(fd);
+        free(seg);
+        return NULL;
     }
+    atomic_init(&seg->refcnt, 1);
+    return seg;
+}
 
-    MD5_CTX c;
-    unsigned char out[MD5_DIGEST_LENGTH];
+/*drop a reference, the last one deletes the segment unless it is borrowed*/
+void segment_release(struct segment * seg){
+    char path[32];
+    if (atomic_fetch_sub(&seg->refcnt, 1) != 1)
+        return;
+    segment_path(seg->id, path);
+    if (!seg->borrowed)
+        unlink(path);
+    munmap(seg->map, seg->map_len);
+    close(seg->fd);
+    free(seg);
+}
 
-    MD5_Init(&c);
-    MD5_Update(&c, request_uri, strlen(request_uri));
-    MD5_Final(out, &c);
-    char md5string[33];
-    for(int i = 0; i < 16; ++i)
-        sprintf(&md5string[i*2], "%02x", (unsigned int)out[i]);
+/*
+ * segment_append - write an object to the end of the current segment,
+ * starting a new one when it is full. Appends only take the store lock to
+ * claim their range, the writes themselves go on side by side
+ * Returns the segment with a reference for the object and its offset in
+ * *off, or NULL if it could not be written
+ */
+struct segment * segment_append(char * data, size_t len, size_t * off){
+    pthread_mutex_lock(&store.lock);
+    struct segment * seg = store.current;
+    if (!seg || seg->tail + len > store.seg_size) {
+        seg = segment_open(store.next_id, 1);
+        if (!seg) {
+            log_msg(LOG_ERROR, "%s: %s", SEGMENT_DIR, strerror(errno));
+            pthread_mutex_unlock(&store.lock);
+            return NULL;
+        }
+        store.next_id++;
+        seg->next = store.segments;
+        store.segments = store.current = seg;
+    }
+    *off = seg->tail;
+    seg->tail += len;
+    atomic_fetch_add(&seg->refcnt, 1);
+    pthread_mutex_unlock(&store.lock);
 
-    char filename[] = "Cache/";
-    strcat(filename, md5string);
+    if (pwrite(seg->fd, data, len, *off) != (ssize_t)len) {
+        segment_release(seg);
+        return NULL;
+    }
+    atomic_store(&seg->dirty, 1);
+    return seg;
+}
 
-    struct web_cache * webptr = get_webcache(request_uri);
+/*the listed segment id for an index record, opened on first use. Startup only*/
+static struct segment * segment_find(uint32_t id){
+    struct segment * seg;
+    for (seg = store.segments; seg; seg = seg->next)
+        if (seg->id == id)
+            return seg;
+    if (!(seg = segment_open(id, 0)))
+        return NULL;
+    seg->next = store.segments;
+    store.segments = seg;
+    return seg;
+}
 
-    if( webptr ) { //webpage in cache
-        int bytes_read;
+/*
+ * segment_borrow - another worker process's segment id, opened the first
+ * time an entry is taken from it. One its owner deleted, and maybe numbered
+ * again after a restart, is let go and opened afresh
+ * Returns it with a reference for the entry if it holds end bytes by now,
+ * else NULL
+ */
+static struct segment * segment_borrow(uint32_t id, size_t end){
+    char path[32];
+    struct stat st, held;
+    struct segment * seg, ** link;
 
-        //send cached webpage
-        /*open file and determine its size*/
-        FILE * fp = fopen(filename, "r");
-        fseek(fp, 0, SEEK_END);
-        int size = ftell(fp);   //get size of file
-        fseek(fp, 0, SEEK_SET);
-        printf("sending the following CACHED response to client:\n");
-        while (size) {
-            bzero(response, sizeof(response));
-            bytes_read = fread(response, sizeof(char), sizeof(response), fp);
+    segment_path(id, path);
+    pthread_mutex_lock(&store.lock);
+    for (link = &store.borrowed; (seg = *link); link = &seg->next)
+        if (seg->id == id)
+            break;
+    if (seg && (stat(path, &st) < 0 || fstat(seg->fd, &held) < 0 || st.st_ino != held.st_ino)) {
+        *link = seg->next;
+        segment_release(seg);
+        seg = NULL;
+    }
+    if (!seg && (seg = segment_open(id, 0))) {
+        seg->borrowed = 1;
+        seg->next = store.borrowed;
+        store.borrowed = seg;
+    }
+    if (seg && (fstat(seg->fd, &st) < 0 || (size_t)st.st_size < end))
+        seg = NULL;
+    if (seg)
+        atomic_fetch_add(&seg->refcnt, 1);
+    pthread_mutex_unlock(&store.lock);
+    return seg;
+}
 
-            /*send buffer to server*/
-            send(connfd, response, bytes_read, 0);
-            printf("%s", response);
-            size -= bytes_read;
+/*let go of the borrowed segments no entry refers to any more*/
+static void segment_unborrow(void){
+    struct segment * seg, ** link = &store.borrowed;
+    pthread_mutex_lock(&store.lock);
+    while ((seg = *link)) {
+        if (atomic_load(&seg->refcnt) == 1) {
+            *link = seg->next;
+            segment_release(seg);
         }
+        else
+            link = &seg->next;
     }
+    pthread_mutex_unlock(&store.lock);
+}
 
-    else { //webpage not in cache
-        //send the modified http request to server
-        send(serv_sockfd, new_request, sizeof(new_request), 0);
-
-        //receive the reply
-        n = recv(serv_sockfd, response, sizeof(response), 0);
-        printf("sending the following response to client:\n");
-
-        //cache the webpage
-        FILE * fp = fopen(filename, "w");
-//        printf("Value of errno: %d\n ", errno);
+/*
+ * segment_recover - after the index is loaded, delete the segments no entry
+ * refers to and carry on numbering past the highest one. A worker process
+ * only looks at the segments it numbered, a single process at all of them
+ */
+static void segment_recover(void){
+    char path[32];
+    DIR * dir = opendir(SEGMENT_DIR);
+    struct dirent * d;
+    while (dir && (d = readdir(dir))) {
+        char * end;
+        uint32_t id = strtoul(d->d_name, &end, 16);
+        struct segment * seg;
+        int own = id >> SEGMENT_WORKER_SHIFT == (uint32_t)worker_index;
+        if (*end || end == d->d_name || (shared && !own))
+            continue;
+        for (seg = store.segments; seg && seg->id != id; seg = seg->next)
+            ;
+        if (!seg) {
+            segment_path(id, path);
+            unlink(path);
+        }
+        if (own && id >= store.next_id)
+            store.next_id = id + 1;
+    }
+    if (dir)
+        closedir(dir);
+}
 
-        while (n > 0) {
-            printf("%s", response);
-            fwrite(response, sizeof(char), n, fp);
-            send(connfd, response, n, 0); //sending it to client web browser
-            bzero(response, sizeof(response));
-            n = recv(serv_sockfd, response, sizeof(response), 0);
+/*
+ * segment_sync - flush the segments written since the last checkpoint, so
+ * a checkpoint never names objects that are not on disk
+ */
+static void segment_sync(void){
+    struct segment ** dirty = NULL;
+    size_t n = 0, cap = 0;
+    pthread_mutex_lock(&store.lock);
+    for (struct segment * seg = store.segments; seg; seg = seg->next) {
+        if (!atomic_exchange(&seg->dirty, 0))
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            dirty = realloc(dirty, cap * sizeof(struct segment *));
         }
-        fclose(fp);
-        clock_t start = clock();
-        addto_webcache(request_uri, start);
+        atomic_fetch_add(&seg->refcnt, 1);
+        dirty[n++] = seg;
+    }
+    pthread_mutex_unlock(&store.lock);
+    for (size_t i = 0; i < n; i++) {
+        fdatasync(dirty[i]->fd);
+        segment_release(dirty[i]);
     }
+    free(dirty);
+}
 
-//    printf("received the following response from end server:\n%s", response);
-    //close connection to server
-    close(serv_sockfd);
+/*an indexed copy of entry whose object was moved to seg_off in seg*/
+static struct web_cache * webcache_moved(struct web_cache * entry, struct segment * seg,
+                                         size_t seg_off){
+    struct web_cache * pair = calloc(1, sizeof(struct web_cache));
+    memcpy(pair->key, entry->key, MD5_DIGEST_LENGTH);
+    pair->status = entry->status;
+    pair->stored = entry->stored;
+    pair->fresh_until = entry->fresh_until;
+    pair->initial_age = entry->initial_age;
+    pair->etag = entry->etag ? strdup(entry->etag) : NULL;
+    pair->last_modified = entry->last_modified;
+    pair->size = entry->size;
+    pair->hdr = malloc(entry->hdr_len + 1);
+    memcpy(pair->hdr, entry->hdr, entry->hdr_len + 1);
+    pair->hdr_len = entry->hdr_len;
+    pair->body_off = entry->body_off;
+    pair->seg = seg;
+    pair->seg_off = seg_off;
+    atomic_init(&pair->refcnt, 1);
+    atomic_init(&pair->fd, -1);
+    return pair;
+}
 
-    //forward to client
-//    write(connfd, response, sizeof(response));
+/*
+ * segment_compact - take the sealed segment with the least of it still
+ * indexed, if under COMPACT_LIVE, off the list and copy its indexed objects
+ * to the current segment. The file goes once the last entry or reader
+ * holding it lets go
+ */
+static void segment_compact(void){
+    struct segment * victim = NULL, ** victim_link = NULL;
+    pthread_mutex_lock(&store.lock);
+    for (struct segment ** link = &store.segments; *link; link = &(*link)->next) {
+        struct segment * seg = *link;
+        double live = seg->tail ? (double)atomic_load(&seg->live) / seg->tail : 0;
+        if (seg != store.current && live < COMPACT_LIVE &&
+            (!victim || live < (double)atomic_load(&victim->live) / victim->tail)) {
+            victim = seg;
+            victim_link = link;
+        }
+    }
+    if (victim)
+        *victim_link = victim->next;
+    pthread_mutex_unlock(&store.lock);
+    if (!victim)
+        return;
 
+    //hold the entries still in it, then move them one by one
+    struct web_cache ** moving = NULL;
+    size_t n = 0, cap = 0;
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard * shard = &webCache[s];
+        pthread_rwlock_rdlock(&shard->rwlock);
+        for (size_t i = 0; i < shard->capacity; i++) {
+            struct web_cache * e = shard->slots[i];
+            if (!e || e == WEBCACHE_TOMBSTONE || e->seg != victim)
+                continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                moving = realloc(moving, cap * sizeof(struct web_cache *));
+            }
+            atomic_fetch_add(&e->refcnt, 1);
+            moving[n++] = e;
+        }
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct web_cache * e = moving[i];
+        size_t off;
+        struct segment * seg = segment_append(victim->map + e->seg_off, e->size, &off);
+        if (seg) {
+            //lost if e was replaced or dropped meanwhile
+            struct web_cache * pair = webcache_moved(e, seg, off);
+            if (webcache_insert(pair, e))
+                atomic_fetch_add(&store.moved_bytes, e->size);
+            else
+                release_webcache(pair);
+        }
+        release_webcache(e);
+    }
+    free(moving);
+    atomic_fetch_add(&store.compactions, 1);
+    segment_release(victim);
+}
 
+/*the cache key of a URI, md5 of it followed by suffix if there is one*/
+static void uri_digest(const char * uri, size_t len, const char * suffix, unsigned char * key){
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, uri, len);
+    if (suffix)
+        MD5_Update(&ctx, suffix, strlen(suffix));
+    MD5_Final(key, &ctx);
+}
 
+/*
+ * Cache/xx/yy/<md5> for a digest, fanned out over two directory levels.
+ * Worker processes past the first add .<owner>, so each one only ever
+ * writes, renames over and deletes its own files
+ */
+void webcache_filename(unsigned char * key, int owner, char * filename){
+    sprintf(filename, "Cache/%02x/%02x/", key[0], key[1]);
+    for(int i = 0; i < MD5_DIGEST_LENGTH; ++i)
+        sprintf(&filename[12 + i*2], "%02x", (unsigned int)key[i]);
+    if (owner > 0)
+        sprintf(&filename[12 + 2 * MD5_DIGEST_LENGTH], ".%d", owner);
+}
 
-    //close the connection to client
-    close(connfd);
+/*st is the file entry was stored in, not a later copy under the same name*/
+static int webcache_same_file(struct web_cache * entry, struct stat * st){
+    return (size_t)st->st_size == entry->size &&
+           (!entry->file_ino || (st->st_ino == entry->file_ino &&
+                                 st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec == entry->file_mtime));
 }
 
-/* 
- * open_listenfd - open and return a listening socket on port
- * Returns -1 in case of failure 
+/*
+ * webcache_open - descriptor for the entry's file, or its segment's. The
+ * first hit on a file opens it and parks it in the entry so later hits skip
+ * open(). If too many are parked already *owned is set and the caller
+ * closes it when done
  */
-int open_listenfd(int port) 
-{
-    int listenfd, optval=1;
-    struct sockaddr_in serveraddr;
-  
-    /* Create a socket descriptor */
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+int webcache_open(struct web_cache * entry, int * owned){
+    char filename[48];
+    int fd = atomic_load(&entry->fd);
+    *owned = 0;
+    if (entry->seg)
+        return entry->seg->fd;
+    if (fd >= 0)
+        return fd;
+    webcache_filename(entry->key, entry->borrowed ? entry->owner : worker_index, filename);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
         return -1;
-
-    /* Eliminates "Address already in use" error from bind. */
-    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
-                   (const void *)&optval , sizeof(int)) < 0)
+    //an entry restored from the index, or borrowed, may have lost its file to a newer copy
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !webcache_same_file(entry, &st)) {
+        close(fd);
         return -1;
+    }
+    if (atomic_fetch_add(&cache_fds, 1) < max_cache_fds) {
+        int expected = -1;
+        if (atomic_compare_exchange_strong(&entry->fd, &expected, fd))
+            return fd;
+        //another thread parked one first
+        close(fd);
+        atomic_fetch_sub(&cache_fds, 1);
+        return expected;
+    }
+    atomic_fetch_sub(&cache_fds, 1);
+    *owned = 1;
+    return fd;
+}
 
-    /* listenfd will be an endpoint for all requests to port
-       on any IP address for this host */
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET; 
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
-    serveraddr.sin_port = htons((unsigned short)port); 
-    if (bind(listenfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0)
-        return -1;
+/*
+ * webcache_map - map small objects once they are hot, objects in a segment
+ * are always sent from its mapping
+ * Returns NULL if the object should be sent with sendfile
+ */
+char * webcache_map(struct web_cache * entry, int fd){
+    if (entry->seg)
+        return entry->seg->map;
+    char * map = atomic_load(&entry->map);
+    if (map || entry->size == 0 || entry->size > MMAP_MAX_SIZE ||
+        atomic_load(&entry->hits) < MMAP_HOT_HITS)
+        return map;
+    map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char * expected = NULL;
+    if (atomic_compare_exchange_strong(&entry->map, &expected, map))
+        return map;
+    munmap(map, entry->size);
+    return expected;
+}
 
-    /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0)
-        return -1;
-    return listenfd;
-} /* end open_listenfd */
+static void shared_lock_init(pthread_mutex_t * lock){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
+static void shared_lock(pthread_mutex_t * lock){
+    //a worker died holding it, shared_forget clears what it was writing
+    if (pthread_mutex_lock(lock) == EOWNERDEAD)
+        pthread_mutex_consistent(lock);
+}
 
-/*signal handler (ctrl+c)*/
-void intHandler(int dummy) {
-    keep_running = 0;
-    printf("\nWEB SERVER SHUTDOWN\n");
-    exit(0);
+/*map the shared index, before the worker processes are forked*/
+struct shared_index * init_shared(void){
+    struct shared_index * s = mmap(NULL, sizeof(struct shared_index), PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED)
+        return NULL;
+    for (int i = 0; i < SHARED_SETS; i++)
+        shared_lock_init(&s->sets[i].lock);
+    for (int i = 0; i < SHARED_HOST_SETS; i++)
+        shared_lock_init(&s->hosts[i].lock);
+    return s;
 }
 
-/*IP caching function*/
-void addto_ipcache(char * hostname, char * ip){
-    pthread_rwlock_wrlock(&ipcache_start_rwlock);
-    struct ip_cache * pair = malloc(sizeof(struct ip_cache));
-    strcpy(pair->hostname, hostname);
-    strcpy(pair->ip, ip);
-    pair->next = ipCache_start;
-    pthread_rwlock_init(&(pair->rwlock), NULL);
-    ipCache_start = pair;
-    pthread_rwlock_unlock(&ipcache_start_rwlock);
+static struct shared_set * shared_set(unsigned char * key){
+    return &shared->sets[webcache_hash(key) % SHARED_SETS];
 }
 
-struct ip_cache * get_ipcache(char * hostname){
-    struct ip_cache * ptr = ipCache_start;
-    while (ptr){
-        if(pthread_rwlock_trywrlock(&(ptr->rwlock)) == 0) {
-            if (strcmp(hostname, ptr->hostname) == 0)
-                return ptr;
-            pthread_rwlock_unlock(&(ptr->rwlock));
-        }
-        ptr = ptr->next;
-    }
+/*the slot holding key in set, NULL if none does*/
+static struct shared_slot * shared_find(struct shared_set * set, unsigned char * key){
+    for (int i = 0; i < SHARED_WAYS; i++)
+        if (set->slots[i].owner && memcmp(set->slots[i].key, key, MD5_DIGEST_LENGTH) == 0)
+            return &set->slots[i];
     return NULL;
 }
 
-/*connect to server via IP*/
-int connect_via_ip(char * ip, int port){
-    if (!port)
-        port = 80;
+/*
+ * shared_publish - offer e to the other worker processes in place of any
+ * copy of its key, else of the entry going stale first. Called under e's
+ * shard lock so changes to one key are published in order
+ */
+static void shared_publish(struct web_cache * e){
+    if (!shared || e->borrowed || index_record_len(e) > SHARED_RECORD_MAX)
+        return;
+    time_t wall = time(NULL), mono = monotonic_now();
+    struct shared_set * set = shared_set(e->key);
+    shared_lock(&set->lock);
+    struct shared_slot * slot = shared_find(set, e->key);
+    for (int i = 0; !slot && i < SHARED_WAYS; i++)
+        if (!set->slots[i].owner)
+            slot = &set->slots[i];
+    if (!slot) {
+        slot = &set->slots[0];
+        for (int i = 1; i < SHARED_WAYS; i++)
+            if (set->slots[i].fresh_until < slot->fresh_until)
+                slot = &set->slots[i];
+    }
+    //free while it is written, in case we die halfway
+    slot->owner = 0;
+    slot->len = index_record_fill((char *)slot->record, INDEX_ADD, e, wall, mono);
+    slot->tag = (uintptr_t)e;
+    slot->fresh_until = wall + (e->fresh_until - mono);
+    memcpy(slot->key, e->key, MD5_DIGEST_LENGTH);
+    slot->owner = worker_index + 1;
+    pthread_mutex_unlock(&set->lock);
+    atomic_fetch_add(&cache_stats.published, 1);
+}
 
-    struct sockaddr_in serveraddr;
+/*shared_withdraw - e left this worker's index, take back the slot offering it*/
+static void shared_withdraw(struct web_cache * e){
+    if (!shared)
+        return;
+    struct shared_set * set = shared_set(e->key);
+    shared_lock(&set->lock);
+    struct shared_slot * slot = shared_find(set, e->key);
+    if (slot && slot->owner == (uint32_t)worker_index + 1 && slot->tag == (uintptr_t)e)
+        slot->owner = 0;
+    pthread_mutex_unlock(&set->lock);
+}
 
-    /* socket: create the socket */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("ERROR opening socket");
-        return -1;
+/*
+ * shared_import - an entry for key offered by another worker process. It
+ * shares that worker's file or segment, which stays the other's to delete
+ * Returns NULL if no other worker offers key or its object is gone
+ */
+static struct web_cache * shared_import(unsigned char * key){
+    uint64_t buf[SHARED_RECORD_MAX / 8];
+    struct index_record * r = (struct index_record *)buf;
+    struct segment * seg = NULL;
+    size_t len = 0;
+    int owner = 0;
+
+    if (!shared)
+        return NULL;
+    struct shared_set * set = shared_set(key);
+    shared_lock(&set->lock);
+    struct shared_slot * slot = shared_find(set, key);
+    if (slot && slot->owner != (uint32_t)worker_index + 1 && slot->len <= sizeof(buf)) {
+        len = slot->len;
+        owner = slot->owner - 1;
+        memcpy(buf, slot->record, len);
     }
+    pthread_mutex_unlock(&set->lock);
+    if (len < sizeof(*r) || r->op != INDEX_ADD || r->len != len ||
+        sizeof(*r) + r->etag_len + r->hdr_len + 2 > len)
+        return NULL;
+    if (r->segment && !(seg = segment_borrow(r->segment, r->seg_off + r->size)))
+        return NULL;
 
+    //the record is on the stack, the entry needs its own head
+    struct web_cache * pair = index_record_entry(calloc(1, sizeof(struct web_cache)), r, seg,
+                                                 time(NULL), monotonic_now());
+    pair->mapped = 0;
+    pair->borrowed = 1;
+    pair->owner = owner;
+    pair->etag = pair->etag ? strdup(pair->etag) : NULL;
+    char * hdr = malloc(pair->hdr_len + 1);
+    memcpy(hdr, pair->hdr, pair->hdr_len + 1);
+    pair->hdr = hdr;
+    return pair;
+}
 
-    /* build the server's Internet address */
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy(ip,
-          (char *)&serveraddr.sin_addr.s_addr, sizeof(ip));
-    serveraddr.sin_port = htons(port);
-
-    //connect to host server
-    int connected = connect(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
-    if (connected<0)
-        return -1;
-    else
-        return sockfd;
+/*
+ * shared_forget - worker process index died, drop what it offered. It comes
+ * back with what it journaled and offers that again
+ */
+void shared_forget(int index){
+    for (int i = 0; i < SHARED_SETS; i++) {
+        struct shared_set * set = &shared->sets[i];
+        shared_lock(&set->lock);
+        for (int j = 0; j < SHARED_WAYS; j++)
+            if (set->slots[j].owner == (uint32_t)index + 1)
+                set->slots[j].owner = 0;
+        pthread_mutex_unlock(&set->lock);
+    }
 }
 
-/*connect to server via name*/
-int connect_via_name(char * hostname, int port){
-    if (!port)
-        port = 80;
+static struct flight_bucket * flight_bucket(unsigned char * key){
+    return &flights[webcache_hash(key) % FLIGHT_BUCKETS];
+}
 
-    struct hostent * server;
-    struct sockaddr_in serveraddr;
+/*
+ * flight_join - make c the fetcher of its missing page, or park it on the
+ * fetch already under way
+ * Returns 1 if c fetches, 0 if it waits
+ */
+int flight_join(struct conn * c){
+    struct flight_bucket * bucket = flight_bucket(c->key);
+    struct flight * f;
+    pthread_mutex_lock(&bucket->lock);
+    for (f = bucket->chain; f; f = f->next)
+        if (memcmp(f->key, c->key, MD5_DIGEST_LENGTH) == 0)
+            break;
+    if (!f) {
+        f = calloc(1, sizeof(struct flight));
+        memcpy(f->key, c->key, MD5_DIGEST_LENGTH);
+        f->next = bucket->chain;
+        bucket->chain = f;
+        c->flight = f;
+        c->flight_fetcher = 1;
+        pthread_mutex_unlock(&bucket->lock);
+        return 1;
+    }
+    if (f->fill) {
+        //already downloading, read along right away
+        atomic_fetch_add(&f->fill->refcnt, 1);
+        c->tail = f->fill;
+        atomic_store(&c->flight_done, 1);
+        pthread_mutex_unlock(&bucket->lock);
+        return 0;
+    }
+    atomic_store(&c->flight_done, 0);
+    c->flight = f;
+    memcpy(c->flight_key, c->key, MD5_DIGEST_LENGTH);
+    c->flight_next = f->waiters;
+    f->waiters = c;
+    pthread_mutex_unlock(&bucket->lock);
+    return 0;
+}
 
-    /* socket: create the socket */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("ERROR opening socket");
-        exit(0);
+/*
+ * flight_publish - c's fill can be read along, hand it to everyone waiting
+ * on c's fetch and to whoever joins it from now on
+ */
+void flight_publish(struct conn * c){
+    if (!c->flight_fetcher)
+        return;
+    struct flight_bucket * bucket = flight_bucket(c->key);
+    struct flight * f = c->flight;
+    pthread_mutex_lock(&bucket->lock);
+    f->fill = c->fill;
+    atomic_fetch_add(&f->fill->refcnt, 1);
+    struct conn * w = f->waiters;
+    f->waiters = NULL;
+    while (w) {
+        struct conn * next = w->flight_next;
+        w->flight = NULL;
+        atomic_fetch_add(&f->fill->refcnt, 1);
+        w->tail = f->fill;
+        conn_wake(w, &w->flight_done);
+        w = next;
     }
+    pthread_mutex_unlock(&bucket->lock);
+}
 
-    /*gethostbyname*/
-    server = gethostbyname(hostname);
-    if (server == NULL) {
-        fprintf(stderr,"ERROR, no such host as %s\n", hostname);
-        //handle for bad hostname
-        return -1;
+/*
+ * flight_end - the fetch or variant f stands for is over, wake everyone
+ * waiting on it and free it. cached says whether its key is now in the cache
+ */
+static void flight_end(struct flight * f, int cached){
+    struct flight_bucket * bucket = flight_bucket(f->key);
+    struct flight ** pp;
+    pthread_mutex_lock(&bucket->lock);
+    for (pp = &bucket->chain; *pp != f; pp = &(*pp)->next)
+        ;
+    *pp = f->next;
+    struct conn * w = f->waiters;
+    while (w) {
+        struct conn * next = w->flight_next;
+        w->flight = NULL;
+        w->flight_cached = cached;
+        conn_wake(w, &w->flight_done);
+        w = next;
     }
-    addto_ipcache(hostname, server->h_addr);
+    pthread_mutex_unlock(&bucket->lock);
+    if (f->fill)
+        fill_release(f->fill);
+    free(f);
+}
 
-    /* build the server's Internet address */
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-          (char *)&serveraddr.sin_addr.s_addr, server->h_length);
-    serveraddr.sin_port = htons(port);
-
-    //connect to host server
-    int connected = connect(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
-    if (connected<0)
-        return -1;
-    else
-        return sockfd;
+/*
+ * flight_finish - c's fetch is over, wake everyone waiting on it. cached
+ * says whether the page is now in the cache. Does nothing unless c is a fetcher
+ */
+void flight_finish(struct conn * c, int cached){
+    if (!c->flight_fetcher)
+        return;
+    flight_end(c->flight, cached);
+    c->flight = NULL;
+    c->flight_fetcher = 0;
 }
 
-void parse_uri(char * uri, struct uri_info * server_info){
-    char temp[MAXLINE];
+/*a reader parked on a fill is closing, take it off*/
+void tail_cancel(struct conn * c){
+    struct conn ** pp;
+    pthread_mutex_lock(&c->tail->lock);
+    for (pp = &c->tail->readers; *pp && *pp != c; pp = &(*pp)->tail_next)
+        ;
+    if (*pp)
+        *pp = c->tail_next;
+    pthread_mutex_unlock(&c->tail->lock);
+}
 
-    //Extract the path to the resource
-    if(strstr(uri,"http://") != NULL)
-        sscanf( uri, "http://%[^/]%s", temp, server_info->path);
+/*a waiting c is closing, take it off the fetch or variant*/
+void flight_cancel(struct conn * c){
+    struct flight_bucket * bucket = flight_bucket(c->flight_key);
+    pthread_mutex_lock(&bucket->lock);
+    if (c->flight) {
+        struct conn ** pp = &c->flight->waiters;
+        while (*pp != c)
+            pp = &(*pp)->flight_next;
+        *pp = c->flight_next;
+        c->flight = NULL;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
 
-    else if(strstr(uri,"https://") != NULL)
-        sscanf( uri, "https://%[^/]%s", temp, server_info->path);
+void print_cache_stats(void){
+    static const char * policy_names[] = {"lru", "slru", "gdsf"};
+    unsigned long hits = atomic_load(&cache_stats.hits);
+    unsigned long misses = atomic_load(&cache_stats.misses);
+    printf("cache: %s, %zu of %zu bytes, %lu hits, %lu misses (%lu expired), hit ratio %.3f, "
+           "%lu coalesced (%lu tailed), %lu inserted, %lu rejected, %lu uncacheable, %lu revalidated, "
+           "%lu not modified, %lu retired, %lu evictions (%lu bytes), %lu gzipped, %lu gunzipped, "
+           "%lu ranges\n",
+           policy_names[cache_policy.kind], cache_policy.bytes, cache_policy.capacity,
+           hits, misses, atomic_load(&cache_stats.expired),
+           hits + misses ? (double)hits / (hits + misses) : 0.0,
+           atomic_load(&cache_stats.coalesced), atomic_load(&cache_stats.tailed),
+           atomic_load(&cache_stats.insertions), atomic_load(&cache_stats.rejected),
+           atomic_load(&cache_stats.uncacheable), atomic_load(&cache_stats.revalidated),
+           atomic_load(&cache_stats.not_modified), atomic_load(&cache_stats.retired),
+           atomic_load(&cache_stats.evictions), atomic_load(&cache_stats.evicted_bytes),
+           atomic_load(&cache_stats.gzipped), atomic_load(&cache_stats.gunzipped),
+           atomic_load(&cache_stats.ranges));
 
-    else
-        sscanf( uri, "%[^/]%s", temp, server_info->path);
+    size_t segments = 0, live = 0, appended = 0;
+    pthread_mutex_lock(&store.lock);
+    for (struct segment * seg = store.segments; seg; seg = seg->next) {
+        segments++;
+        live += atomic_load(&seg->live);
+        appended += seg->tail;
+    }
+    pthread_mutex_unlock(&store.lock);
+    printf("segments: %zu, %zu of %zu bytes live, %lu compactions (%lu bytes moved)\n",
+           segments, live, appended, atomic_load(&store.compactions), atomic_load(&store.moved_bytes));
+}
 
+void print_shared_stats(void){
+    if (!shared)
+        return;
+    printf("shared: worker %d of %d, %lu entries published, %lu borrowed, %lu dns answers taken\n",
+           worker_index, worker_processes, atomic_load(&cache_stats.published),
+           atomic_load(&cache_stats.borrowed), atomic_load(&resolver.shared_hits));
+}
 
+static uint64_t blacklist_hash(const char * s, size_t len, uint64_t h){
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+    return h;
+}
 
-    //Extract the port number and the hostname
-    if( strstr(temp, ":") != NULL)
-        sscanf(temp,"%[^:]:%d", server_info->host, &server_info->port);
-    else {
-        strcpy(server_info->host,temp);
-        server_info->port = 0;
+static size_t pow2_at_least(size_t n){
+    size_t cap = 16;
+    while (cap < n)
+        cap *= 2;
+    return cap;
+}
+
+/*slot holding host in the exact set, or the empty slot it would go in*/
+static uint32_t * blacklist_host_slot(struct blacklist * bl, const char * host){
+    size_t mask = bl->hosts_cap - 1;
+    size_t i = blacklist_hash(host, strlen(host), BLACKLIST_FNV) & mask;
+    while (bl->hosts[i] && strcmp(bl->arena + bl->hosts[i] - 1, host) != 0)
+        i = (i + 1) & mask;
+    return &bl->hosts[i];
+}
+
+/*slot holding the trie edge from parent by label, or the empty slot it would go in*/
+static uint32_t * blacklist_edge_slot(struct blacklist * bl, uint32_t parent,
+                                      const char * label, size_t len){
+    size_t mask = bl->edges_cap - 1;
+    size_t i = blacklist_hash(label, len, BLACKLIST_FNV ^ (parent * 0x9e3779b97f4a7c15ULL)) & mask;
+    while (bl->edges[i]) {
+        struct blacklist_node * node = &bl->nodes[bl->edges[i]];
+        if (node->parent == parent && node->label_len == len &&
+            memcmp(bl->arena + node->label, label, len) == 0)
+            break;
+        i = (i + 1) & mask;
     }
+    return &bl->edges[i];
+}
 
-    // incase the path to resource is empty
-    if(!server_info->path[0])
-        strcpy(server_info->path,"/");
+/*
+ * blacklist_entry - reduce a blacklist.txt line to a lowercase host.
+ * "http://" and any path or port are dropped, a leading "." blocks the domain
+ * and every subdomain, "*." only the subdomains
+ * Returns the rule kind, or -1 for blank and comment lines
+ */
+static int blacklist_entry(char * line, char * host, size_t size){
+    int kind = BLACKLIST_EXACT;
+    size_t len = 0;
+    line += strspn(line, " \t");
+    if (strncasecmp(line, "http://", 7) == 0)
+        line += 7;
+    else if (strncasecmp(line, "https://", 8) == 0)
+        line += 8;
+    if (strncmp(line, "*.", 2) == 0) {
+        kind = BLACKLIST_WILDCARD;
+        line += 2;
+    }
+    else if (line[0] == '.') {
+        kind = BLACKLIST_SUFFIX;
+        line++;
+    }
+    while (line[len] && !strchr(" \t\r\n/:#", line[len]) && len < size - 1) {
+        host[len] = line[len] | 0x20 * (line[len] >= 'A' && line[len] <= 'Z');
+        len++;
+    }
+    while (len && host[len - 1] == '.')
+        len--;
+    host[len] = 0;
+    return len ? kind : -1;
 }
 
-/*parse addition request hdr info from clinet after first line*/
-void parse_hdr_info(char * hdr_line, char * data, int * host_provided){
-    if(!strcmp(hdr_line, "\r\n"))
-        return;
+/*walk the trie down the reversed labels of domain, adding missing nodes*/
+static void blacklist_add_rule(struct blacklist * bl, uint32_t off, int kind){
+    char * domain = bl->arena + off;
+    char * end = domain + strlen(domain);
+    uint32_t node = 0;
+    while (end > domain) {
+        char * start = end;
+        while (start > domain && start[-1] != '.')
+            start--;
+        uint32_t * slot = blacklist_edge_slot(bl, node, start, end - start);
+        if (!*slot) {
+            struct blacklist_node * child = &bl->nodes[bl->nnodes];
+            child->parent = node;
+            child->label = start - bl->arena;
+            child->label_len = end - start;
+            child->flags = 0;
+            *slot = bl->nnodes++;
+        }
+        node = *slot;
+        end = start > domain ? start - 1 : domain;
+    }
+    bl->nodes[node].flags |= kind == BLACKLIST_SUFFIX ? BLACKLIST_NODE_SUFFIX : BLACKLIST_NODE_WILDCARD;
+}
 
-    if(strstr(hdr_line, "User-Agent:"))
-        return;
+/*
+ * load_blacklist - compile path into a new blacklist, an empty one if the
+ * file cannot be read
+ */
+struct blacklist * load_blacklist(char * path){
+    struct blacklist * bl = calloc(1, sizeof(struct blacklist));
+    struct { uint32_t off; int kind; } * rules = NULL;
+    size_t nrules = 0, rules_cap = 0, nexact = 0, nlabels = 0;
+    char * line = NULL, host[256];
+    size_t line_cap = 0;
 
-    if(strstr(hdr_line, "Accept:"))
-        return;
+    //read every rule into the arena first, so the tables can be sized once
+    FILE * fp = fopen(path, "r");
+    while (fp && getline(&line, &line_cap, fp) >= 0) {
+        int kind = blacklist_entry(line, host, sizeof(host));
+        if (kind < 0)
+            continue;
+        size_t len = strlen(host) + 1;
+        if (bl->arena_len + len > bl->arena_cap) {
+            bl->arena_cap = pow2_at_least(2 * (bl->arena_len + len));
+            bl->arena = realloc(bl->arena, bl->arena_cap);
+        }
+        if (nrules == rules_cap) {
+            rules_cap = rules_cap ? rules_cap * 2 : 64;
+            rules = realloc(rules, rules_cap * sizeof(*rules));
+        }
+        //offsets start at 1 so 0 can mark an empty slot
+        if (!bl->arena_len)
+            bl->arena_len = 1;
+        memcpy(bl->arena + bl->arena_len, host, len);
+        rules[nrules].off = bl->arena_len;
+        rules[nrules++].kind = kind;
+        bl->arena_len += len;
+        if (kind == BLACKLIST_EXACT)
+            nexact += 2;
+        else {
+            nlabels++;
+            for (char * p = host; *p; p++)
+                nlabels += *p == '.';
+        }
+    }
+    if (fp)
+        fclose(fp);
+    free(line);
 
-    if(strstr(hdr_line, "Accept-Encoding:"))
-        return;
+    bl->hosts_cap = pow2_at_least(2 * nexact);
+    bl->hosts = calloc(bl->hosts_cap, sizeof(uint32_t));
+    bl->edges_cap = pow2_at_least(2 * nlabels);
+    bl->edges = calloc(bl->edges_cap, sizeof(uint32_t));
+    bl->nodes = calloc(nlabels + 1, sizeof(struct blacklist_node));
+    bl->nnodes = 1;
+    for (size_t i = 0; i < nrules; i++) {
+        char * name = bl->arena + rules[i].off;
+        if (rules[i].kind != BLACKLIST_EXACT) {
+            blacklist_add_rule(bl, rules[i].off, rules[i].kind);
+            bl->nrules++;
+            continue;
+        }
+        //a www. entry also blocks the bare domain, as it always has
+        for (int www = 0; www < 1 + (strncmp(name, "www.", 4) == 0 && name[4]); www++) {
+            uint32_t * slot = blacklist_host_slot(bl, name + 4 * www);
+            if (!*slot) {
+                *slot = rules[i].off + 4 * www + 1;
+                bl->nhosts++;
+            }
+        }
+    }
+    free(rules);
+    return bl;
+}
 
-    if(strstr(hdr_line, "Connection:"))
+void free_blacklist(struct blacklist * bl){
+    if (!bl)
         return;
+    free(bl->arena);
+    free(bl->hosts);
+    free(bl->edges);
+    free(bl->nodes);
+    free(bl);
+}
 
-    if(strstr(hdr_line, "Proxy-Connection:"))
-        return;
+/*lookup in a compiled blacklist, touches nothing but bl*/
+static int blacklist_match(struct blacklist * bl, char * hostname){
+    char host[256];
+    size_t len = 0;
+    while (hostname[len] && len < sizeof(host) - 1) {
+        host[len] = hostname[len] | 0x20 * (hostname[len] >= 'A' && hostname[len] <= 'Z');
+        len++;
+    }
+    while (len && host[len - 1] == '.')
+        len--;
+    host[len] = 0;
 
-    if(strstr(hdr_line, "Host:")) {
-        sprintf(data, "%s%s\r\n", data, hdr_line);
-        * host_provided = 1;
-        return;
+    if (bl->nhosts && *blacklist_host_slot(bl, host))
+        return 1;
+    if (!bl->nrules)
+        return 0;
+    char * end = host + len;
+    uint32_t node = 0;
+    while (end > host) {
+        char * start = end;
+        while (start > host && start[-1] != '.')
+            start--;
+        node = *blacklist_edge_slot(bl, node, start, end - start);
+        if (!node)
+            return 0;
+        if ((bl->nodes[node].flags & BLACKLIST_NODE_SUFFIX) ||
+            ((bl->nodes[node].flags & BLACKLIST_NODE_WILDCARD) && start > host))
+            return 1;
+        end = start > host ? start - 1 : host;
     }
+    return 0;
+}
 
-    sprintf(data, "%s%s\r\n", data, hdr_line);
+/*
+ * blacklist_enter - take the current blacklist until blacklist_exit. The
+ * reader counts itself in the current phase before it loads the pointer, so
+ * the watcher knows when nobody can still be reading a replaced copy
+ */
+static struct blacklist * blacklist_enter(int * phase){
+    *phase = atomic_load(&blacklist_phase);
+    atomic_fetch_add(&blacklist_readers[*phase], 1);
+    return atomic_load(&blacklist_current);
 }
 
-/*adds uri to linked list*/
-void addto_webcache(char * uri, clock_t tickstart){
-    pthread_rwlock_wrlock(&webcache_start_rwlock);
-    struct web_cache * pair = malloc(sizeof(struct web_cache));
-    strcpy(pair->uri, uri);
-    pair->tick_start = tickstart;
-    pair->next = webCache_start;
-    pthread_rwlock_init(&(pair->rwlock), NULL);
-    webCache_start = pair;
-    pthread_rwlock_unlock(&webcache_start_rwlock);
+static void blacklist_exit(int phase){
+    atomic_fetch_sub(&blacklist_readers[phase], 1);
 }
 
-struct web_cache * get_webcache(char * uri){
-    struct web_cache * ptr = webCache_start;
-    clock_t diff;
-    while (ptr){
-        if(pthread_rwlock_trywrlock(&(ptr->rwlock)) == 0) {
-            diff = clock() - ptr->tick_start;
-            diff = diff/CLOCKS_PER_SEC;
-            if (strcmp(uri, ptr->uri) == 0 && diff<timeout)
-                return ptr;
-            pthread_rwlock_unlock(&(ptr->rwlock));
-        }
-        ptr = ptr->next;
-    }
-    return NULL;
+int check_blacklisted(char * hostname){
+    int phase;
+    int blocked = blacklist_match(blacklist_enter(&phase), hostname);
+    blacklist_exit(phase);
+    if (!blocked)
+        return 0;
+    atomic_fetch_add(&blacklist_blocked, 1);
+    return 1;
 }
 
-void parse_blacklisted_host(char * blacklist_uri, char * answer){
-    char temp[100];
+void init_blacklist(char * path){
+    pthread_t tid;
+    blacklist_path = path;
+    struct blacklist * bl = load_blacklist(path);
+    atomic_store(&blacklist_current, bl);
+    log_msg(LOG_INFO, "blacklist: %zu hosts, %zu domain rules from %s", bl->nhosts, bl->nrules, path);
+    pthread_create(&tid, NULL, blacklist_watcher, NULL);
+    pthread_detach(tid);
+}
 
-    //Extract the path to the resource
-    if(strstr(blacklist_uri,"www.") != NULL)
-        sscanf( blacklist_uri, "www.%s", temp);
+/*
+ * blacklist_synchronize - wait until no lookup can hold a copy replaced
+ * before the call. Each phase is flipped away from and then drained: no new
+ * lookup joins a phase that is not current, and one that read the phase
+ * before a flip but counted itself after loads the new pointer. Flipping
+ * twice also drains a lookup left over from the last reload that stalled
+ * between reading the phase and counting itself
+ */
+static void blacklist_synchronize(void){
+    for (int i = 0; i < 2; i++) {
+        int phase = atomic_load(&blacklist_phase);
+        atomic_store(&blacklist_phase, !phase);
+        while (atomic_load(&blacklist_readers[phase]))
+            usleep(1000);
+    }
+}
 
-    else if(strstr(blacklist_uri,"http://") != NULL)
-        sscanf( blacklist_uri, "http://%s", temp);
+/*
+ * reloads the blacklist when its file changes or on SIGHUP. The replaced copy
+ * is freed once blacklist_synchronize says no lookup is still in it
+ */
+void * blacklist_watcher(void * vargp)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char dir[PATH_MAX] = ".";
+    char * base = strrchr(blacklist_path, '/');
+    int pending = 0;
 
+    //watch the directory, editors often replace the file with a rename
+    if (base) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - blacklist_path), blacklist_path);
+        if (!dir[0])
+            strcpy(dir, "/");
+        base++;
+    }
     else
-        sscanf( blacklist_uri, "%s", temp);
+        base = blacklist_path;
+    int fd = inotify_init1(IN_NONBLOCK);
+    if (fd >= 0 && inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                              IN_CREATE | IN_DELETE) < 0) {
+        close(fd);
+        fd = -1;
+    }
 
-    strcpy(answer, temp);
-}
+    while (keep_running) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, fd >= 0, 1000) > 0) {
+            ssize_t n;
+            while ((n = read(fd, events, sizeof(events))) > 0)
+                for (char * p = events; p < events + n; ) {
+                    struct inotify_event * ev = (struct inotify_event *)p;
+                    if (ev->len && strcmp(ev->name, base) == 0)
+                        pending = 1;
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+        }
+        if (atomic_exchange(&blacklist_reload, 0))
+            pending = 1;
 
-int check_blacklisted(char * hostname){
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t n;
-    char blacklist_host[100];
-    pthread_rwlock_rdlock(&blacklist_rwlock);
-    FILE * fp = fopen("blacklist.txt", "r");
-    n = getline(&line, &len, fp);
-    while (n >= 0){
-        parse_blacklisted_host(line, blacklist_host);
-        blacklist_host[strcspn(blacklist_host, "\n")] = 0; //remove trailing newline
-        if (strcmp(blacklist_host, hostname) == 0){
-            pthread_rwlock_unlock(&blacklist_rwlock);
-            return 1;
+        if (pending) {
+            struct blacklist * bl = load_blacklist(blacklist_path);
+            struct blacklist * retired = atomic_exchange(&blacklist_current, bl);
+            blacklist_synchronize();
+            free_blacklist(retired);
+            pending = 0;
+            atomic_fetch_add(&blacklist_reloads, 1);
+            log_msg(LOG_INFO, "blacklist: reloaded %zu hosts, %zu domain rules", bl->nhosts, bl->nrules);
         }
-        n = getline(&line, &len, fp);
     }
-    pthread_rwlock_unlock(&blacklist_rwlock);
-    return 0;
+    return NULL;
 }
 
+void print_blacklist_stats(void){
+    int phase;
+    struct blacklist * bl = blacklist_enter(&phase);
+    printf("blacklist: %zu hosts, %zu domain rules, %lu blocked, %lu reloads\n",
+           bl ? bl->nhosts : 0, bl ? bl->nrules : 0,
+           atomic_load(&blacklist_blocked), atomic_load(&blacklist_reloads));
+    blacklist_exit(phase);
+}